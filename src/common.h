@@ -13,4 +13,15 @@ enum class InputDeviceType : uint8_t {
     TOUCHPAD,
 };
 
+// input-grabber、input-emitter 与 daemon 之间共享内存队列中的输入事件
+struct InputRingEvent {
+    uint32_t device;    // 设备序号，仅 input-grabber 使用
+    uint8_t deviceType; // InputDeviceType，仅 input-grabber 使用
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+    int64_t timestamp;  // 帧的内核时间戳，CLOCK_MONOTONIC 纳秒，未知时为 0
+    int64_t sendTime;   // 写入队列的时刻，CLOCK_MONOTONIC 纳秒
+};
+
 #endif // !COMMON_H
@@ -4,30 +4,178 @@
 
 #include "DisplayBase.h"
 
+#include <algorithm>
+#include <cmath>
+
 #include "Manager.h"
+#include "utils/latency.h"
 #include "protocol/device_sharing.pb.h"
 
+// 预计在这段时间内到达边缘时通知对端，应大于网络的往返时间，单位毫秒
+static constexpr double predictLeadTime = 100;
+// 低于这个速度（像素/毫秒）不预测，避免在边缘附近慢慢移动时误报
+static constexpr double predictMinSpeed = 0.5;
+// 两次移动间隔超过这个时间（毫秒）时重新计算速度
+static constexpr double predictResetInterval = 100;
+// 本机鼠标停止移动超过这个时间（纳秒）后，对端即将流转过来时才预先移动光标
+static constexpr int64_t pointerIdleTime = 1000000000;
+
+static bool isHorizontal(uint16_t direction) {
+    return direction == FLOW_DIRECTION_LEFT || direction == FLOW_DIRECTION_RIGHT;
+}
+
 DisplayBase::DisplayBase(Manager *manager)
     : m_manager(manager)
-    , m_startEdgeDetection(false) {
+    , m_screenWidth(0)
+    , m_screenHeight(0)
+    , m_startEdgeDetection(false)
+    , m_lastX(0)
+    , m_lastY(0)
+    , m_predictX(0)
+    , m_predictY(0)
+    , m_predictTime(0)
+    , m_velocityX(0)
+    , m_velocityY(0)
+    , m_preparedDirection(-1)
+    , m_lastLocalMotion(0) {
+}
+
+void DisplayBase::startEdgeDetection() {
+    if (!m_startEdgeDetection) {
+        m_startEdgeDetection = true;
+        updateEdges();
+    }
+}
+
+void DisplayBase::stopEdgeDetection() {
+    if (m_startEdgeDetection) {
+        m_startEdgeDetection = false;
+        updateEdges();
+    }
+}
+
+uint8_t DisplayBase::flowEdges() const {
+    return m_manager->flowEdges();
+}
+
+bool DisplayBase::predictiveFlow() const {
+    return m_manager->isPredictiveFlow();
+}
+
+bool DisplayBase::pointerIdle() const {
+    return Latency::now() - m_lastLocalMotion > pointerIdleTime;
 }
 
 void DisplayBase::handleScreenSizeChange(int16_t w, int16_t h) {
     m_screenWidth = w;
     m_screenHeight = h;
+    buildEdges();
+}
+
+void DisplayBase::handleMonitorsChange(const std::vector<Monitor> &monitors) {
+    m_monitors = monitors;
+    buildEdges();
+}
+
+void DisplayBase::buildEdges() {
+    std::vector<Monitor> monitors = m_monitors;
+    if (monitors.empty()) {
+        monitors.push_back({0, 0, m_screenWidth, m_screenHeight});
+    }
+
+    for (uint16_t direction = 0; direction < m_edges.size(); direction++) {
+        m_edges[direction].assign(isHorizontal(direction) ? m_screenHeight : m_screenWidth, -1);
+    }
+
+    // 每一行取最左和最右的显示器边缘，每一列取最上和最下的显示器边缘
+    for (const auto &m : monitors) {
+        int left = std::max<int>(m.x, 0);
+        int right = std::min<int>(m.x + m.width, m_screenWidth) - 1;
+        int top = std::max<int>(m.y, 0);
+        int bottom = std::min<int>(m.y + m.height, m_screenHeight) - 1;
+        if (left > right || top > bottom) {
+            continue;
+        }
+
+        for (int y = top; y <= bottom; y++) {
+            int16_t &l = m_edges[FLOW_DIRECTION_LEFT][y];
+            int16_t &r = m_edges[FLOW_DIRECTION_RIGHT][y];
+            if (l == -1 || left < l) {
+                l = left;
+            }
+            if (r == -1 || right > r) {
+                r = right;
+            }
+        }
+
+        for (int x = left; x <= right; x++) {
+            int16_t &t = m_edges[FLOW_DIRECTION_TOP][x];
+            int16_t &b = m_edges[FLOW_DIRECTION_BOTTOM][x];
+            if (t == -1 || top < t) {
+                t = top;
+            }
+            if (b == -1 || bottom > b) {
+                b = bottom;
+            }
+        }
+    }
+
+    // 把坐标相同的连续位置合并为一段
+    for (uint16_t direction = 0; direction < m_edges.size(); direction++) {
+        const auto &edge = m_edges[direction];
+        auto &segments = m_segments[direction];
+        segments.clear();
+
+        for (size_t i = 0; i < edge.size(); i++) {
+            if (edge[i] == -1) {
+                continue;
+            }
+
+            if (!segments.empty() && segments.back().pos == edge[i] &&
+                segments.back().end == static_cast<int16_t>(i) - 1) {
+                segments.back().end = i;
+            } else {
+                segments.push_back({edge[i], static_cast<int16_t>(i), static_cast<int16_t>(i)});
+            }
+        }
+    }
+}
+
+bool DisplayBase::atEdge(uint16_t direction, int16_t x, int16_t y) const {
+    const auto &edge = m_edges[direction];
+    int16_t along = isHorizontal(direction) ? y : x;
+    int16_t across = isHorizontal(direction) ? x : y;
+    return along >= 0 && static_cast<size_t>(along) < edge.size() && edge[along] == across;
+}
+
+double DisplayBase::edgePosition(uint16_t direction, double along) const {
+    const auto &segments = m_segments[direction];
+    if (segments.empty()) {
+        return 0;
+    }
+
+    int16_t start = segments.front().start;
+    int16_t end = segments.back().end;
+    if (end <= start) {
+        return 0;
+    }
+
+    return std::clamp((along - start) / (end - start), 0.0, 1.0);
 }
 
 void DisplayBase::handleMotion(int16_t x, int16_t y, bool evFromPeer) {
+    predictFlow(x, y, evFromPeer);
+
     do {
         if (m_lastX == x) {
-            if (x == 0) {
+            if (atEdge(FLOW_DIRECTION_LEFT, x, y)) {
                 // left flow
                 qInfo("left flow");
                 flowOut(FLOW_DIRECTION_LEFT, 0, y, evFromPeer);
                 break;
             }
 
-            if (x == m_screenWidth - 1) {
+            if (atEdge(FLOW_DIRECTION_RIGHT, x, y)) {
                 // right flow
                 qInfo("right flow");
                 flowOut(FLOW_DIRECTION_RIGHT, 0, y, evFromPeer);
@@ -36,14 +184,14 @@ void DisplayBase::handleMotion(int16_t x, int16_t y, bool evFromPeer) {
         }
 
         if (m_lastY == y) {
-            if (y == 0) {
+            if (atEdge(FLOW_DIRECTION_TOP, x, y)) {
                 // top flow
                 qInfo("top flow");
                 flowOut(FLOW_DIRECTION_TOP, x, 0, evFromPeer);
                 break;
             }
 
-            if (y == m_screenHeight - 1) {
+            if (atEdge(FLOW_DIRECTION_BOTTOM, x, y)) {
                 // bottom flow
                 qInfo("bottom flow");
                 flowOut(FLOW_DIRECTION_BOTTOM, x, 0, evFromPeer);
@@ -56,23 +204,168 @@ void DisplayBase::handleMotion(int16_t x, int16_t y, bool evFromPeer) {
     m_lastY = y;
 }
 
-void DisplayBase::flowBack(uint16_t direction, uint16_t x, uint16_t y) {
-    switch (direction) {
-    case 3: {
-        // left
-        x = m_screenWidth;
+void DisplayBase::predictFlow(int16_t x, int16_t y, bool evFromPeer) {
+    int64_t now = Latency::now();
+    if (!evFromPeer) {
+        m_lastLocalMotion = now;
+    }
+
+    if (!predictiveFlow()) {
+        return;
+    }
+
+    double dt = (now - m_predictTime) / 1e6;
+    if (m_predictTime != 0 && dt > 0 && dt < predictResetInterval) {
+        m_velocityX = m_velocityX / 2 + (x - m_predictX) / dt / 2;
+        m_velocityY = m_velocityY / 2 + (y - m_predictY) / dt / 2;
+    } else {
+        m_velocityX = 0;
+        m_velocityY = 0;
+    }
+    m_predictX = x;
+    m_predictY = y;
+    m_predictTime = now;
+
+    int predicted = -1;
+    double predictedAlong = 0;
+    uint8_t edges = flowEdges();
+    for (uint16_t direction = 0; direction < m_edges.size(); direction++) {
+        if (!(edges & (1 << direction))) {
+            continue;
+        }
+
+        bool horizontal = isHorizontal(direction);
+        int16_t along = horizontal ? y : x;
+        if (along < 0 || static_cast<size_t>(along) >= m_edges[direction].size() ||
+            m_edges[direction][along] == -1) {
+            continue;
+        }
+
+        // 朝向边缘的速度和到边缘的距离
+        int16_t edge = m_edges[direction][along];
+        double speed, distance;
+        switch (direction) {
+        case FLOW_DIRECTION_LEFT:
+            speed = -m_velocityX;
+            distance = x - edge;
+            break;
+        case FLOW_DIRECTION_RIGHT:
+            speed = m_velocityX;
+            distance = edge - x;
+            break;
+        case FLOW_DIRECTION_TOP:
+            speed = -m_velocityY;
+            distance = y - edge;
+            break;
+        default:
+            speed = m_velocityY;
+            distance = edge - y;
+            break;
+        }
+
+        if (speed < predictMinSpeed || distance < 0 || distance / speed > predictLeadTime) {
+            continue;
+        }
+
+        // 按当前速度估计到达边缘时沿边缘方向的位置
+        double t = distance / speed;
+        predictedAlong = along + (horizontal ? m_velocityY : m_velocityX) * t;
+        predicted = direction;
         break;
     }
+
+    // 每次接近边缘只通知一次，离开后再接近时重新通知
+    if (predicted != m_preparedDirection) {
+        m_preparedDirection = predicted;
+        if (predicted != -1) {
+            m_manager->prepareFlow(predicted, edgePosition(predicted, predictedAlong), evFromPeer);
+        }
+    }
+}
+
+void DisplayBase::handleEdgeHit(uint16_t direction, int16_t x, int16_t y, bool evFromPeer) {
+    switch (direction) {
+    case FLOW_DIRECTION_LEFT:
+    case FLOW_DIRECTION_RIGHT:
+        qInfo("%s flow", direction == FLOW_DIRECTION_LEFT ? "left" : "right");
+        flowOut(direction, 0, y, evFromPeer);
+        break;
+    case FLOW_DIRECTION_TOP:
+    case FLOW_DIRECTION_BOTTOM:
+        qInfo("%s flow", direction == FLOW_DIRECTION_TOP ? "top" : "bottom");
+        flowOut(direction, x, 0, evFromPeer);
+        break;
     }
+}
+
+void DisplayBase::flowBack(uint16_t direction,
+                           uint16_t x,
+                           uint16_t y,
+                           std::optional<double> position) {
+    entryPoint(direction, x, y, position);
 
+    m_preparedDirection = -1;
     moveMouse(x, y);
     hideMouse(false);
     startEdgeDetection();
 }
 
+void DisplayBase::prepareFlowBack(uint16_t direction, double position) {
+    uint16_t x = 0;
+    uint16_t y = 0;
+    entryPoint(direction, x, y, position);
+    moveMouse(x, y);
+}
+
+void DisplayBase::entryPoint(uint16_t direction,
+                             uint16_t &x,
+                             uint16_t &y,
+                             std::optional<double> position) const {
+    // 对端从某个方向流出，鼠标从本机相反方向的边缘进入
+    uint16_t entry = (direction + 2) % m_segments.size();
+    const auto &segments = m_segments[entry];
+
+    if (!segments.empty()) {
+        int16_t start = segments.front().start;
+        int16_t end = segments.back().end;
+
+        int along;
+        if (position) {
+            along = start + std::lround(std::clamp(*position, 0.0, 1.0) * (end - start));
+        } else {
+            // 旧版本的对端只发送坐标
+            along = std::clamp<int>(isHorizontal(entry) ? y : x, start, end);
+        }
+
+        // 落在显示器之间的空隙时取最近的一段
+        const EdgeSegment *nearest = &segments.front();
+        int distance = INT32_MAX;
+        for (const auto &segment : segments) {
+            int d = along < segment.start ? segment.start - along
+                  : along > segment.end   ? along - segment.end
+                                          : 0;
+            if (d < distance) {
+                distance = d;
+                nearest = &segment;
+            }
+        }
+        along = std::clamp<int>(along, nearest->start, nearest->end);
+
+        if (isHorizontal(entry)) {
+            x = nearest->pos;
+            y = along;
+        } else {
+            x = along;
+            y = nearest->pos;
+        }
+    }
+}
+
 void DisplayBase::flowOut(uint16_t direction, uint16_t x, uint16_t y, bool evFromPeer) {
-    bool r = m_manager->tryFlowOut(direction, x, y, evFromPeer);
+    double position = edgePosition(direction, isHorizontal(direction) ? y : x);
+    bool r = m_manager->tryFlowOut(direction, x, y, position, evFromPeer);
     if (r) {
+        m_preparedDirection = -1;
         // stopEdgeDetection();
         hideMouse(true);
     }
@@ -5,6 +5,8 @@
 #ifndef DISPLAYBASE_H
 #define DISPLAYBASE_H
 
+#include <array>
+#include <optional>
 #include <vector>
 
 #include <cstdint>
@@ -13,33 +15,91 @@ class Manager;
 
 class DisplayBase {
 public:
+    // 一个显示器在根窗口中的区域
+    struct Monitor {
+        int16_t x;
+        int16_t y;
+        uint16_t width;
+        uint16_t height;
+    };
+
+    // 某个方向上最外侧边缘中坐标相同的一段。
+    // pos 为边缘像素在垂直于边缘方向上的坐标，[start, end] 为沿边缘方向的范围
+    struct EdgeSegment {
+        int16_t pos;
+        int16_t start;
+        int16_t end;
+    };
+
     explicit DisplayBase(Manager *manager);
     virtual ~DisplayBase() = default;
 
-    void flowBack(uint16_t direction, uint16_t x, uint16_t y);
-    void startEdgeDetection() { m_startEdgeDetection = true; };
-    void stopEdgeDetection() { m_startEdgeDetection = false; };
+    // position 为对端流出时在其边缘上的相对位置，旧版本的对端不发送
+    void flowBack(uint16_t direction, uint16_t x, uint16_t y, std::optional<double> position);
+    // 对端预计即将流转过来，先把光标移动到进入位置
+    void prepareFlowBack(uint16_t direction, double position);
+    // 本机的鼠标有一段时间没有移动
+    bool pointerIdle() const;
+    void startEdgeDetection();
+    void stopEdgeDetection();
+    // 共享设备的对端或其方向变化后，重新设置需要检测的屏幕边缘
+    virtual void updateEdges() {}
     virtual void hideMouse(bool hide) = 0;
 
 protected:
     virtual void moveMouse(uint16_t x, uint16_t y) = 0;
 
     bool edgeDetectionStarted() { return m_startEdgeDetection; }
+    uint16_t screenWidth() const { return m_screenWidth; }
+    uint16_t screenHeight() const { return m_screenHeight; }
+    // 有对端的屏幕边缘，按 1 << direction 置位
+    uint8_t flowEdges() const;
+    bool predictiveFlow() const;
+    const std::vector<EdgeSegment> &edgeSegments(uint16_t direction) const {
+        return m_segments[direction];
+    }
 
     void handleScreenSizeChange(int16_t w, int16_t h);
+    // 为空时把整个根窗口当作一个显示器
+    void handleMonitorsChange(const std::vector<Monitor> &monitors);
     void handleMotion(int16_t x, int16_t y, bool evFromPeer);
+    void handleEdgeHit(uint16_t direction, int16_t x, int16_t y, bool evFromPeer);
+    // 根据移动速度预测即将到达的边缘，提前通知对端，同时记录本机鼠标最近移动的时间
+    void predictFlow(int16_t x, int16_t y, bool evFromPeer);
 
 private:
     Manager *m_manager;
 
     uint16_t m_screenWidth;
     uint16_t m_screenHeight;
+    std::vector<Monitor> m_monitors;
+
+    // 按方向索引，左右边缘按行、上下边缘按列记录最外侧边缘的坐标，没有显示器时为 -1
+    std::array<std::vector<int16_t>, 4> m_edges;
+    std::array<std::vector<EdgeSegment>, 4> m_segments;
 
     bool m_startEdgeDetection;
 
     uint16_t m_lastX;
     uint16_t m_lastY;
 
+    // 预测流转：上一次的位置和时间、平滑后的速度（像素/毫秒）、已经通知过对端的方向
+    int16_t m_predictX;
+    int16_t m_predictY;
+    int64_t m_predictTime;
+    double m_velocityX;
+    double m_velocityY;
+    int m_preparedDirection;
+    // 本机鼠标最近一次移动的时间，CLOCK_MONOTONIC 纳秒
+    int64_t m_lastLocalMotion;
+
+    void buildEdges();
+    bool atEdge(uint16_t direction, int16_t x, int16_t y) const;
+    double edgePosition(uint16_t direction, double along) const;
+    void entryPoint(uint16_t direction,
+                    uint16_t &x,
+                    uint16_t &y,
+                    std::optional<double> position) const;
     void flowOut(uint16_t direction, uint16_t x, uint16_t y, bool evFromPeer);
 };
 
@@ -0,0 +1,374 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "BlockCache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <fmt/core.h>
+
+#include <QDebug>
+
+namespace fs = std::filesystem;
+
+static constexpr char META_MAGIC[] = "DDEFSC1";
+// 写入的块攒一段时间后一起落盘
+static constexpr auto syncInterval = std::chrono::seconds(1);
+
+#pragma pack(push, 1)
+struct MetaHeader {
+    char magic[sizeof(META_MAGIC)];
+    uint64_t size;
+    uint32_t keyLength;
+};
+#pragma pack(pop)
+
+static bool readFull(int fd, void *buf, size_t size, off_t offset) {
+    return pread(fd, buf, size, offset) == static_cast<ssize_t>(size);
+}
+
+static bool writeFull(int fd, const void *buf, size_t size, off_t offset) {
+    return pwrite(fd, buf, size, offset) == static_cast<ssize_t>(size);
+}
+
+BlockCache::Entry::~Entry() {
+    // meta 文件的 mtime 记录最近使用时间，重启后用于恢复 LRU 顺序
+    if (m_metaFd != -1) {
+        futimens(m_metaFd, nullptr);
+    }
+    close(m_dataFd);
+    close(m_metaFd);
+}
+
+BlockCache::BlockCache(const std::filesystem::path &dir, uint64_t capacity)
+    : m_dir(dir)
+    , m_capacity(capacity)
+    , m_usage(0)
+    , m_stopping(false) {
+    std::error_code ec;
+    fs::create_directories(m_dir, ec);
+    if (ec) {
+        qWarning() << fmt::format("failed to create cache dir {}: {}", m_dir.string(), ec.message())
+                          .data();
+        return;
+    }
+
+    loadIndex();
+
+    m_syncThread = std::thread(&BlockCache::syncLoop, this);
+}
+
+BlockCache::~BlockCache() {
+    {
+        std::lock_guard lk(m_syncMut);
+        m_stopping = true;
+    }
+    m_syncCv.notify_all();
+
+    if (m_syncThread.joinable()) {
+        m_syncThread.join();
+    }
+}
+
+void BlockCache::syncLoop() {
+    std::unique_lock lk(m_syncMut);
+    while (true) {
+        m_syncCv.wait_for(lk, syncInterval, [this] { return m_stopping; });
+
+        std::vector<std::shared_ptr<Entry>> dirty;
+        dirty.swap(m_dirty);
+        bool stopping = m_stopping;
+
+        lk.unlock();
+        for (const auto &entry : dirty) {
+            syncEntry(*entry);
+        }
+        dirty.clear();
+        lk.lock();
+
+        // 退出前把最后一批写入落盘
+        if (stopping && m_dirty.empty()) {
+            return;
+        }
+    }
+}
+
+void BlockCache::syncEntry(Entry &entry) {
+    std::set<uint64_t> pending;
+    {
+        std::lock_guard lk(entry.m_mut);
+        pending.swap(entry.m_pending);
+    }
+
+    // 数据落盘后才记录位图，崩溃时只会丢失缓存而不会读到错误数据
+    if (pending.empty() || fdatasync(entry.m_dataFd) == -1) {
+        return;
+    }
+
+    std::lock_guard lk(entry.m_mut);
+    for (uint64_t block : pending) {
+        entry.m_bitmap[block / 8] |= 1 << (block % 8);
+        writeFull(entry.m_metaFd, &entry.m_bitmap[block / 8], 1, entry.m_bitmapOffset + block / 8);
+    }
+}
+
+void BlockCache::loadIndex() {
+    std::vector<std::pair<int64_t, std::string>> items;
+
+    std::error_code ec;
+    for (const auto &item : fs::directory_iterator(m_dir, ec)) {
+        const fs::path &p = item.path();
+        if (p.extension() != ".meta") {
+            if (p.extension() == ".data" && !fs::exists(fs::path(p).replace_extension(".meta"))) {
+                fs::remove(p, ec);
+            }
+            continue;
+        }
+
+        std::string name = p.stem().string();
+        fs::path dataPath = fs::path(p).replace_extension(".data");
+
+        struct stat metaSt;
+        struct stat dataSt;
+        MetaHeader header;
+        int fd = ::open(p.c_str(), O_RDONLY | O_CLOEXEC);
+        bool valid = fd != -1 && fstat(fd, &metaSt) == 0 && readFull(fd, &header, sizeof(header), 0)
+                     && memcmp(header.magic, META_MAGIC, sizeof(META_MAGIC)) == 0
+                     && stat(dataPath.c_str(), &dataSt) == 0;
+        if (fd != -1) {
+            close(fd);
+        }
+
+        if (!valid) {
+            fs::remove(p, ec);
+            fs::remove(dataPath, ec);
+            continue;
+        }
+
+        uint64_t usage = dataSt.st_blocks * 512;
+        m_index[name].usage = usage;
+        m_usage += usage;
+        items.emplace_back(metaSt.st_mtim.tv_sec, name);
+    }
+
+    std::sort(items.begin(), items.end());
+    for (const auto &[_, name] : items) {
+        m_lru.push_front(name);
+        m_index[name].lru = m_lru.begin();
+    }
+
+    // 容量可能被调小，启动时先淘汰到上限以内
+    reserve({}, 0);
+}
+
+void BlockCache::removeItem(const std::string &name) {
+    auto iter = m_index.find(name);
+    if (iter == m_index.end()) {
+        return;
+    }
+
+    std::error_code ec;
+    fs::remove(m_dir / (name + ".data"), ec);
+    fs::remove(m_dir / (name + ".meta"), ec);
+
+    m_usage -= std::min(m_usage, iter->second.usage);
+    m_lru.erase(iter->second.lru);
+    m_index.erase(iter);
+}
+
+BlockCache::IndexItem &BlockCache::touch(const std::string &name) {
+    auto [iter, inserted] = m_index.try_emplace(name);
+    if (inserted) {
+        m_lru.push_front(name);
+        iter->second.lru = m_lru.begin();
+    } else {
+        m_lru.splice(m_lru.begin(), m_lru, iter->second.lru);
+    }
+
+    return iter->second;
+}
+
+bool BlockCache::reserve(const std::string &name, uint64_t size) {
+    std::lock_guard lk(m_mut);
+
+    while (m_usage + size > m_capacity) {
+        // 从尾部起淘汰最久未使用且当前没有打开的条目，打开的条目只有少数几个
+        auto victim = std::find_if(m_lru.rbegin(), m_lru.rend(), [this, &name](const std::string &n) {
+            return n != name && m_index[n].entry.expired();
+        });
+        if (victim == m_lru.rend()) {
+            return false;
+        }
+
+        removeItem(std::string(*victim));
+    }
+
+    m_usage += size;
+    if (!name.empty()) {
+        auto iter = m_index.find(name);
+        if (iter != m_index.end()) {
+            iter->second.usage += size;
+        }
+    }
+
+    return true;
+}
+
+std::shared_ptr<BlockCache::Entry>
+BlockCache::open(const std::string &path, uint64_t ino, int64_t mtime, uint64_t size) {
+    std::string key = fmt::format("{}\n{}\n{}\n{}", path, ino, mtime, size);
+    std::string name = fmt::format("{:016x}", std::hash<std::string>{}(key));
+
+    std::lock_guard lk(m_mut);
+
+    IndexItem &item = touch(name);
+    if (auto entry = item.entry.lock()) {
+        return entry->m_key == key ? entry : nullptr;
+    }
+
+    fs::path metaPath = m_dir / (name + ".meta");
+    fs::path dataPath = m_dir / (name + ".data");
+
+    auto entry = std::make_shared<Entry>();
+    entry->m_name = name;
+    entry->m_key = key;
+    entry->m_size = size;
+    entry->m_metaFd = ::open(metaPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    entry->m_dataFd = ::open(dataPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (entry->m_metaFd == -1 || entry->m_dataFd == -1) {
+        qWarning() << fmt::format("failed to open cache entry: {}", strerror(errno)).data();
+        removeItem(name);
+        return nullptr;
+    }
+
+    entry->m_bitmapOffset = sizeof(MetaHeader) + key.size();
+    entry->m_bitmap.resize((size + blockSize - 1) / blockSize / 8 + 1);
+
+    MetaHeader header;
+    std::string storedKey(key.size(), '\0');
+    bool valid = readFull(entry->m_metaFd, &header, sizeof(header), 0)
+                 && memcmp(header.magic, META_MAGIC, sizeof(META_MAGIC)) == 0
+                 && header.size == size && header.keyLength == key.size()
+                 && readFull(entry->m_metaFd, storedKey.data(), storedKey.size(), sizeof(header))
+                 && storedKey == key
+                 && readFull(entry->m_metaFd,
+                             entry->m_bitmap.data(),
+                             entry->m_bitmap.size(),
+                             entry->m_bitmapOffset);
+    if (!valid) {
+        // 新条目或哈希冲突，重新初始化
+        m_usage -= std::min(m_usage, item.usage);
+        item.usage = 0;
+
+        std::copy(&META_MAGIC[0], &META_MAGIC[sizeof(META_MAGIC)], &header.magic[0]);
+        header.size = size;
+        header.keyLength = key.size();
+        std::fill(entry->m_bitmap.begin(), entry->m_bitmap.end(), 0);
+
+        if (ftruncate(entry->m_metaFd, 0) == -1 || ftruncate(entry->m_dataFd, 0) == -1
+            || ftruncate(entry->m_dataFd, size) == -1
+            || !writeFull(entry->m_metaFd, &header, sizeof(header), 0)
+            || !writeFull(entry->m_metaFd, key.data(), key.size(), sizeof(header))
+            || !writeFull(entry->m_metaFd,
+                          entry->m_bitmap.data(),
+                          entry->m_bitmap.size(),
+                          entry->m_bitmapOffset)) {
+            qWarning() << fmt::format("failed to init cache entry: {}", strerror(errno)).data();
+            removeItem(name);
+            return nullptr;
+        }
+    }
+
+    futimens(entry->m_metaFd, nullptr);
+
+    item.entry = entry;
+    return entry;
+}
+
+bool BlockCache::read(Entry &entry, char *buf, uint64_t offset, size_t size, size_t *n) {
+    if (offset >= entry.m_size) {
+        *n = 0;
+        return true;
+    }
+
+    uint64_t end = std::min<uint64_t>(offset + size, entry.m_size);
+    {
+        std::lock_guard lk(entry.m_mut);
+        for (uint64_t block = offset / blockSize; block * blockSize < end; block++) {
+            if (!entry.hasBlock(block)) {
+                return false;
+            }
+        }
+    }
+
+    if (!readFull(entry.m_dataFd, buf, end - offset, offset)) {
+        return false;
+    }
+
+    {
+        std::lock_guard lk(m_mut);
+        touch(entry.m_name);
+    }
+
+    *n = end - offset;
+    return true;
+}
+
+void BlockCache::write(const std::shared_ptr<Entry> &entry,
+                       const char *buf,
+                       uint64_t offset,
+                       size_t size) {
+    uint64_t end = std::min<uint64_t>(offset + size, entry->m_size);
+
+    std::vector<uint64_t> written;
+    for (uint64_t block = (offset + blockSize - 1) / blockSize; block * blockSize < end; block++) {
+        uint64_t blockStart = block * blockSize;
+        uint64_t blockEnd = std::min(blockStart + blockSize, entry->m_size);
+        if (blockEnd > end) {
+            break;
+        }
+
+        {
+            std::lock_guard lk(entry->m_mut);
+            if (entry->hasBlock(block) || entry->m_pending.count(block) > 0) {
+                continue;
+            }
+        }
+
+        if (!reserve(entry->m_name, blockEnd - blockStart)
+            || !writeFull(entry->m_dataFd,
+                          buf + (blockStart - offset),
+                          blockEnd - blockStart,
+                          blockStart)) {
+            break;
+        }
+
+        written.push_back(block);
+    }
+
+    if (written.empty()) {
+        return;
+    }
+
+    bool wasClean;
+    {
+        std::lock_guard lk(entry->m_mut);
+        wasClean = entry->m_pending.empty();
+        entry->m_pending.insert(written.begin(), written.end());
+    }
+
+    // 已在队列中的条目由后台线程一起处理
+    if (wasClean) {
+        std::lock_guard lk(m_syncMut);
+        m_dirty.push_back(entry);
+    }
+}
@@ -0,0 +1,92 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef FUSE_BLOCKCACHE_H
+#define FUSE_BLOCKCACHE_H
+
+#include <condition_variable>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// 远端文件内容的本地磁盘缓存，每个文件对应一个稀疏数据文件和一个记录已缓存块的 meta 文件。
+// 文件以 远端路径 + inode + mtime + size 为键，远端文件变化后自然对应到新的条目，
+// 旧条目按 LRU 淘汰
+class BlockCache {
+public:
+    static constexpr uint64_t blockSize = 128 * 1024;
+
+    class Entry {
+        friend class BlockCache;
+
+    public:
+        ~Entry();
+
+        uint64_t size() const { return m_size; }
+
+    private:
+        std::string m_name;
+        std::string m_key;
+        uint64_t m_size;
+        int m_dataFd = -1;
+        int m_metaFd = -1;
+        off_t m_bitmapOffset;
+
+        std::mutex m_mut;
+        std::vector<uint8_t> m_bitmap;
+        // 已写入数据文件、等待 fdatasync 后才记入位图的块
+        std::set<uint64_t> m_pending;
+
+        bool hasBlock(uint64_t block) const { return m_bitmap[block / 8] & (1 << (block % 8)); }
+    };
+
+    BlockCache(const std::filesystem::path &dir, uint64_t capacity);
+    ~BlockCache();
+
+    std::shared_ptr<Entry> open(const std::string &path, uint64_t ino, int64_t mtime, uint64_t size);
+
+    // 请求范围内的块全部已缓存时读出数据并返回 true，*n 为读到的字节数
+    bool read(Entry &entry, char *buf, uint64_t offset, size_t size, size_t *n);
+    // 将远端读到的数据写入缓存，只记录被完整覆盖的块。
+    // 不等待落盘，后台线程定期 fdatasync 后再记入位图
+    void write(const std::shared_ptr<Entry> &entry, const char *buf, uint64_t offset, size_t size);
+
+private:
+    struct IndexItem {
+        uint64_t usage = 0;
+        std::weak_ptr<Entry> entry;
+        std::list<std::string>::iterator lru;
+    };
+
+    const std::filesystem::path m_dir;
+    const uint64_t m_capacity;
+
+    std::mutex m_mut;
+    std::unordered_map<std::string, IndexItem> m_index;
+    // 最近使用的条目在前，淘汰时从尾部查找
+    std::list<std::string> m_lru;
+    uint64_t m_usage;
+
+    std::mutex m_syncMut;
+    std::condition_variable m_syncCv;
+    std::vector<std::shared_ptr<Entry>> m_dirty;
+    bool m_stopping;
+    std::thread m_syncThread;
+
+    void loadIndex();
+    void syncLoop();
+    void syncEntry(Entry &entry);
+    // 取得条目并移到 LRU 的头部，需持有 m_mut
+    IndexItem &touch(const std::string &name);
+    void removeItem(const std::string &name);
+    bool reserve(const std::string &name, uint64_t size);
+};
+
+#endif // !FUSE_BLOCKCACHE_H
@@ -4,354 +4,1624 @@
 
 #include "FuseClient.h"
 
-#include <functional>
 #include <filesystem>
-#include <chrono>
+#include <utility>
+#include <algorithm>
+#include <optional>
+#include <fstream>
+#include <sstream>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 #include <fmt/core.h>
 #include <google/protobuf/util/time_util.h>
 
-#include <QTcpSocket>
-#include <QHostAddress>
-#include <QProcess>
+#include <QByteArray>
 
 #include "utils/net.h"
 #include "utils/message_helper.h"
 #include "protocol/message.pb.h"
 
-using namespace std::chrono_literals;
-
 namespace fs = std::filesystem;
 
+// 向服务端申请的单次读取上限，实际值以协商结果为准
+static constexpr size_t maxRead = 1024 * 1024;
+// 内核单次写请求的上限，也是客户端合并写入的上限
+static constexpr size_t maxWrite = 1024 * 1024;
+static constexpr size_t connectionCount = 4;
+// 首次访问时等待对端启动 FuseServer 的时间
+static constexpr auto remoteTimeout = std::chrono::seconds(10);
+static constexpr double attrTimeout = 1.0;
+static constexpr double entryTimeout = 1.0;
+// readdir 时尚未 lookup 过的条目没有节点号，使用与 libfuse 高层接口相同的占位值
+static constexpr ino_t unknownIno = 0xffffffff;
+// 子树预取的深度和条目数上限，以及预取结果的有效期
+static constexpr uint32_t prefetchDepth = 3;
+static constexpr uint32_t prefetchEntries = 256;
+static constexpr auto prefetchTimeout = std::chrono::seconds(5);
+// 目录被打开后这段时间内有这么多子目录被打开，即认为在逐层遍历
+static constexpr auto crawlWindow = std::chrono::seconds(2);
+static constexpr unsigned int crawlThreshold = 2;
+
 template <auto F>
 struct fuseOpsWrapper;
 
-template <typename... Args, int (FuseClient::*F)(Args...)>
+template <typename... Args, void (FuseClient::*F)(fuse_req_t, Args...)>
 struct fuseOpsWrapper<F> {
-    static int func(Args... args) {
-        auto *ctx = fuse_get_context();
-        auto *p = reinterpret_cast<FuseClient *>(ctx->private_data);
-        return (p->*F)(args...);
+    static void func(fuse_req_t req, Args... args) {
+        auto *p = static_cast<FuseClient *>(fuse_req_userdata(req));
+        (p->*F)(req, args...);
     }
 };
 
+static void toStat(const FsStat &fsStat, fuse_ino_t ino, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = ino;
+    st->st_nlink = fsStat.nlink();
+    st->st_mode = fsStat.mode();
+    st->st_uid = fsStat.uid();
+    st->st_gid = fsStat.gid();
+    st->st_size = fsStat.size();
+    st->st_blksize = fsStat.blksize();
+    st->st_blocks = fsStat.blocks();
+    st->st_atim.tv_sec = fsStat.atime().seconds();
+    st->st_atim.tv_nsec = fsStat.atime().nanos();
+    st->st_mtim.tv_sec = fsStat.mtime().seconds();
+    st->st_mtim.tv_nsec = fsStat.mtime().nanos();
+    st->st_ctim.tv_sec = fsStat.ctime().seconds();
+    st->st_ctim.tv_nsec = fsStat.ctime().nanos();
+}
+
+// 在 /proc/self/mountinfo 中查找挂载点，路径中的空白字符按八进制转义
+static bool isMounted(const fs::path &mountpoint) {
+    std::ifstream mountinfo("/proc/self/mountinfo");
+    std::string line;
+    while (std::getline(mountinfo, line)) {
+        std::istringstream fields(line);
+        std::string id, parentId, devno, root, point;
+        fields >> id >> parentId >> devno >> root >> point;
+
+        std::string unescaped;
+        for (size_t i = 0; i < point.size(); i++) {
+            if (point[i] == '\\' && i + 3 < point.size()) {
+                unescaped += static_cast<char>(std::stoi(point.substr(i + 1, 3), nullptr, 8));
+                i += 3;
+            } else {
+                unescaped += point[i];
+            }
+        }
+
+        if (unescaped == mountpoint.string()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// 上次异常退出时残留的挂载，访问时只会返回 ENOTCONN，需要先卸载才能重新挂载
+static void cleanStaleMount(const fs::path &mountpoint) {
+    if (!isMounted(mountpoint)) {
+        return;
+    }
+
+    if (umount2(mountpoint.c_str(), MNT_DETACH) == 0) {
+        qInfo("stale mount detached");
+        return;
+    }
+
+    // 普通用户没有卸载权限，只能交给 setuid 的 fusermount3
+    qInfo() << fmt::format("umount2 failed: {}, fallback to fusermount3", strerror(errno)).data();
+
+    const char *argv[] = {"fusermount3", "-u", "-z", mountpoint.c_str(), nullptr};
+    pid_t pid;
+    if (posix_spawnp(&pid, argv[0], nullptr, nullptr, const_cast<char **>(argv), environ) == 0) {
+        waitpid(pid, nullptr, 0);
+    }
+}
+
 FuseClient::FuseClient(const std::string &ip,
-                       uint16_t port,
-                       const std::filesystem::path &mountpoint)
-    : m_conn(new QTcpSocket(this))
-    , m_ip(ip)
-    , m_port(port)
+                       const std::filesystem::path &mountpoint,
+                       std::unique_ptr<BlockCache> cache)
+    : m_ip(ip)
+    , m_port(0)
     , m_mountpoint(mountpoint)
     , m_args(FUSE_ARGS_INIT(0, nullptr))
-    , m_fuse(std::unique_ptr<fuse, decltype(&fuse_destroy)>(nullptr, &fuse_destroy)) {
+    , m_session(nullptr, &fuse_session_destroy)
+    , m_serial(0)
+    , m_maxRead(maxRead)
+    , m_exiting(false)
+    , m_writeback(false)
+    , m_cache(std::move(cache))
+    , m_connecting(0)
+    , m_remoteState(RemoteState::Idle) {
     qInfo() << fmt::format("FuseClient::FuseClient, mountpoint: {}", m_mountpoint.string()).data();
 
-    QProcess *process = new QProcess(this);
-    connect(process,
-            static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
-            [this, process]([[maybe_unused]] int exitCode, QProcess::ExitStatus exitStatus) {
-                if (!exitStatus) {
-                    qInfo("umount point success");
-                }
+    m_nodes.emplace(FUSE_ROOT_ID, Node{"/", 1, FUSE_ROOT_ID});
 
-                if (!fs::exists(m_mountpoint)) {
-                    fs::create_directories(m_mountpoint);
-                }
+    fuse_opt_add_arg(&m_args, "dde-cooperation");
 
-                fuse_opt_add_arg(&m_args, m_mountpoint.c_str());
-                fuse_opt_add_arg(&m_args, "-d");
+    // 只在本地挂载，连接对端推迟到第一次访问挂载点时
+    m_mountThread = std::thread([this] {
+        cleanStaleMount(m_mountpoint);
 
-                connect(m_conn, &QTcpSocket::connected, [this] {
-                    Net::tcpSocketSetKeepAliveOption(m_conn->socketDescriptor());
-                    m_mountThread = std::thread(&FuseClient::mount, this);
-                });
-                connect(m_conn, &QTcpSocket::readyRead, this, &FuseClient::handleResponse);
-                m_conn->connectToHost(QHostAddress(QString::fromStdString(m_ip)), m_port);
+        std::error_code ec;
+        fs::create_directories(m_mountpoint, ec);
 
-                process->deleteLater();
-            });
-    process->start("/usr/bin/umount", QStringList{QString::fromStdString(m_mountpoint.string())});
+        mount();
+    });
 }
 
 FuseClient::~FuseClient() {
-    m_conn->close();
     exit();
+    fuse_opt_free_args(&m_args);
 }
 
 bool FuseClient::mount() {
     qInfo("FuseClient::mount");
 
-    fuse_operations ops{};
-    ops.getattr = fuseOpsWrapper<&FuseClient::getattr>::func,
-    ops.open = fuseOpsWrapper<&FuseClient::open>::func,
-    ops.read = fuseOpsWrapper<&FuseClient::read>::func,
-    ops.release = fuseOpsWrapper<&FuseClient::release>::func,
-    ops.readdir = fuseOpsWrapper<&FuseClient::readdir>::func,
+    // 挂载时还没有连接对端，max_read 使用向服务端申请的值，服务端至少会同意这么多
+    bool ok = false;
+    auto maxReadOpt = fmt::format("-omax_read={}", m_maxRead);
+    fuse_opt_add_arg(&m_args, maxReadOpt.c_str());
+
+    fuse_lowlevel_ops ops{};
+    ops.init = [](void *userdata, struct fuse_conn_info *conn) {
+        static_cast<FuseClient *>(userdata)->init(conn);
+    };
+    ops.lookup = fuseOpsWrapper<&FuseClient::lookup>::func;
+    ops.forget = fuseOpsWrapper<&FuseClient::forget>::func;
+    ops.forget_multi = fuseOpsWrapper<&FuseClient::forgetMulti>::func;
+    ops.getattr = fuseOpsWrapper<&FuseClient::getattr>::func;
+    ops.readlink = fuseOpsWrapper<&FuseClient::readlink>::func;
+    ops.open = fuseOpsWrapper<&FuseClient::open>::func;
+    ops.read = fuseOpsWrapper<&FuseClient::read>::func;
+    ops.release = fuseOpsWrapper<&FuseClient::release>::func;
+    ops.opendir = fuseOpsWrapper<&FuseClient::opendir>::func;
+    ops.readdir = fuseOpsWrapper<&FuseClient::readdir>::func;
+    ops.releasedir = fuseOpsWrapper<&FuseClient::releasedir>::func;
+    ops.write = fuseOpsWrapper<&FuseClient::write>::func;
+    ops.flush = fuseOpsWrapper<&FuseClient::flush>::func;
+    ops.fsync = fuseOpsWrapper<&FuseClient::fsync>::func;
+    ops.create = fuseOpsWrapper<&FuseClient::create>::func;
+    ops.setattr = fuseOpsWrapper<&FuseClient::setattr>::func;
+    ops.rename = fuseOpsWrapper<&FuseClient::rename>::func;
+    ops.unlink = fuseOpsWrapper<&FuseClient::unlink>::func;
+    ops.mkdir = fuseOpsWrapper<&FuseClient::mkdir>::func;
+    ops.rmdir = fuseOpsWrapper<&FuseClient::rmdir>::func;
+
+    fuse_session *session = fuse_session_new(&m_args, &ops, sizeof(ops), this);
+    {
+        std::lock_guard lk(m_sessionMut);
+        m_session.reset(session);
+    }
+
+    if (session && fuse_session_mount(session, m_mountpoint.c_str()) == 0) {
+        // exit 可能在挂载完成前就已调用
+        if (m_exiting) {
+            fuse_session_exit(session);
+        }
+
+        fuse_loop_config config{};
+        config.clone_fd = 1;
+        config.max_idle_threads = connectionCount * 2;
+        ok = fuse_session_loop_mt(session, &config) == 0;
+        fuse_session_unmount(session);
+    }
+
+    {
+        std::lock_guard lk(m_sessionMut);
+        m_session.reset(nullptr);
+    }
+
+    std::lock_guard lk(m_connsMut);
+    for (auto &conn : m_conns) {
+        closeConnection(conn.get());
+        for (int &fd : conn->pipe) {
+            if (fd != -1) {
+                close(fd);
+                fd = -1;
+            }
+        }
+    }
+    m_idleConns.clear();
+    m_conns.clear();
+
+    return ok;
+}
+
+void FuseClient::setRemote(uint16_t port, const std::string &token) {
+    qInfo() << fmt::format("FuseClient::setRemote: {}", port).data();
+
+    {
+        std::lock_guard lk(m_connsMut);
+        m_port = port;
+        m_token = token;
+        m_remoteState = port ? RemoteState::Ready : RemoteState::Failed;
+    }
+    m_connsCv.notify_all();
+}
 
-    m_fuse.reset(fuse_new(&m_args, &ops, sizeof(ops), this));
-    int ret = fuse_mount(m_fuse.get(), m_mountpoint.c_str());
-    if (ret != 0) {
+bool FuseClient::sessionExited() {
+    std::lock_guard lk(m_sessionMut);
+    return !m_session || fuse_session_exited(m_session.get());
+}
+
+bool FuseClient::connectRemote(std::unique_lock<std::mutex> &lk) {
+    if (m_remoteState == RemoteState::Idle) {
+        m_remoteState = RemoteState::Requested;
+        // 在 fuse 工作线程中发出，由 Machine 在主线程中向对端请求
+        emit remoteRequested();
+    }
+
+    bool answered = m_connsCv.wait_for(lk, remoteTimeout, [this] {
+        return m_remoteState != RemoteState::Requested || sessionExited();
+    });
+    if (!answered || m_remoteState != RemoteState::Ready) {
+        // 失败后回到初始状态，下一次访问时重新请求
+        if (m_remoteState != RemoteState::Ready) {
+            m_remoteState = RemoteState::Idle;
+        }
         return false;
     }
 
-    ret = fuse_loop(m_fuse.get());
-    fuse_unmount(m_fuse.get());
-    if (ret != 0) {
+    // 等待期间其他线程可能已经把连接池填满
+    if (m_conns.size() + m_connecting >= connectionCount) {
+        return true;
+    }
+
+    // 连接可能要等到超时，期间不持有锁，其他线程可以继续取用已有的空闲连接
+    m_connecting++;
+    lk.unlock();
+    auto conn = std::make_unique<Connection>();
+    bool connected = connectToServer(conn.get());
+    lk.lock();
+    m_connecting--;
+
+    if (!connected) {
+        if (m_conns.empty() && m_connecting == 0) {
+            m_remoteState = RemoteState::Idle;
+        }
+        m_connsCv.notify_all();
         return false;
     }
 
-    m_fuse.reset(nullptr);
+    if (conn->maxRead < m_maxRead) {
+        qWarning() << fmt::format("server max_read {} is less than {}", conn->maxRead, m_maxRead)
+                          .data();
+    }
+    m_idleConns.push_back(conn.get());
+    m_conns.emplace_back(std::move(conn));
+    m_connsCv.notify_all();
+
     return true;
 }
 
 void FuseClient::exit() {
-    if (m_fuse) {
-        // 此函数只是设置标志，并不能中断 fuse 的阻塞，
-        // 所以需要调用一下 stat 解除阻塞
-        fuse_exit(m_fuse.get());
+    m_exiting = true;
+
+    bool running;
+    {
+        std::lock_guard lk(m_sessionMut);
+        running = static_cast<bool>(m_session);
+        if (running) {
+            // 此函数只是设置标志，并不能中断 fuse 的阻塞，
+            // 所以需要调用一下 stat 解除阻塞
+            fuse_session_exit(m_session.get());
+        }
+    }
+
+    if (running) {
+        // 工作线程可能正阻塞在等待服务端回复上
+        {
+            std::lock_guard lk(m_connsMut);
+            for (auto &conn : m_conns) {
+                int sock = conn->sock;
+                if (sock != -1) {
+                    shutdown(sock, SHUT_RDWR);
+                }
+            }
+        }
+        m_connsCv.notify_all();
 
         struct stat statbuf;
         stat(m_mountpoint.c_str(), &statbuf);
+    }
 
-        if (m_mountThread.joinable()) {
-            m_mountThread.join();
-        }
+    if (m_mountThread.joinable()) {
+        m_mountThread.join();
     }
 }
 
-int FuseClient::getattr(const char *path,
-                        struct stat *const st,
-                        [[maybe_unused]] struct fuse_file_info *fi) {
-    qDebug() << fmt::format("getattr: {}", path).data();
+bool FuseClient::connectToServer(Connection *conn) {
+    uint16_t port;
+    std::string token;
+    {
+        std::lock_guard lk(m_connsMut);
+        port = m_port;
+        token = m_token;
+    }
 
-    QMetaObject::invokeMethod(this, [this, path]() {
-        Message msg;
-        FsMethodGetAttrRequest *req = msg.mutable_fsmethodgetattrrequest();
-        m_serial++;
-        req->set_serial(m_serial);
-        req->set_path(path);
-        m_conn->write(MessageHelper::genMessage(msg));
-    });
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        qWarning() << fmt::format("failed to create socket: {}", strerror(errno)).data();
+        return false;
+    }
 
-    auto resp = std::static_pointer_cast<FsMethodGetAttrResponse>(waitForServerReply());
-    if (!resp) {
-        errno = ETIMEDOUT;
-        return -1;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, m_ip.c_str(), &addr.sin_addr) != 1
+        || ::connect(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1) {
+        qWarning() << fmt::format("failed to connect to {}:{}: {}", m_ip, port, strerror(errno))
+                          .data();
+        close(sock);
+        return false;
     }
 
-    auto retStat = resp->stat();
+    // 3s 内没有回复即认为超时，与原先等待回复的超时一致
+    timeval tv{3, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 
-    memset(st, 0, sizeof(struct stat));
-    st->st_ino = retStat.ino();
-    st->st_nlink = retStat.nlink();
-    st->st_mode = retStat.mode();
-    st->st_uid = retStat.uid();
-    st->st_gid = retStat.gid();
-    st->st_size = retStat.size();
-    st->st_blksize = retStat.blksize();
-    st->st_blocks = retStat.blocks();
-    st->st_atim.tv_sec = retStat.atime().seconds();
-    st->st_atim.tv_nsec = retStat.atime().nanos();
-    st->st_mtim.tv_sec = retStat.mtime().seconds();
-    st->st_mtim.tv_nsec = retStat.mtime().nanos();
-    st->st_ctim.tv_sec = retStat.ctime().seconds();
-    st->st_ctim.tv_nsec = retStat.ctime().nanos();
-
-    qDebug() << fmt::format("path: {}, mode: {}, S_IFDIR: {}, S_IFREG: {}, nlink: {}",
-                            path,
-                            static_cast<uint32_t>(st->st_mode),
-                            static_cast<bool>(st->st_mode & S_IFDIR),
-                            static_cast<bool>(st->st_mode & S_IFREG),
-                            st->st_nlink)
-                    .data();
-
-    return resp->result();
-}
-
-int FuseClient::open(const char *path, struct fuse_file_info *fi) {
-    qDebug() << fmt::format("open: {}", path).data();
-
-    QMetaObject::invokeMethod(this, [this, path]() {
-        Message msg;
-        FsMethodOpenRequest *req = msg.mutable_fsmethodopenrequest();
-        m_serial++;
-        req->set_serial(m_serial);
-        req->set_path(path);
-        m_conn->write(MessageHelper::genMessage(msg));
-    });
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    Net::tcpSocketSetKeepAliveOption(sock);
+
+    conn->sock = sock;
 
-    auto resp = std::static_pointer_cast<FsMethodOpenResponse>(waitForServerReply());
-    if (!resp) {
-        errno = ETIMEDOUT;
-        return -1;
+    Message msg;
+    FsMethodInitRequest *request = msg.mutable_fsmethodinitrequest();
+    request->set_serial(++m_serial);
+    request->set_max_read(maxRead);
+    request->set_token(token);
+
+    Message reply;
+    if (!transact(conn, msg, &reply) || !reply.has_fsmethodinitresponse()
+        || reply.fsmethodinitresponse().result() < 0) {
+        qWarning("fuse init failed");
+        closeConnection(conn);
+        return false;
     }
+    conn->maxRead = reply.fsmethodinitresponse().max_read();
 
-    if (resp->has_fh()) {
-        fi->fh = resp->fh();
+    if (conn->pipe[0] == -1) {
+        if (pipe2(conn->pipe, O_CLOEXEC) == 0) {
+            int size = fcntl(conn->pipe[1], F_SETPIPE_SZ, static_cast<int>(conn->maxRead));
+            if (size == -1) {
+                size = fcntl(conn->pipe[1], F_GETPIPE_SZ);
+            }
+            conn->pipeSize = size > 0 ? size : 0;
+        } else {
+            qWarning() << fmt::format("failed to create pipe: {}", strerror(errno)).data();
+            conn->pipe[0] = conn->pipe[1] = -1;
+        }
     }
 
-    fi->direct_io = true;
+    return true;
+}
 
-    return resp->result();
+void FuseClient::closeConnection(Connection *conn) {
+    int sock = conn->sock.exchange(-1);
+    if (sock != -1) {
+        close(sock);
+    }
 }
 
-int FuseClient::read(const char *path,
-                     char *buf,
-                     size_t size,
-                     off_t offset,
-                     struct fuse_file_info *fi) {
-    qDebug()
-        << fmt::format("read: {}, fh: {}, size: {}, offset: {}", path, fi->fh, size, offset).data();
+FuseClient::Connection *FuseClient::acquireConnection(bool establish) {
+    std::unique_lock lk(m_connsMut);
 
-    QMetaObject::invokeMethod(this, [this, offset, size, fi]() {
-        Message msg;
-        FsMethodReadRequest *req = msg.mutable_fsmethodreadrequest();
-        m_serial++;
-        req->set_serial(m_serial);
-        req->set_offset(offset);
-        req->set_size(size);
-        auto rfi = req->mutable_fi();
-        rfi->set_fh(fi->fh);
-        m_conn->write(MessageHelper::genMessage(msg));
-    });
+    // 没有空闲连接且连接池未满时新建连接，否则等待其他线程归还
+    bool grow = establish;
+    while (m_idleConns.empty()) {
+        if (m_conns.empty() && m_connecting == 0 && !grow) {
+            return nullptr;
+        }
+
+        if (grow && m_conns.size() + m_connecting < connectionCount) {
+            grow = connectRemote(lk);
+            continue;
+        }
 
-    auto resp = std::static_pointer_cast<FsMethodReadResponse>(waitForServerReply());
-    if (!resp) {
-        errno = ETIMEDOUT;
-        return -1;
+        m_connsCv.wait(lk);
     }
 
-    qInfo()
-        << fmt::format("readed size: {}, result: {}", resp->data().size(), resp->result()).data();
-    memcpy(buf, resp->data().data(), resp->data().size());
+    Connection *conn = m_idleConns.back();
+    m_idleConns.pop_back();
+    return conn;
+}
 
-    return resp->result();
+void FuseClient::releaseConnection(Connection *conn) {
+    if (!conn) {
+        return;
+    }
+
+    {
+        std::lock_guard lk(m_connsMut);
+        m_idleConns.push_back(conn);
+    }
+    m_connsCv.notify_one();
 }
 
-int FuseClient::release(const char *path, struct fuse_file_info *fi) {
-    qDebug() << fmt::format("release: {}", path).data();
+bool FuseClient::sendRequest(Connection *conn, const Message &msg) {
+    // 超时断开的连接在下次使用时重连
+    if (conn->sock == -1 && (sessionExited() || !connectToServer(conn))) {
+        return false;
+    }
 
-    QMetaObject::invokeMethod(this, [this, path, fi]() {
-        Message msg;
-        FsMethodReleaseRequest *req = msg.mutable_fsmethodreleaserequest();
-        m_serial++;
-        req->set_serial(m_serial);
-        req->set_path(path);
-        req->mutable_fi()->set_fh(fi->fh);
-        m_conn->write(MessageHelper::genMessage(msg));
-    });
+    size_t size = msg.ByteSizeLong();
+    conn->buff.resize(header_size + size);
+    new (conn->buff.data()) MessageHeader(size);
+    msg.SerializeToArray(conn->buff.data() + header_size, size);
 
-    auto resp = std::static_pointer_cast<FsMethodReleaseResponse>(waitForServerReply());
-    if (!resp) {
-        errno = ETIMEDOUT;
-        return -1;
+    if (!Net::sendAll(conn->sock, conn->buff.data(), conn->buff.size())) {
+        qWarning() << fmt::format("failed to send request: {}", strerror(errno)).data();
+        closeConnection(conn);
+        return false;
     }
 
-    return resp->result();
+    return true;
 }
 
-int FuseClient::readdir(const char *path,
-                        void *buf,
-                        fuse_fill_dir_t filler,
-                        [[maybe_unused]] off_t offset,
-                        [[maybe_unused]] struct fuse_file_info *fi,
-                        [[maybe_unused]] enum fuse_readdir_flags flags) {
-    qDebug() << fmt::format("readdir: {}", path).data();
-
-    QMetaObject::invokeMethod(this, [this, path]() {
-        Message msg;
-        FsMethodReadDirRequest *req = msg.mutable_fsmethodreaddirrequest();
-        m_serial++;
-        req->set_serial(m_serial);
-        req->set_path(path);
-        m_conn->write(MessageHelper::genMessage(msg));
-    });
+bool FuseClient::transact(Connection *conn, const Message &msg, Message *reply) {
+    if (!sendRequest(conn, msg)) {
+        return false;
+    }
 
-    auto resp = std::static_pointer_cast<FsMethodReadDirResponse>(waitForServerReply());
-    if (!resp) {
-        errno = ETIMEDOUT;
-        return -1;
+    MessageHeader header;
+    if (!Net::recvAll(conn->sock, &header, header_size) || !header.legal()) {
+        qWarning("fuse not responded");
+        closeConnection(conn);
+        return false;
     }
 
-    for (const std::string &i : resp->item()) {
-        filler(buf, i.c_str(), nullptr, 0, static_cast<fuse_fill_dir_flags>(0));
+    conn->buff.resize(header.size());
+    if (!Net::recvAll(conn->sock, conn->buff.data(), conn->buff.size())
+        || !reply->ParseFromArray(conn->buff.data(), conn->buff.size())) {
+        qWarning("fuse not responded");
+        closeConnection(conn);
+        return false;
     }
 
-    return resp->result();
+    return true;
+}
+
+bool FuseClient::transact(const Message &msg, Message *reply) {
+    Connection *conn = acquireConnection();
+    bool ok = conn && transact(conn, msg, reply);
+    releaseConnection(conn);
+
+    return ok;
 }
 
-void FuseClient::handleResponse() noexcept {
-    while (m_conn->size() >= header_size) {
-        QByteArray buffer = m_conn->peek(header_size);
-        auto header = MessageHelper::parseMessageHeader(buffer);
-        if (!header.legal()) {
-            qWarning() << "illegal message from " << m_conn->peerAddress().toString();
+void FuseClient::replyTrailingData(Connection *conn, fuse_req_t req, size_t size) {
+    bool spliceUnsupported = conn->pipe[0] == -1 || size > conn->pipeSize;
+
+    if (!spliceUnsupported) {
+        size_t moved = 0;
+        while (moved < size) {
+            ssize_t n = splice(conn->sock, nullptr, conn->pipe[1], nullptr, size - moved, SPLICE_F_MOVE);
+            if (n > 0) {
+                moved += n;
+                continue;
+            }
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+
+            spliceUnsupported = n == -1 && errno == EINVAL && moved == 0;
+            break;
+        }
+
+        if (moved == size) {
+            fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+            bufv.buf[0].flags = FUSE_BUF_IS_FD;
+            bufv.buf[0].fd = conn->pipe[0];
+            if (fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE) != 0) {
+                drainPipe(conn);
+            }
             return;
         }
 
-        if (m_conn->size() < static_cast<qint64>(header_size + header.size())) {
-            qDebug() << "partial content";
+        if (!spliceUnsupported) {
+            drainPipe(conn);
+            closeConnection(conn);
+            fuse_reply_err(req, EIO);
             return;
         }
+    }
 
-        m_conn->read(header_size);
-        auto size = header.size();
-        buffer = m_conn->read(size);
+    conn->buff.resize(size);
+    if (!Net::recvAll(conn->sock, conn->buff.data(), size)) {
+        closeConnection(conn);
+        fuse_reply_err(req, EIO);
+        return;
+    }
 
-        Message msg = MessageHelper::parseMessageBody<Message>(buffer.data(), buffer.size());
+    fuse_reply_buf(req, conn->buff.data(), size);
+}
 
-        qDebug() << fmt::format("message type: {}", msg.payload_case()).data();
+void FuseClient::drainPipe(Connection *conn) {
+    int pending = 0;
+    if (ioctl(conn->pipe[0], FIONREAD, &pending) == -1 || pending <= 0) {
+        return;
+    }
 
-        switch (msg.payload_case()) {
-        case Message::PayloadCase::kFsMethodGetAttrResponse: {
-            const auto &data = msg.fsmethodgetattrresponse();
-            m_buff.reset(new FsMethodGetAttrResponse(data));
-            m_cv.notify_one();
+    conn->buff.resize(pending);
+    while (pending > 0) {
+        ssize_t n = ::read(conn->pipe[0], conn->buff.data(), pending);
+        if (n <= 0) {
             break;
         }
-        case Message::PayloadCase::kFsMethodOpenResponse: {
-            const auto &data = msg.fsmethodopenresponse();
-            m_buff.reset(new FsMethodOpenResponse(data));
-            m_cv.notify_one();
-            break;
+        pending -= n;
+    }
+}
+
+void FuseClient::sendForget(uint64_t node, uint64_t nlookup) {
+    {
+        std::unique_lock lk(m_nodesMut);
+        auto iter = m_nodes.find(node);
+        if (iter != m_nodes.end() && node != FUSE_ROOT_ID) {
+            iter->second.nlookup -= std::min(iter->second.nlookup, nlookup);
+            if (iter->second.nlookup == 0) {
+                m_nodes.erase(iter);
+            }
         }
-        case Message::PayloadCase::kFsMethodReadResponse: {
-            const auto &data = msg.fsmethodreadresponse();
-            m_buff.reset(new FsMethodReadResponse(data));
-            m_cv.notify_one();
-            break;
+    }
+
+    remoteForget(node, nlookup);
+}
+
+void FuseClient::remoteForget(uint64_t node, uint64_t nlookup) {
+    Message msg;
+    FsMethodForgetRequest *req = msg.mutable_fsmethodforgetrequest();
+    req->set_serial(++m_serial);
+    req->set_node(node);
+    req->set_nlookup(nlookup);
+
+    // 从未连接过对端时服务端没有任何节点，不需要为此建立连接
+    Connection *conn = acquireConnection(false);
+    if (conn) {
+        sendRequest(conn, msg);
+        releaseConnection(conn);
+    }
+}
+
+std::string FuseClient::nodePath(fuse_ino_t ino) {
+    std::shared_lock lk(m_nodesMut);
+
+    auto iter = m_nodes.find(ino);
+    if (iter == m_nodes.end()) {
+        return {};
+    }
+
+    return iter->second.path;
+}
+
+fuse_ino_t FuseClient::nodeParent(fuse_ino_t ino) {
+    std::shared_lock lk(m_nodesMut);
+
+    auto iter = m_nodes.find(ino);
+    if (iter == m_nodes.end()) {
+        return 0;
+    }
+
+    return iter->second.parent;
+}
+
+bool FuseClient::detectCrawl(fuse_ino_t ino) {
+    fuse_ino_t parent = nodeParent(ino);
+    auto now = std::chrono::steady_clock::now();
+
+    std::lock_guard lk(m_prefetchMut);
+
+    if (m_crawl.size() > 1024) {
+        for (auto iter = m_crawl.begin(); iter != m_crawl.end();) {
+            iter = now - iter->second.lastOpen > crawlWindow ? m_crawl.erase(iter) : std::next(iter);
         }
-        case Message::PayloadCase::kFsMethodReadDirResponse: {
-            const auto &data = msg.fsmethodreaddirresponse();
-            m_buff.reset(new FsMethodReadDirResponse(data));
-            m_cv.notify_one();
-            break;
+    }
+
+    CrawlState &self = m_crawl[ino];
+    self.lastOpen = now;
+    self.descents = 0;
+
+    if (parent == 0 || parent == ino) {
+        return false;
+    }
+
+    auto iter = m_crawl.find(parent);
+    if (iter == m_crawl.end() || now - iter->second.lastOpen > crawlWindow) {
+        return false;
+    }
+
+    // 同一个目录只在第一次达到阈值时预取，之后的子目录由预取结果覆盖
+    return ++iter->second.descents == crawlThreshold;
+}
+
+void FuseClient::prefetchSubtree(fuse_ino_t ino) {
+    qDebug() << fmt::format("prefetchSubtree: {}", ino).data();
+
+    Message msg;
+    FsMethodSnapshotRequest *request = msg.mutable_fsmethodsnapshotrequest();
+    request->set_serial(++m_serial);
+    request->set_node(ino);
+    request->set_max_depth(prefetchDepth);
+    request->set_max_entries(prefetchEntries);
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodsnapshotresponse()
+        || reply.fsmethodsnapshotresponse().result() < 0) {
+        return;
+    }
+
+    const auto &resp = reply.fsmethodsnapshotresponse();
+    QByteArray data = qUncompress(reinterpret_cast<const uchar *>(resp.data().data()), resp.data().size());
+
+    FsSnapshot snapshot;
+    if (!snapshot.ParseFromArray(data.data(), data.size())) {
+        qWarning("invalid snapshot");
+        return;
+    }
+
+    auto expires = std::chrono::steady_clock::now() + prefetchTimeout;
+    std::unordered_map<fuse_ino_t, PrefetchDir> dirs;
+    if (resp.complete()) {
+        dirs[ino].expires = expires;
+    }
+
+    std::vector<uint64_t> stale;
+    {
+        std::lock_guard lk(m_prefetchMut);
+        purgePrefetch(stale);
+
+        for (const auto &entry : snapshot.entry()) {
+            fuse_ino_t parent = entry.parent() == 0 ? ino : snapshot.entry(entry.parent() - 1).node();
+
+            auto [iter, inserted] = m_prefetchEntries.try_emplace(std::make_pair(parent, entry.name()));
+            if (!inserted) {
+                stale.push_back(iter->second.node);
+            }
+            iter->second = PrefetchEntry{entry.node(), entry.stat(), expires};
+
+            if (entry.complete()) {
+                dirs[entry.node()].expires = expires;
+            }
+
+            // 父条目总在子条目之前，目录的列表在遇到子条目前已经建好
+            auto dir = dirs.find(parent);
+            if (dir != dirs.end()) {
+                FsDirEntry *dirEntry = dir->second.listing.add_entry();
+                dirEntry->set_name(entry.name());
+                dirEntry->set_ino(entry.node());
+                dirEntry->set_mode(entry.stat().mode() & S_IFMT);
+            }
+        }
+
+        for (auto &[node, dir] : dirs) {
+            m_prefetchDirs[node] = std::move(dir);
+        }
+    }
+
+    for (uint64_t node : stale) {
+        remoteForget(node, 1);
+    }
+}
+
+void FuseClient::purgePrefetch(std::vector<uint64_t> &stale) {
+    auto now = std::chrono::steady_clock::now();
+
+    for (auto iter = m_prefetchEntries.begin(); iter != m_prefetchEntries.end();) {
+        if (now < iter->second.expires) {
+            ++iter;
+            continue;
         }
-        case Message::PayloadCase::kFsMethodReleaseResponse: {
-            const auto &data = msg.fsmethodreleaseresponse();
-            m_buff.reset(new FsMethodReleaseResponse(data));
-            m_cv.notify_one();
+        stale.push_back(iter->second.node);
+        iter = m_prefetchEntries.erase(iter);
+    }
+
+    for (auto iter = m_prefetchDirs.begin(); iter != m_prefetchDirs.end();) {
+        iter = now < iter->second.expires ? std::next(iter) : m_prefetchDirs.erase(iter);
+    }
+}
+
+void FuseClient::invalidatePrefetch(fuse_ino_t parent, const char *name) {
+    std::optional<uint64_t> stale;
+    {
+        std::lock_guard lk(m_prefetchMut);
+
+        m_prefetchDirs.erase(parent);
+
+        auto iter = m_prefetchEntries.find(std::make_pair(parent, std::string(name)));
+        if (iter != m_prefetchEntries.end()) {
+            stale = iter->second.node;
+            m_prefetchEntries.erase(iter);
+        }
+    }
+
+    if (stale) {
+        remoteForget(*stale, 1);
+    }
+}
+
+void FuseClient::addNode(fuse_ino_t parent, const char *name, fuse_ino_t ino) {
+    std::unique_lock lk(m_nodesMut);
+
+    auto parentIter = m_nodes.find(parent);
+    auto [iter, inserted] = m_nodes.try_emplace(ino, Node{{}, 0, parent});
+    if (inserted && parentIter != m_nodes.end()) {
+        const std::string &parentPath = parentIter->second.path;
+        iter->second.path = parentPath == "/" ? parentPath + name : parentPath + "/" + name;
+    }
+    iter->second.nlookup++;
+}
+
+void FuseClient::renameNode(fuse_ino_t parent,
+                            const char *name,
+                            fuse_ino_t newParent,
+                            const char *newName) {
+    std::unique_lock lk(m_nodesMut);
+
+    auto parentIter = m_nodes.find(parent);
+    auto newParentIter = m_nodes.find(newParent);
+    if (parentIter == m_nodes.end() || newParentIter == m_nodes.end()) {
+        return;
+    }
+
+    auto join = [](const std::string &dir, const char *name) {
+        return dir == "/" ? dir + name : dir + "/" + name;
+    };
+    std::string from = join(parentIter->second.path, name);
+    std::string to = join(newParentIter->second.path, newName);
+
+    // 被移动的节点及其子孙节点的路径都要更新
+    for (auto &[ino, node] : m_nodes) {
+        if (node.path == from) {
+            node.path = to;
+            node.parent = newParent;
+        } else if (node.path.size() > from.size() && node.path.compare(0, from.size(), from) == 0
+                   && node.path[from.size()] == '/') {
+            node.path = to + node.path.substr(from.size());
+        }
+    }
+}
+
+FuseClient::FileHandle *FuseClient::newFileHandle(uint64_t fh, fuse_ino_t ino) {
+    auto *handle = new FileHandle;
+    handle->fh = fh;
+    handle->ino = ino;
+
+    std::lock_guard lk(m_handlesMut);
+    m_openHandles.emplace(ino, handle);
+
+    return handle;
+}
+
+void FuseClient::removeFileHandle(FileHandle *handle) {
+    std::lock_guard lk(m_handlesMut);
+
+    auto range = m_openHandles.equal_range(handle->ino);
+    for (auto iter = range.first; iter != range.second; ++iter) {
+        if (iter->second == handle) {
+            m_openHandles.erase(iter);
             break;
         }
-        default: {
-            qWarning() << "FuseClient unknown message type:" << msg.payload_case();
+    }
+}
+
+int FuseClient::flushPending(FileHandle &handle) {
+    if (handle.pending.empty()) {
+        return 0;
+    }
+
+    size_t size = handle.pending.size();
+
+    Message msg;
+    FsMethodWriteRequest *request = msg.mutable_fsmethodwriterequest();
+    request->set_serial(++m_serial);
+    request->set_offset(handle.pendingOffset);
+    request->set_data(std::move(handle.pending));
+    request->mutable_fi()->set_fh(handle.fh);
+    handle.pending.clear();
+
+    Message reply;
+    int result;
+    if (!transact(msg, &reply) || !reply.has_fsmethodwriteresponse()) {
+        result = -ETIMEDOUT;
+    } else if (reply.fsmethodwriteresponse().result() < 0) {
+        result = reply.fsmethodwriteresponse().result();
+    } else if (static_cast<size_t>(reply.fsmethodwriteresponse().result()) < size) {
+        result = -EIO;
+    } else {
+        return 0;
+    }
+
+    handle.error = -result;
+    return result;
+}
+
+void FuseClient::flushNode(fuse_ino_t ino) {
+    // 持有 m_handlesMut 期间句柄不会被释放，release 先从表中摘除句柄再自行刷出
+    std::lock_guard lk(m_handlesMut);
+
+    auto range = m_openHandles.equal_range(ino);
+    for (auto iter = range.first; iter != range.second; ++iter) {
+        std::lock_guard handleLk(iter->second->mut);
+        flushPending(*iter->second);
+    }
+}
+
+int FuseClient::remoteFlags(int flags) const {
+    // 开启写回缓存后内核可能为了补齐页而读取只写打开的文件，
+    // O_APPEND 也由内核按文件大小换算成偏移，远端不能再追加
+    if (m_writeback) {
+        if ((flags & O_ACCMODE) == O_WRONLY) {
+            flags = (flags & ~O_ACCMODE) | O_RDWR;
+        }
+        flags &= ~O_APPEND;
+    }
+
+    return flags;
+}
+
+std::shared_ptr<BlockCache::Entry> FuseClient::openCacheEntry(fuse_ino_t ino) {
+    std::string path = nodePath(ino);
+    if (path.empty()) {
+        return nullptr;
+    }
+
+    // 缓存的键包含 mtime 和 size，打开时用一次 getattr 取得远端当前的值
+    Message msg;
+    FsMethodGetAttrRequest *request = msg.mutable_fsmethodgetattrrequest();
+    request->set_serial(++m_serial);
+    request->set_node(ino);
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodgetattrresponse()
+        || reply.fsmethodgetattrresponse().result() < 0) {
+        return nullptr;
+    }
+
+    const FsStat &st = reply.fsmethodgetattrresponse().stat();
+    if (!S_ISREG(st.mode())) {
+        return nullptr;
+    }
+
+    int64_t mtime = st.mtime().seconds() * 1000000000 + st.mtime().nanos();
+    return m_cache->open(path, st.ino(), mtime, st.size());
+}
+
+int FuseClient::remoteRelease(uint64_t fh) {
+    Message msg;
+    FsMethodReleaseRequest *req = msg.mutable_fsmethodreleaserequest();
+    req->set_serial(++m_serial);
+    req->mutable_fi()->set_fh(fh);
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodreleaseresponse()) {
+        return -ETIMEDOUT;
+    }
+
+    return reply.fsmethodreleaseresponse().result();
+}
+
+void FuseClient::init(struct fuse_conn_info *conn) {
+    // 读取的数据经由管道 splice 到 /dev/fuse，避免拷贝到用户态
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    }
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE) {
+        conn->want |= FUSE_CAP_SPLICE_MOVE;
+    }
+
+    // 写回缓存让内核把小块写入合并到页缓存里，再以大块写下来
+    if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+        m_writeback = true;
+    }
+    conn->max_write = maxWrite;
+}
+
+void FuseClient::lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    qDebug() << fmt::format("lookup: {}, {}", parent, name).data();
+
+    std::optional<PrefetchEntry> prefetched;
+    bool negative = false;
+    {
+        std::lock_guard lk(m_prefetchMut);
+
+        auto now = std::chrono::steady_clock::now();
+        auto iter = m_prefetchEntries.find(std::make_pair(parent, std::string(name)));
+        if (iter != m_prefetchEntries.end() && now < iter->second.expires) {
+            prefetched = std::move(iter->second);
+            m_prefetchEntries.erase(iter);
+        } else if (iter == m_prefetchEntries.end()) {
+            // 目录列表完整且不含该名字，可以直接返回不存在
+            auto dir = m_prefetchDirs.find(parent);
+            negative = dir != m_prefetchDirs.end() && now < dir->second.expires
+                       && std::none_of(dir->second.listing.entry().begin(),
+                                       dir->second.listing.entry().end(),
+                                       [name](const FsDirEntry &entry) { return entry.name() == name; });
+        }
+    }
+
+    if (prefetched || negative) {
+        fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = entryTimeout;
+
+        if (negative) {
+            fuse_reply_entry(req, &e);
+            return;
+        }
+
+        // 预取时服务端已经为该节点增加了一次引用，这里转交给内核
+        e.ino = prefetched->node;
+        e.attr_timeout = attrTimeout;
+        toStat(prefetched->stat, e.ino, &e.attr);
+
+        addNode(parent, name, e.ino);
+        if (fuse_reply_entry(req, &e) != 0) {
+            sendForget(e.ino, 1);
+        }
+        return;
+    }
+
+    Message msg;
+    FsMethodLookupRequest *request = msg.mutable_fsmethodlookuprequest();
+    request->set_serial(++m_serial);
+    request->set_parent(parent);
+    request->set_name(name);
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodlookupresponse()) {
+        fuse_reply_err(req, ETIMEDOUT);
+        return;
+    }
+
+    const auto &resp = reply.fsmethodlookupresponse();
+    if (resp.result() < 0) {
+        fuse_reply_err(req, -resp.result());
+        return;
+    }
+
+    fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = resp.node();
+    e.attr_timeout = attrTimeout;
+    e.entry_timeout = entryTimeout;
+    toStat(resp.stat(), e.ino, &e.attr);
+
+    addNode(parent, name, e.ino);
+
+    // 请求已被中断时内核不会持有该节点，需要归还服务端的引用
+    if (fuse_reply_entry(req, &e) != 0) {
+        sendForget(e.ino, 1);
+    }
+}
+
+void FuseClient::forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    qDebug() << fmt::format("forget: {}, {}", ino, nlookup).data();
+
+    sendForget(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+void FuseClient::forgetMulti(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) {
+        sendForget(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+void FuseClient::getattr(fuse_req_t req, fuse_ino_t ino, [[maybe_unused]] struct fuse_file_info *fi) {
+    qDebug() << fmt::format("getattr: {}", ino).data();
+
+    // 列出挂载点所在目录时会 stat 挂载点，此时不必连接对端
+    if (ino == FUSE_ROOT_ID) {
+        std::unique_lock lk(m_connsMut);
+        if (m_conns.empty()) {
+            lk.unlock();
+
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            st.st_ino = FUSE_ROOT_ID;
+            st.st_mode = S_IFDIR | 0755;
+            st.st_nlink = 2;
+            st.st_uid = getuid();
+            st.st_gid = getgid();
+            fuse_reply_attr(req, &st, 0);
+            return;
+        }
+    }
+
+    flushNode(ino);
+
+    Message msg;
+    FsMethodGetAttrRequest *request = msg.mutable_fsmethodgetattrrequest();
+    request->set_serial(++m_serial);
+    request->set_node(ino);
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodgetattrresponse()) {
+        fuse_reply_err(req, ETIMEDOUT);
+        return;
+    }
+
+    const auto &resp = reply.fsmethodgetattrresponse();
+    if (resp.result() < 0) {
+        fuse_reply_err(req, -resp.result());
+        return;
+    }
+
+    struct stat st;
+    toStat(resp.stat(), ino, &st);
+    fuse_reply_attr(req, &st, attrTimeout);
+}
+
+void FuseClient::readlink(fuse_req_t req, fuse_ino_t ino) {
+    qDebug() << fmt::format("readlink: {}", ino).data();
+
+    Message msg;
+    FsMethodReadlinkRequest *request = msg.mutable_fsmethodreadlinkrequest();
+    request->set_serial(++m_serial);
+    request->set_node(ino);
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodreadlinkresponse()) {
+        fuse_reply_err(req, ETIMEDOUT);
+        return;
+    }
+
+    const auto &resp = reply.fsmethodreadlinkresponse();
+    if (resp.result() < 0) {
+        fuse_reply_err(req, -resp.result());
+        return;
+    }
+
+    fuse_reply_readlink(req, resp.target().c_str());
+}
+
+void FuseClient::open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    qDebug() << fmt::format("open: {}", ino).data();
+
+    Message msg;
+    FsMethodOpenRequest *request = msg.mutable_fsmethodopenrequest();
+    request->set_serial(++m_serial);
+    request->set_node(ino);
+    request->mutable_fi()->set_flags(remoteFlags(fi->flags));
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodopenresponse()) {
+        fuse_reply_err(req, ETIMEDOUT);
+        return;
+    }
+
+    const auto &resp = reply.fsmethodopenresponse();
+    if (resp.result() < 0) {
+        fuse_reply_err(req, -resp.result());
+        return;
+    }
+
+    auto *handle = newFileHandle(resp.fh(), ino);
+    if (m_cache && (fi->flags & O_ACCMODE) == O_RDONLY) {
+        handle->cache = openCacheEntry(ino);
+    }
+
+    fi->fh = reinterpret_cast<uint64_t>(handle);
+    // 写回缓存依赖页缓存，只在未开启时绕过
+    fi->direct_io = !m_writeback;
+
+    if (fuse_reply_open(req, fi) != 0) {
+        remoteRelease(handle->fh);
+        removeFileHandle(handle);
+        delete handle;
+    }
+}
+
+void FuseClient::read(fuse_req_t req,
+                      fuse_ino_t ino,
+                      size_t size,
+                      off_t off,
+                      struct fuse_file_info *fi) {
+    auto *handle = reinterpret_cast<FileHandle *>(fi->fh);
+
+    qDebug() << fmt::format("read: {}, fh: {}, size: {}, offset: {}", ino, handle->fh, size, off).data();
+
+    {
+        std::lock_guard lk(handle->mut);
+        flushPending(*handle);
+    }
+
+    uint64_t reqOffset = off;
+    uint64_t reqSize = size;
+    if (handle->cache) {
+        thread_local std::vector<char> buff;
+        buff.resize(size);
+
+        size_t n;
+        if (m_cache->read(*handle->cache, buff.data(), off, size, &n)) {
+            fuse_reply_buf(req, buff.data(), n);
+            return;
+        }
+
+        // 按块对齐向远端请求，使读到的数据能完整写入缓存
+        uint64_t alignedOffset = off / BlockCache::blockSize * BlockCache::blockSize;
+        uint64_t alignedEnd = (off + size + BlockCache::blockSize - 1) / BlockCache::blockSize
+                              * BlockCache::blockSize;
+        if (alignedEnd - alignedOffset <= m_maxRead) {
+            reqOffset = alignedOffset;
+            reqSize = alignedEnd - alignedOffset;
+        }
+    }
+
+    Message msg;
+    FsMethodReadRequest *request = msg.mutable_fsmethodreadrequest();
+    request->set_serial(++m_serial);
+    request->set_offset(reqOffset);
+    request->set_size(reqSize);
+    request->set_trailing(true);
+    request->mutable_fi()->set_fh(handle->fh);
+
+    // 数据紧跟在响应之后，需要在同一连接上接收完
+    Connection *conn = acquireConnection();
+
+    Message reply;
+    if (!conn || !transact(conn, msg, &reply) || !reply.has_fsmethodreadresponse()) {
+        releaseConnection(conn);
+        fuse_reply_err(req, ETIMEDOUT);
+        return;
+    }
+
+    const auto &resp = reply.fsmethodreadresponse();
+    if (resp.result() <= 0) {
+        releaseConnection(conn);
+        if (resp.result() < 0) {
+            fuse_reply_err(req, -resp.result());
+        } else {
+            fuse_reply_buf(req, nullptr, 0);
+        }
+        return;
+    }
+
+    if (!handle->cache) {
+        replyTrailingData(conn, req, resp.result());
+        releaseConnection(conn);
+        return;
+    }
+
+    size_t n = resp.result();
+    conn->buff.resize(n);
+    if (!Net::recvAll(conn->sock, conn->buff.data(), n)) {
+        closeConnection(conn);
+        releaseConnection(conn);
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    // 先回复内核，缓存的写入不会让读取等待
+    size_t skip = off - reqOffset;
+    size_t len = n > skip ? std::min(size, n - skip) : 0;
+    fuse_reply_buf(req, conn->buff.data() + skip, len);
+
+    m_cache->write(handle->cache, conn->buff.data(), reqOffset, n);
+    releaseConnection(conn);
+}
+
+void FuseClient::release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    qDebug() << fmt::format("release: {}, fh: {}", ino, fi->fh).data();
+
+    auto *handle = reinterpret_cast<FileHandle *>(fi->fh);
+    // 先从表中摘除，之后不会再有其它线程访问该句柄
+    removeFileHandle(handle);
+
+    // release 的结果不会返回给调用方，写入错误只能在 flush 时报告
+    flushPending(*handle);
+    int result = remoteRelease(handle->fh);
+    delete handle;
+
+    fuse_reply_err(req, result < 0 ? -result : 0);
+}
+
+void FuseClient::opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    qDebug() << fmt::format("opendir: {}", ino).data();
+
+    if (detectCrawl(ino)) {
+        prefetchSubtree(nodeParent(ino));
+    }
+
+    FsMethodReadDirResponse *prefetched = nullptr;
+    {
+        std::lock_guard lk(m_prefetchMut);
+
+        auto iter = m_prefetchDirs.find(ino);
+        if (iter != m_prefetchDirs.end() && std::chrono::steady_clock::now() < iter->second.expires) {
+            prefetched = new FsMethodReadDirResponse(iter->second.listing);
+        }
+    }
+
+    if (prefetched) {
+        fi->fh = reinterpret_cast<uint64_t>(prefetched);
+        if (fuse_reply_open(req, fi) != 0) {
+            delete prefetched;
+        }
+        return;
+    }
+
+    Message msg;
+    FsMethodReadDirRequest *request = msg.mutable_fsmethodreaddirrequest();
+    request->set_serial(++m_serial);
+    request->set_node(ino);
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodreaddirresponse()) {
+        fuse_reply_err(req, ETIMEDOUT);
+        return;
+    }
+
+    if (reply.fsmethodreaddirresponse().result() < 0) {
+        fuse_reply_err(req, -reply.fsmethodreaddirresponse().result());
+        return;
+    }
+
+    // 目录内容在 opendir 时一次取回，readdir 只按 offset 从中取条目
+    FsMethodReadDirResponse *dir = reply.release_fsmethodreaddirresponse();
+    fi->fh = reinterpret_cast<uint64_t>(dir);
+    if (fuse_reply_open(req, fi) != 0) {
+        delete dir;
+    }
+}
+
+void FuseClient::readdir(fuse_req_t req,
+                         [[maybe_unused]] fuse_ino_t ino,
+                         size_t size,
+                         off_t off,
+                         struct fuse_file_info *fi) {
+    auto *dir = reinterpret_cast<FsMethodReadDirResponse *>(fi->fh);
+    thread_local std::vector<char> buff;
+
+    buff.resize(size);
+    size_t pos = 0;
+    for (int i = off; i < dir->entry_size(); i++) {
+        const auto &entry = dir->entry(i);
+
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = entry.ino() ? entry.ino() : unknownIno;
+        st.st_mode = entry.mode();
+
+        size_t len = fuse_add_direntry(req,
+                                       buff.data() + pos,
+                                       size - pos,
+                                       entry.name().c_str(),
+                                       &st,
+                                       i + 1);
+        if (len > size - pos) {
             break;
         }
+        pos += len;
+    }
+
+    fuse_reply_buf(req, buff.data(), pos);
+}
+
+void FuseClient::releasedir(fuse_req_t req,
+                            [[maybe_unused]] fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+    delete reinterpret_cast<FsMethodReadDirResponse *>(fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+void FuseClient::write(fuse_req_t req,
+                       fuse_ino_t ino,
+                       const char *buf,
+                       size_t size,
+                       off_t off,
+                       struct fuse_file_info *fi) {
+    auto *handle = reinterpret_cast<FileHandle *>(fi->fh);
+
+    qDebug() << fmt::format("write: {}, fh: {}, size: {}, offset: {}", ino, handle->fh, size, off).data();
+
+    std::lock_guard lk(handle->mut);
+
+    if (handle->error) {
+        fuse_reply_err(req, std::exchange(handle->error, 0));
+        return;
+    }
+
+    // 不连续的写入不能合并，先把已有的发出去
+    if (!handle->pending.empty() && handle->pendingOffset + handle->pending.size() != uint64_t(off)) {
+        int result = flushPending(*handle);
+        if (result < 0) {
+            handle->error = 0;
+            fuse_reply_err(req, -result);
+            return;
+        }
+    }
+
+    if (handle->pending.empty()) {
+        handle->pendingOffset = off;
+    }
+    handle->pending.append(buf, size);
+
+    if (handle->pending.size() >= maxWrite) {
+        int result = flushPending(*handle);
+        if (result < 0) {
+            handle->error = 0;
+            fuse_reply_err(req, -result);
+            return;
         }
     }
+
+    fuse_reply_write(req, size);
 }
 
-std::shared_ptr<google::protobuf::Message> FuseClient::waitForServerReply() {
-    std::unique_lock lk(m_mut);
-    m_buff.reset();
-    m_cv.wait_for(lk, 3s);
-    if (m_buff) {
-        qInfo("fuse responded");
-    } else {
-        qInfo("fuse not responded");
+void FuseClient::flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    qDebug() << fmt::format("flush: {}, fh: {}", ino, fi->fh).data();
+
+    // close 时只需把本地合并的写入发出，数据落盘由 fsync 负责
+    auto *handle = reinterpret_cast<FileHandle *>(fi->fh);
+    std::lock_guard lk(handle->mut);
+
+    flushPending(*handle);
+    fuse_reply_err(req, std::exchange(handle->error, 0));
+}
+
+void FuseClient::fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    qDebug() << fmt::format("fsync: {}, fh: {}", ino, fi->fh).data();
+
+    auto *handle = reinterpret_cast<FileHandle *>(fi->fh);
+    {
+        std::lock_guard lk(handle->mut);
+        flushPending(*handle);
+        if (handle->error) {
+            fuse_reply_err(req, std::exchange(handle->error, 0));
+            return;
+        }
+    }
+
+    Message msg;
+    FsMethodFsyncRequest *request = msg.mutable_fsmethodfsyncrequest();
+    request->set_serial(++m_serial);
+    request->set_datasync(datasync);
+    request->mutable_fi()->set_fh(handle->fh);
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodfsyncresponse()) {
+        fuse_reply_err(req, ETIMEDOUT);
+        return;
+    }
+
+    fuse_reply_err(req, -reply.fsmethodfsyncresponse().result());
+}
+
+void FuseClient::create(fuse_req_t req,
+                        fuse_ino_t parent,
+                        const char *name,
+                        mode_t mode,
+                        struct fuse_file_info *fi) {
+    qDebug() << fmt::format("create: {}, {}", parent, name).data();
+
+    invalidatePrefetch(parent, name);
+
+    Message msg;
+    FsMethodCreateRequest *request = msg.mutable_fsmethodcreaterequest();
+    request->set_serial(++m_serial);
+    request->set_parent(parent);
+    request->set_name(name);
+    request->set_mode(mode);
+    request->mutable_fi()->set_flags(remoteFlags(fi->flags));
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodcreateresponse()) {
+        fuse_reply_err(req, ETIMEDOUT);
+        return;
+    }
+
+    const auto &resp = reply.fsmethodcreateresponse();
+    if (resp.result() < 0) {
+        fuse_reply_err(req, -resp.result());
+        return;
+    }
+
+    fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = resp.node();
+    e.attr_timeout = attrTimeout;
+    e.entry_timeout = entryTimeout;
+    toStat(resp.stat(), e.ino, &e.attr);
+
+    addNode(parent, name, e.ino);
+
+    auto *handle = newFileHandle(resp.fh(), e.ino);
+    fi->fh = reinterpret_cast<uint64_t>(handle);
+    fi->direct_io = !m_writeback;
+
+    if (fuse_reply_create(req, &e, fi) != 0) {
+        remoteRelease(handle->fh);
+        removeFileHandle(handle);
+        delete handle;
+        sendForget(e.ino, 1);
+    }
+}
+
+void FuseClient::setattr(fuse_req_t req,
+                         fuse_ino_t ino,
+                         struct stat *attr,
+                         int toSet,
+                         struct fuse_file_info *fi) {
+    qDebug() << fmt::format("setattr: {}, to_set: {:#x}", ino, toSet).data();
+
+    // 截断等操作必须排在已合并的写入之后
+    flushNode(ino);
+
+    Message msg;
+    FsMethodSetAttrRequest *request = msg.mutable_fsmethodsetattrrequest();
+    request->set_serial(++m_serial);
+    request->set_node(ino);
+    if (fi) {
+        request->mutable_fi()->set_fh(reinterpret_cast<FileHandle *>(fi->fh)->fh);
+    }
+    if (toSet & FUSE_SET_ATTR_MODE) {
+        request->set_mode(attr->st_mode);
+    }
+    if (toSet & FUSE_SET_ATTR_UID) {
+        request->set_uid(attr->st_uid);
+    }
+    if (toSet & FUSE_SET_ATTR_GID) {
+        request->set_gid(attr->st_gid);
+    }
+    if (toSet & FUSE_SET_ATTR_SIZE) {
+        request->set_size(attr->st_size);
+    }
+    if (toSet & FUSE_SET_ATTR_ATIME_NOW) {
+        request->set_atime_now(true);
+    } else if (toSet & FUSE_SET_ATTR_ATIME) {
+        request->mutable_atime()->set_seconds(attr->st_atim.tv_sec);
+        request->mutable_atime()->set_nanos(attr->st_atim.tv_nsec);
+    }
+    if (toSet & FUSE_SET_ATTR_MTIME_NOW) {
+        request->set_mtime_now(true);
+    } else if (toSet & FUSE_SET_ATTR_MTIME) {
+        request->mutable_mtime()->set_seconds(attr->st_mtim.tv_sec);
+        request->mutable_mtime()->set_nanos(attr->st_mtim.tv_nsec);
+    }
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodsetattrresponse()) {
+        fuse_reply_err(req, ETIMEDOUT);
+        return;
+    }
+
+    const auto &resp = reply.fsmethodsetattrresponse();
+    if (resp.result() < 0) {
+        fuse_reply_err(req, -resp.result());
+        return;
+    }
+
+    struct stat st;
+    toStat(resp.stat(), ino, &st);
+    fuse_reply_attr(req, &st, attrTimeout);
+}
+
+void FuseClient::rename(fuse_req_t req,
+                        fuse_ino_t parent,
+                        const char *name,
+                        fuse_ino_t newParent,
+                        const char *newName,
+                        unsigned int flags) {
+    qDebug() << fmt::format("rename: {}, {} -> {}, {}", parent, name, newParent, newName).data();
+
+    invalidatePrefetch(parent, name);
+    invalidatePrefetch(newParent, newName);
+
+    Message msg;
+    FsMethodRenameRequest *request = msg.mutable_fsmethodrenamerequest();
+    request->set_serial(++m_serial);
+    request->set_parent(parent);
+    request->set_name(name);
+    request->set_new_parent(newParent);
+    request->set_new_name(newName);
+    request->set_flags(flags);
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodrenameresponse()) {
+        fuse_reply_err(req, ETIMEDOUT);
+        return;
+    }
+
+    int result = reply.fsmethodrenameresponse().result();
+    if (result == 0) {
+        renameNode(parent, name, newParent, newName);
+    }
+
+    fuse_reply_err(req, -result);
+}
+
+void FuseClient::unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    qDebug() << fmt::format("unlink: {}, {}", parent, name).data();
+
+    invalidatePrefetch(parent, name);
+
+    Message msg;
+    FsMethodUnlinkRequest *request = msg.mutable_fsmethodunlinkrequest();
+    request->set_serial(++m_serial);
+    request->set_parent(parent);
+    request->set_name(name);
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodunlinkresponse()) {
+        fuse_reply_err(req, ETIMEDOUT);
+        return;
+    }
+
+    fuse_reply_err(req, -reply.fsmethodunlinkresponse().result());
+}
+
+void FuseClient::mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    qDebug() << fmt::format("mkdir: {}, {}", parent, name).data();
+
+    invalidatePrefetch(parent, name);
+
+    Message msg;
+    FsMethodMkdirRequest *request = msg.mutable_fsmethodmkdirrequest();
+    request->set_serial(++m_serial);
+    request->set_parent(parent);
+    request->set_name(name);
+    request->set_mode(mode);
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodmkdirresponse()) {
+        fuse_reply_err(req, ETIMEDOUT);
+        return;
+    }
+
+    const auto &resp = reply.fsmethodmkdirresponse();
+    if (resp.result() < 0) {
+        fuse_reply_err(req, -resp.result());
+        return;
+    }
+
+    fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = resp.node();
+    e.attr_timeout = attrTimeout;
+    e.entry_timeout = entryTimeout;
+    toStat(resp.stat(), e.ino, &e.attr);
+
+    addNode(parent, name, e.ino);
+
+    if (fuse_reply_entry(req, &e) != 0) {
+        sendForget(e.ino, 1);
+    }
+}
+
+void FuseClient::rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    qDebug() << fmt::format("rmdir: {}, {}", parent, name).data();
+
+    invalidatePrefetch(parent, name);
+
+    Message msg;
+    FsMethodRmdirRequest *request = msg.mutable_fsmethodrmdirrequest();
+    request->set_serial(++m_serial);
+    request->set_parent(parent);
+    request->set_name(name);
+
+    Message reply;
+    if (!transact(msg, &reply) || !reply.has_fsmethodrmdirresponse()) {
+        fuse_reply_err(req, ETIMEDOUT);
+        return;
     }
 
-    return m_buff;
+    fuse_reply_err(req, -reply.fsmethodrmdirresponse().result());
 }
@@ -8,60 +8,206 @@
 #include <filesystem>
 #include <thread>
 #include <memory>
+#include <vector>
+#include <atomic>
 #include <mutex>
+#include <shared_mutex>
 #include <condition_variable>
+#include <unordered_map>
+#include <map>
+#include <chrono>
+#include <string>
 
 #define FUSE_USE_VERSION 35
-#include <fuse3/fuse.h>
-
-#include <google/protobuf/message.h>
+#include <fuse3/fuse_lowlevel.h>
 
 #include <QObject>
 
-class QTcpSocket;
+#include "BlockCache.h"
+
+#include "protocol/fs.pb.h"
+
+class Message;
 
 class FuseClient : public QObject {
     Q_OBJECT
 
 public:
     explicit FuseClient(const std::string &ip,
-                        uint16_t port,
-                        const std::filesystem::path &mountpoint);
+                        const std::filesystem::path &mountpoint,
+                        std::unique_ptr<BlockCache> cache = nullptr);
     ~FuseClient();
 
+    // 对端 FuseServer 的端口和会话令牌，port 为 0 表示对端拒绝
+    void setRemote(uint16_t port, const std::string &token = {});
+
     bool mount();
     void unmount() { exit(); }
     void exit();
 
+signals:
+    // 挂载点第一次被访问，需要对端启动 FuseServer
+    void remoteRequested();
+
 private:
-    QTcpSocket *m_conn;
+    enum class RemoteState {
+        Idle,
+        Requested,
+        Ready,
+        Failed,
+    };
 
     std::string m_ip;
     uint16_t m_port;
+    std::string m_token;
     const std::filesystem::path m_mountpoint;
 
     fuse_args m_args;
-    std::unique_ptr<fuse, decltype(&fuse_destroy)> m_fuse;
-    uint16_t m_serial;
+    // 会话在挂载线程中创建和销毁，exit 在主线程中访问，需持有 m_sessionMut。
+    // 不能在持有 m_sessionMut 时再获取 m_connsMut
+    std::mutex m_sessionMut;
+    std::unique_ptr<fuse_session, decltype(&fuse_session_destroy)> m_session;
+    std::atomic<uint16_t> m_serial;
+    size_t m_maxRead;
 
     std::thread m_mountThread;
-    std::mutex m_mut;
-    std::condition_variable m_cv;
-    std::shared_ptr<google::protobuf::Message> m_buff;
-
-    int getattr(const char *path, struct stat *st, struct fuse_file_info *fi);
-    int open(const char *path, struct fuse_file_info *fi);
-    int read(const char *path, char *buf, size_t size, off_t offser, struct fuse_file_info *fi);
-    int release(const char *path, struct fuse_file_info *fi);
-    int readdir(const char *path,
-                void *buf,
-                fuse_fill_dir_t filler,
-                off_t offset,
-                struct fuse_file_info *fi,
-                enum fuse_readdir_flags flags);
-
-    void handleResponse() noexcept;
-    std::shared_ptr<google::protobuf::Message> waitForServerReply();
+    std::atomic<bool> m_exiting;
+
+    // 节点对应的远端路径，用作块缓存的键
+    struct Node {
+        std::string path;
+        uint64_t nlookup;
+        fuse_ino_t parent;
+    };
+
+    std::shared_mutex m_nodesMut;
+    std::unordered_map<fuse_ino_t, Node> m_nodes;
+
+    struct FileHandle {
+        uint64_t fh;
+        fuse_ino_t ino;
+        std::shared_ptr<BlockCache::Entry> cache;
+
+        // 连续的写入先在本地合并，攒够或遇到不连续写入时再发给服务端
+        std::mutex mut;
+        uint64_t pendingOffset = 0;
+        std::string pending;
+        // 合并写入失败时记录错误，由下一次 write/flush/fsync 返回
+        int error = 0;
+    };
+
+    // getattr/setattr 前需要先把同一节点上未发送的写入刷出去
+    std::mutex m_handlesMut;
+    std::unordered_multimap<fuse_ino_t, FileHandle *> m_openHandles;
+    bool m_writeback;
+
+    std::unique_ptr<BlockCache> m_cache;
+
+    // 文件管理器逐层打开目录时，一次取回整棵子树的元数据，之后的 lookup/opendir 在本地完成。
+    // 预取的条目在服务端各持有一次引用，被 lookup 取走时转交给内核，过期时 forget
+    struct PrefetchEntry {
+        uint64_t node;
+        FsStat stat;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    struct PrefetchDir {
+        FsMethodReadDirResponse listing;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    // 记录目录最近一次被打开的时间，以及之后有多少个子目录被打开，用于识别逐层遍历
+    struct CrawlState {
+        std::chrono::steady_clock::time_point lastOpen;
+        unsigned int descents = 0;
+    };
+
+    std::mutex m_prefetchMut;
+    std::map<std::pair<fuse_ino_t, std::string>, PrefetchEntry> m_prefetchEntries;
+    std::unordered_map<fuse_ino_t, PrefetchDir> m_prefetchDirs;
+    std::unordered_map<fuse_ino_t, CrawlState> m_crawl;
+
+    // 一个连接同一时间只处理一个请求，fuse 的多个工作线程各自从连接池中取用
+    struct Connection {
+        std::atomic<int> sock{-1};
+        // 读请求的数据从 socket splice 到管道，再由 libfuse splice 到 /dev/fuse
+        int pipe[2] = {-1, -1};
+        size_t pipeSize = 0;
+        size_t maxRead = 0;
+        std::vector<char> buff;
+    };
+
+    std::vector<std::unique_ptr<Connection>> m_conns;
+    std::vector<Connection *> m_idleConns;
+    std::mutex m_connsMut;
+    std::condition_variable m_connsCv;
+    // 正在建立的连接数，建立连接时不持有 m_connsMut
+    size_t m_connecting;
+    RemoteState m_remoteState;
+
+    bool sessionExited();
+    bool connectToServer(Connection *conn);
+    void closeConnection(Connection *conn);
+    // 向连接池中增加一个连接，连接期间释放 lk
+    bool connectRemote(std::unique_lock<std::mutex> &lk);
+    // 没有连接时 establish 决定是否向对端请求，返回 nullptr 表示无法连接
+    Connection *acquireConnection(bool establish = true);
+    void releaseConnection(Connection *conn);
+
+    bool sendRequest(Connection *conn, const Message &msg);
+    bool transact(Connection *conn, const Message &msg, Message *reply);
+    bool transact(const Message &msg, Message *reply);
+    void replyTrailingData(Connection *conn, fuse_req_t req, size_t size);
+    void drainPipe(Connection *conn);
+    void sendForget(uint64_t node, uint64_t nlookup);
+    void remoteForget(uint64_t node, uint64_t nlookup);
+    fuse_ino_t nodeParent(fuse_ino_t ino);
+    bool detectCrawl(fuse_ino_t ino);
+    void prefetchSubtree(fuse_ino_t ino);
+    void purgePrefetch(std::vector<uint64_t> &stale);
+    void invalidatePrefetch(fuse_ino_t parent, const char *name);
+    std::string nodePath(fuse_ino_t ino);
+    void addNode(fuse_ino_t parent, const char *name, fuse_ino_t ino);
+    void renameNode(fuse_ino_t parent, const char *name, fuse_ino_t newParent, const char *newName);
+    FileHandle *newFileHandle(uint64_t fh, fuse_ino_t ino);
+    void removeFileHandle(FileHandle *handle);
+    int flushPending(FileHandle &handle);
+    void flushNode(fuse_ino_t ino);
+    int remoteFlags(int flags) const;
+    std::shared_ptr<BlockCache::Entry> openCacheEntry(fuse_ino_t ino);
+    int remoteRelease(uint64_t fh);
+
+    void init(struct fuse_conn_info *conn);
+    void lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+    void forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup);
+    void forgetMulti(fuse_req_t req, size_t count, struct fuse_forget_data *forgets);
+    void getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void readlink(fuse_req_t req, fuse_ino_t ino);
+    void open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+    void release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+    void releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void write(fuse_req_t req,
+               fuse_ino_t ino,
+               const char *buf,
+               size_t size,
+               off_t off,
+               struct fuse_file_info *fi);
+    void flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+    void fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+    void create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi);
+    void setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int toSet, struct fuse_file_info *fi);
+    void rename(fuse_req_t req,
+                fuse_ino_t parent,
+                const char *name,
+                fuse_ino_t newParent,
+                const char *newName,
+                unsigned int flags);
+    void unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+    void mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+    void rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
 };
 
 #endif // !FUSE_FUSECLIENT_H
@@ -6,132 +6,676 @@
 
 #include <filesystem>
 #include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
 
 #include <errno.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
 
 #include <QTcpServer>
-#include <QTcpSocket>
+#include <QByteArray>
 
 #include <fmt/core.h>
 #include <google/protobuf/util/time_util.h>
 
-#include "Machine/Machine.h"
+#include "utils/net.h"
 #include "utils/message_helper.h"
 #include "protocol/message.pb.h"
 
 namespace fs = std::filesystem;
 
-static constexpr size_t maxRead = 128 * 1024;
+// 未协商时的默认值，与 fuse 默认的 max_read 一致
+static constexpr size_t defaultMaxRead = 128 * 1024;
+static constexpr size_t maxReadLimit = 4 * 1024 * 1024;
+// 与客户端的 max_write 一致，请求中除写入的数据外只有少量字段
+static constexpr size_t maxWrite = 1024 * 1024;
+static constexpr size_t maxRequestSize = maxWrite + 64 * 1024;
+// 与客户端连接池的大小一致
+static constexpr size_t maxConnections = 4;
+static constexpr size_t tokenSize = 16;
+static constexpr uint64_t rootNode = 1;
+// 取不到描述符限制时的节点数上限，为默认软限制 1024 的一半
+static constexpr size_t defaultMaxNodes = 512;
+// 快照中的每个条目都要占用一个 O_PATH 描述符，单次的条目数远小于描述符的默认上限
+static constexpr uint32_t maxSnapshotEntries = 256;
+// 工作线程按需创建，空闲超过该时间后退出，对端不访问文件时不占用线程
+static constexpr auto workerIdleTimeout = std::chrono::seconds(30);
 
-FuseServer::FuseServer(const std::weak_ptr<Machine> &machine)
+namespace {
+
+// 直接接管连接的 socket 描述符，请求在工作线程中处理，不经过 Qt 事件循环
+class FuseListener : public QTcpServer {
+public:
+    FuseListener(std::function<void(qintptr)> callback, QObject *parent)
+        : QTcpServer(parent)
+        , m_callback(std::move(callback)) {}
+
+protected:
+    void incomingConnection(qintptr fd) override { m_callback(fd); }
+
+private:
+    std::function<void(qintptr)> m_callback;
+};
+
+} // namespace
+
+static std::string generateToken() {
+    std::random_device rd;
+    std::string token(tokenSize, '\0');
+    for (char &c : token) {
+        c = static_cast<char>(rd());
+    }
+    return token;
+}
+
+// 每个节点持有一个描述符，节点最多占用当前软限制的一半，其余留给打开的文件、连接和进程的其他部分。
+// 每次取当前的限制，进程启动后调整过的限制也能生效
+static size_t maxNodes() {
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur != RLIM_INFINITY) {
+        return std::max<size_t>(rlim.rlim_cur / 2, defaultMaxNodes);
+    }
+    return defaultMaxNodes;
+}
+
+// 名字只能是单级，不能借此访问父目录之外的路径
+static bool isValidName(const std::string &name) {
+    return !name.empty() && name != "." && name != ".." && name.find('/') == std::string::npos;
+}
+
+static void fillStat(const struct stat &st, FsStat *fsStat) {
+    fsStat->set_ino(st.st_ino);
+    fsStat->set_nlink(st.st_nlink);
+    fsStat->set_mode(st.st_mode);
+    fsStat->set_uid(st.st_uid);
+    fsStat->set_gid(st.st_gid);
+    fsStat->set_size(st.st_size);
+    fsStat->set_blksize(st.st_blksize);
+    fsStat->set_blocks(st.st_blocks);
+
+    fsStat->mutable_atime()->set_seconds(st.st_atim.tv_sec);
+    fsStat->mutable_atime()->set_nanos(st.st_atim.tv_nsec);
+    fsStat->mutable_mtime()->set_seconds(st.st_mtim.tv_sec);
+    fsStat->mutable_mtime()->set_nanos(st.st_mtim.tv_nsec);
+    fsStat->mutable_ctime()->set_seconds(st.st_ctim.tv_sec);
+    fsStat->mutable_ctime()->set_nanos(st.st_ctim.tv_nsec);
+}
+
+FuseServer::Handle::~Handle() {
+    close(fd);
+}
+
+FuseServer::Connection::~Connection() {
+    close(fd);
+}
+
+FuseServer::FuseServer(const std::weak_ptr<Machine> &machine,
+                       const std::string &peer,
+                       const std::filesystem::path &root,
+                       bool writable)
     : m_machine(machine)
-    , m_listen(new QTcpServer(this))
-    , m_conn(nullptr) {
+    , m_peer(peer)
+    , m_root(root)
+    , m_writable(writable)
+    , m_token(generateToken())
+    , m_rootFd(-1)
+    , m_listen(new FuseListener([this](qintptr fd) { handleNewConnection(fd); }, this))
+    , m_maxWorkers(std::max(2u, std::thread::hardware_concurrency()))
+    , m_idleWorkers(0)
+    , m_stopping(false)
+    , m_lastNode(rootNode)
+    , m_lastHandle(0) {
+    int fd = open(m_root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstatat(fd, "", &st, AT_EMPTY_PATH) == -1) {
+        qWarning() << fmt::format("failed to open root: {}", strerror(errno)).data();
+    } else {
+        m_nodes.emplace(rootNode, Node{fd, st.st_dev, st.st_ino, 1});
+        m_inodes.emplace(std::make_pair(st.st_dev, st.st_ino), rootNode);
+        m_rootFd = fd;
+    }
 
-    m_listen->listen(QHostAddress::Any);
-    m_listen->setMaxPendingConnections(1);
-    connect(m_listen, &QTcpServer::newConnection, this, &FuseServer::handleNewConnection);
+    // 客户端只使用 IPv4 连接，对端地址也按 IPv4 比较
+    m_listen->listen(QHostAddress::AnyIPv4);
 }
 
 FuseServer::~FuseServer() {
-    if (m_conn) {
-        m_conn->close();
-    }
     m_listen->close();
+
+    {
+        std::lock_guard lk(m_connsMut);
+        for (auto &conn : m_conns) {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+    for (auto &conn : m_conns) {
+        if (conn->reader.joinable()) {
+            conn->reader.join();
+        }
+    }
+
+    {
+        std::lock_guard lk(m_tasksMut);
+        m_stopping = true;
+    }
+    m_tasksCv.notify_all();
+    for (auto &worker : m_workers) {
+        worker.join();
+    }
+
+    m_tasks.clear();
+    m_conns.clear();
+    m_handles.clear();
+
+    for (auto &[_, node] : m_nodes) {
+        close(node.fd);
+    }
 }
 
 uint16_t FuseServer::port() const {
     return m_listen->serverPort();
 }
 
-void FuseServer::handleNewConnection() noexcept {
-    if (m_conn) {
-        return;
+bool FuseServer::isPeer(int fd) const {
+    sockaddr_in addr{};
+    socklen_t len = sizeof(addr);
+    in_addr peer{};
+    return getpeername(fd, reinterpret_cast<sockaddr *>(&addr), &len) == 0
+           && addr.sin_family == AF_INET && inet_pton(AF_INET, m_peer.c_str(), &peer) == 1
+           && addr.sin_addr.s_addr == peer.s_addr;
+}
+
+bool FuseServer::authorize(const Message &msg) const {
+    if (!msg.has_fsmethodinitrequest()) {
+        return false;
     }
 
-    // TODO: check client
-    m_conn = m_listen->nextPendingConnection();
-    connect(m_conn, &QTcpSocket::readyRead, this, &FuseServer::handleRequest);
-    connect(m_conn, &QTcpSocket::disconnected, this, &FuseServer::handleDisconnected);
+    // 按固定时间比较，不从耗时泄露令牌内容
+    const std::string &token = msg.fsmethodinitrequest().token();
+    if (token.size() != m_token.size()) {
+        return false;
+    }
 
-    m_listen->close();
+    unsigned char diff = 0;
+    for (size_t i = 0; i < token.size(); i++) {
+        diff |= token[i] ^ m_token[i];
+    }
+    return diff == 0;
 }
 
-void FuseServer::handleDisconnected() noexcept {
-    m_conn->deleteLater();
-    m_conn = nullptr;
-}
+void FuseServer::handleNewConnection(qintptr fd) noexcept {
+    if (!isPeer(fd)) {
+        qWarning("fuse connection not from the paired machine");
+        close(fd);
+        return;
+    }
 
-void FuseServer::handleRequest() noexcept {
-    while (m_conn->size() >= header_size) {
-        QByteArray buffer = m_conn->peek(header_size);
-        auto header = MessageHelper::parseMessageHeader(buffer);
-        if (!header.legal()) {
-            qWarning() << "illegal message from " << m_conn->peerAddress().toString();
-            return;
-        }
+    std::lock_guard lk(m_connsMut);
+    reapConnections();
+    if (m_conns.size() >= maxConnections) {
+        qWarning("too many fuse connections");
+        close(fd);
+        m_listen->pauseAccepting();
+        return;
+    }
 
-        if (m_conn->size() < static_cast<qint64>(header_size + header.size())) {
-            qDebug() << "partial packet:" << m_conn->size();
-            return;
-        }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    Net::tcpSocketSetKeepAliveOption(fd);
 
-        m_conn->read(header_size);
-        auto size = header.size();
-        buffer = m_conn->read(size);
+    auto conn = std::make_shared<Connection>();
+    conn->fd = fd;
+    conn->maxRead = defaultMaxRead;
 
-        Message msg = MessageHelper::parseMessageBody<Message>(buffer.data(), buffer.size());
+    conn->reader = std::thread(&FuseServer::readRequests, this, conn);
+    m_conns.emplace_back(std::move(conn));
 
-        switch (msg.payload_case()) {
-        case Message::PayloadCase::kFsMethodGetAttrRequest: {
-            const auto &req = msg.fsmethodgetattrrequest();
+    // 连接池已满时不再接受新连接，有连接断开后再恢复，以便客户端重连
+    if (m_conns.size() >= maxConnections) {
+        m_listen->pauseAccepting();
+    }
+}
 
-            Message resp;
-            methodGetattr(req, resp.mutable_fsmethodgetattrresponse());
-            m_conn->write(MessageHelper::genMessage(resp));
-            break;
+void FuseServer::reapConnections() {
+    for (auto iter = m_conns.begin(); iter != m_conns.end();) {
+        if ((*iter)->closed) {
+            (*iter)->reader.join();
+            iter = m_conns.erase(iter);
+        } else {
+            ++iter;
         }
-        case Message::PayloadCase::kFsMethodReadRequest: {
-            const auto &req = msg.fsmethodreadrequest();
+    }
+}
+
+void FuseServer::handleConnectionClosed() {
+    std::lock_guard lk(m_connsMut);
+    reapConnections();
+    if (m_conns.size() < maxConnections) {
+        m_listen->resumeAccepting();
+    }
+}
 
-            Message resp;
-            methodRead(req, resp.mutable_fsmethodreadresponse());
-            m_conn->write(MessageHelper::genMessage(resp));
+void FuseServer::readRequests(const std::shared_ptr<Connection> &conn) noexcept {
+    std::vector<char> buffer;
+    bool authorized = false;
+    while (true) {
+        MessageHeader header;
+        if (!Net::recvAll(conn->fd, &header, header_size)) {
             break;
         }
-        case Message::PayloadCase::kFsMethodReadDirRequest: {
-            const auto &req = msg.fsmethodreaddirrequest();
 
-            Message resp;
-            methodReaddir(req, resp.mutable_fsmethodreaddirresponse());
-            m_conn->write(MessageHelper::genMessage(resp));
+        if (!header.legal()) {
+            qWarning("illegal message from fuse client");
             break;
         }
-        case Message::PayloadCase::kFsMethodOpenRequest: {
-            const auto &req = msg.fsmethodopenrequest();
 
-            Message resp;
-            methodOpen(req, resp.mutable_fsmethodopenresponse());
-            m_conn->write(MessageHelper::genMessage(resp));
+        // 长度由对端决定，过大的请求直接断开，避免分配失败
+        if (header.size() > maxRequestSize) {
+            qWarning() << fmt::format("fuse request too large: {}", header.size()).data();
             break;
         }
-        case Message::PayloadCase::kFsMethodReleaseRequest: {
-            const auto &req = msg.fsmethodreleaserequest();
 
-            Message resp;
-            methodRelease(req, resp.mutable_fsmethodreleaseresponse());
-            m_conn->write(MessageHelper::genMessage(resp));
+        buffer.resize(header.size());
+        if (!Net::recvAll(conn->fd, buffer.data(), buffer.size())) {
             break;
         }
-        default: {
-            qWarning() << "FuseServer unknown message type:" << msg.payload_case();
-            break;
+
+        auto msg = std::make_unique<Message>();
+        msg->ParseFromArray(buffer.data(), buffer.size());
+
+        // 在交给工作线程之前验证，未通过验证的连接上不会执行任何操作
+        if (!authorized) {
+            if (!authorize(*msg)) {
+                qWarning("fuse client not authorized");
+                break;
+            }
+            authorized = true;
         }
+
+        {
+            std::lock_guard lk(m_tasksMut);
+            m_tasks.push_back(Task{conn, std::move(msg)});
+            size_t workers = m_workers.size() - m_exitedWorkers.size();
+            if (m_idleWorkers < m_tasks.size() && workers < m_maxWorkers) {
+                spawnWorker();
+            }
         }
+        m_tasksCv.notify_one();
     }
+
+    shutdown(conn->fd, SHUT_RDWR);
+    conn->closed = true;
+
+    QMetaObject::invokeMethod(this, &FuseServer::handleConnectionClosed, Qt::QueuedConnection);
+}
+
+void FuseServer::spawnWorker() {
+    // 回收已经退出的线程
+    for (auto id : m_exitedWorkers) {
+        auto iter = std::find_if(m_workers.begin(), m_workers.end(), [id](const std::thread &t) {
+            return t.get_id() == id;
+        });
+        if (iter != m_workers.end()) {
+            iter->join();
+            m_workers.erase(iter);
+        }
+    }
+    m_exitedWorkers.clear();
+
+    m_workers.emplace_back(&FuseServer::workerLoop, this);
+}
+
+void FuseServer::workerLoop() noexcept {
+    std::unique_lock lk(m_tasksMut);
+    while (true) {
+        m_idleWorkers++;
+        bool ready = m_tasksCv.wait_for(lk, workerIdleTimeout, [this] {
+            return m_stopping || !m_tasks.empty();
+        });
+        m_idleWorkers--;
+        if (m_stopping) {
+            return;
+        }
+        if (!ready) {
+            // 空闲超时，由下一次创建线程或析构时 join
+            m_exitedWorkers.push_back(std::this_thread::get_id());
+            return;
+        }
+
+        Task task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+
+        lk.unlock();
+        handleRequest(*task.conn, *task.msg);
+        task = {};
+        lk.lock();
+    }
+}
+
+void FuseServer::sendResponse(Connection &conn, const Message &msg, const char *data, size_t size) {
+    thread_local std::vector<char> buff;
+
+    size_t msgSize = msg.ByteSizeLong();
+    buff.resize(header_size + msgSize);
+    new (buff.data()) MessageHeader(msgSize);
+    msg.SerializeToArray(buff.data() + header_size, msgSize);
+
+    std::lock_guard lk(conn.writeMut);
+    if (!Net::sendAll(conn.fd, buff.data(), buff.size(), size > 0 ? MSG_MORE : 0)
+        || (size > 0 && !Net::sendAll(conn.fd, data, size))) {
+        shutdown(conn.fd, SHUT_RDWR);
+    }
+}
+
+void FuseServer::handleRequest(Connection &conn, const Message &msg) noexcept {
+    switch (msg.payload_case()) {
+    case Message::PayloadCase::kFsMethodInitRequest: {
+        const auto &req = msg.fsmethodinitrequest();
+
+        Message resp;
+        methodInit(conn, req, resp.mutable_fsmethodinitresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodLookupRequest: {
+        const auto &req = msg.fsmethodlookuprequest();
+
+        Message resp;
+        methodLookup(req, resp.mutable_fsmethodlookupresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodForgetRequest: {
+        methodForget(msg.fsmethodforgetrequest());
+        break;
+    }
+    case Message::PayloadCase::kFsMethodGetAttrRequest: {
+        const auto &req = msg.fsmethodgetattrrequest();
+
+        Message resp;
+        methodGetattr(req, resp.mutable_fsmethodgetattrresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodReadRequest: {
+        const auto &req = msg.fsmethodreadrequest();
+        thread_local std::vector<char> readBuff;
+
+        Message resp;
+        size_t trailing = methodRead(req, resp.mutable_fsmethodreadresponse(), conn.maxRead, readBuff);
+        sendResponse(conn, resp, readBuff.data(), trailing);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodReadlinkRequest: {
+        const auto &req = msg.fsmethodreadlinkrequest();
+
+        Message resp;
+        methodReadlink(req, resp.mutable_fsmethodreadlinkresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodReadDirRequest: {
+        const auto &req = msg.fsmethodreaddirrequest();
+
+        Message resp;
+        methodReaddir(req, resp.mutable_fsmethodreaddirresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodOpenRequest: {
+        const auto &req = msg.fsmethodopenrequest();
+
+        Message resp;
+        methodOpen(req, resp.mutable_fsmethodopenresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodReleaseRequest: {
+        const auto &req = msg.fsmethodreleaserequest();
+
+        Message resp;
+        methodRelease(req, resp.mutable_fsmethodreleaseresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodWriteRequest: {
+        const auto &req = msg.fsmethodwriterequest();
+
+        Message resp;
+        methodWrite(req, resp.mutable_fsmethodwriteresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodCreateRequest: {
+        const auto &req = msg.fsmethodcreaterequest();
+
+        Message resp;
+        methodCreate(req, resp.mutable_fsmethodcreateresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodSetAttrRequest: {
+        const auto &req = msg.fsmethodsetattrrequest();
+
+        Message resp;
+        methodSetattr(req, resp.mutable_fsmethodsetattrresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodRenameRequest: {
+        const auto &req = msg.fsmethodrenamerequest();
+
+        Message resp;
+        methodRename(req, resp.mutable_fsmethodrenameresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodUnlinkRequest: {
+        const auto &req = msg.fsmethodunlinkrequest();
+
+        Message resp;
+        methodUnlink(req, resp.mutable_fsmethodunlinkresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodMkdirRequest: {
+        const auto &req = msg.fsmethodmkdirrequest();
+
+        Message resp;
+        methodMkdir(req, resp.mutable_fsmethodmkdirresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodRmdirRequest: {
+        const auto &req = msg.fsmethodrmdirrequest();
+
+        Message resp;
+        methodRmdir(req, resp.mutable_fsmethodrmdirresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodFsyncRequest: {
+        const auto &req = msg.fsmethodfsyncrequest();
+
+        Message resp;
+        methodFsync(req, resp.mutable_fsmethodfsyncresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    case Message::PayloadCase::kFsMethodSnapshotRequest: {
+        const auto &req = msg.fsmethodsnapshotrequest();
+
+        Message resp;
+        methodSnapshot(req, resp.mutable_fsmethodsnapshotresponse());
+        sendResponse(conn, resp);
+        break;
+    }
+    default: {
+        qWarning() << "FuseServer unknown message type:" << msg.payload_case();
+        break;
+    }
+    }
+}
+
+int FuseServer::openPath(const std::string &path, int flags) const {
+    fs::path relative = fs::path(path).relative_path().lexically_normal();
+    if (relative.empty()) {
+        relative = ".";
+    } else if (*relative.begin() == "..") {
+        errno = EACCES;
+        return -1;
+    }
+
+    // ".." 和符号链接都不能跳出根目录
+    open_how how{};
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    int fd = static_cast<int>(syscall(SYS_openat2, m_rootFd, relative.c_str(), &how, sizeof(how)));
+    if (fd == -1 && errno == ENOSYS) {
+        // 5.6 之前的内核没有 openat2，只能依靠上面的检查，无法阻止指向根目录之外的符号链接
+        fd = openat(m_rootFd, relative.c_str(), flags | O_CLOEXEC);
+    }
+    return fd;
+}
+
+uint64_t FuseServer::registerNode(int fd, const struct stat &st) {
+    std::unique_lock lk(m_nodesMut);
+
+    uint64_t node;
+    auto iter = m_inodes.find(std::make_pair(st.st_dev, st.st_ino));
+    if (iter != m_inodes.end()) {
+        node = iter->second;
+        close(fd);
+    } else if (m_nodes.size() >= maxNodes()) {
+        qWarning() << fmt::format("too many nodes: {}", m_nodes.size()).data();
+        close(fd);
+        return 0;
+    } else {
+        node = ++m_lastNode;
+        m_nodes.emplace(node, Node{fd, st.st_dev, st.st_ino, 0});
+        m_inodes.emplace(std::make_pair(st.st_dev, st.st_ino), node);
+    }
+    m_nodes[node].nlookup++;
+
+    return node;
+}
+
+void FuseServer::forgetNode(uint64_t node, uint64_t nlookup) {
+    std::unique_lock lk(m_nodesMut);
+
+    auto iter = m_nodes.find(node);
+    if (iter == m_nodes.end() || node == rootNode) {
+        return;
+    }
+
+    Node &n = iter->second;
+    n.nlookup -= std::min(n.nlookup, nlookup);
+    if (n.nlookup > 0) {
+        return;
+    }
+
+    close(n.fd);
+    m_inodes.erase(std::make_pair(n.dev, n.ino));
+    m_nodes.erase(iter);
+}
+
+uint64_t FuseServer::addHandle(int fd) {
+    std::unique_lock lk(m_handlesMut);
+
+    uint64_t fh = ++m_lastHandle;
+    m_handles.emplace(fh, std::shared_ptr<Handle>(new Handle{fd}));
+    return fh;
+}
+
+std::shared_ptr<FuseServer::Handle> FuseServer::getHandle(uint64_t fh) {
+    std::shared_lock lk(m_handlesMut);
+
+    auto iter = m_handles.find(fh);
+    if (iter == m_handles.end()) {
+        return nullptr;
+    }
+
+    return iter->second;
+}
+
+void FuseServer::methodInit(Connection &conn,
+                            const FsMethodInitRequest &req,
+                            FsMethodInitResponse *resp) {
+    qInfo() << fmt::format("methodInit: max_read: {}", req.max_read()).data();
+
+    conn.maxRead = req.max_read() > 0 ? std::min<size_t>(req.max_read(), maxReadLimit)
+                                      : defaultMaxRead;
+
+    resp->set_serial(req.serial());
+    resp->set_result(0);
+    resp->set_max_read(conn.maxRead);
+}
+
+void FuseServer::methodLookup(const FsMethodLookupRequest &req, FsMethodLookupResponse *resp) {
+    qDebug() << fmt::format("methodLookup: {}, {}", req.parent(), req.name()).data();
+
+    resp->set_serial(req.serial());
+
+    if (!isValidName(req.name())) {
+        resp->set_result(-EINVAL);
+        return;
+    }
+
+    int fd;
+    struct stat st;
+    {
+        std::shared_lock lk(m_nodesMut);
+
+        auto parent = m_nodes.find(req.parent());
+        if (parent == m_nodes.end()) {
+            resp->set_result(-ESTALE);
+            return;
+        }
+
+        // 不跟随符号链接，否则导出目录中的链接可以指向 m_root 之外，
+        // 链接本身作为节点返回，由客户端 readlink 后在本地解析
+        fd = openat(parent->second.fd, req.name().c_str(), O_PATH | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) {
+            resp->set_result(-errno);
+            return;
+        }
+    }
+
+    if (fstatat(fd, "", &st, AT_EMPTY_PATH) == -1) {
+        resp->set_result(-errno);
+        close(fd);
+        return;
+    }
+
+    uint64_t node = registerNode(fd, st);
+    if (node == 0) {
+        resp->set_result(-ENFILE);
+        return;
+    }
+
+    resp->set_result(0);
+    resp->set_node(node);
+    fillStat(st, resp->mutable_stat());
+}
+
+void FuseServer::methodForget(const FsMethodForgetRequest &req) {
+    qDebug() << fmt::format("methodForget: {}, {}", req.node(), req.nlookup()).data();
+
+    forgetNode(req.node(), req.nlookup());
 }
 
 void FuseServer::methodGetattr(const FsMethodGetAttrRequest &req, FsMethodGetAttrResponse *resp) {
@@ -140,24 +684,34 @@ void FuseServer::methodGetattr(const FsMethodGetAttrRequest &req, FsMethodGetAtt
     resp->set_serial(req.serial());
 
     struct stat st;
-    int result = stat(req.path().c_str(), &st);
-
-    resp->set_result(result);
-    resp->mutable_stat()->set_ino(st.st_ino);
-    resp->mutable_stat()->set_nlink(st.st_nlink);
-    resp->mutable_stat()->set_mode(st.st_mode);
-    resp->mutable_stat()->set_uid(st.st_uid);
-    resp->mutable_stat()->set_gid(st.st_gid);
-    resp->mutable_stat()->set_size(st.st_size);
-    resp->mutable_stat()->set_blksize(st.st_blksize);
-    resp->mutable_stat()->set_blocks(st.st_blocks);
-
-    resp->mutable_stat()->mutable_atime()->set_seconds(st.st_atim.tv_sec);
-    resp->mutable_stat()->mutable_atime()->set_nanos(st.st_atim.tv_nsec);
-    resp->mutable_stat()->mutable_mtime()->set_seconds(st.st_mtim.tv_sec);
-    resp->mutable_stat()->mutable_mtime()->set_nanos(st.st_mtim.tv_nsec);
-    resp->mutable_stat()->mutable_ctime()->set_seconds(st.st_ctim.tv_sec);
-    resp->mutable_stat()->mutable_ctime()->set_nanos(st.st_ctim.tv_nsec);
+    int result;
+    if (req.has_node()) {
+        std::shared_lock lk(m_nodesMut);
+
+        auto node = m_nodes.find(req.node());
+        if (node == m_nodes.end()) {
+            resp->set_result(-ESTALE);
+            return;
+        }
+
+        result = fstatat(node->second.fd, "", &st, AT_EMPTY_PATH);
+    } else {
+        int fd = openPath(req.path(), O_PATH);
+        result = fd == -1 ? -1 : fstatat(fd, "", &st, AT_EMPTY_PATH);
+        if (fd != -1) {
+            int err = errno;
+            close(fd);
+            errno = err;
+        }
+    }
+
+    if (result == -1) {
+        resp->set_result(-errno);
+        return;
+    }
+
+    resp->set_result(0);
+    fillStat(st, resp->mutable_stat());
 
     qDebug() << fmt::format("path: {}, mode: {}, S_IFDIR: {}, S_IFREG: {}, nlink: {}",
                             req.path(),
@@ -168,6 +722,31 @@ void FuseServer::methodGetattr(const FsMethodGetAttrRequest &req, FsMethodGetAtt
                     .data();
 }
 
+void FuseServer::methodReadlink(const FsMethodReadlinkRequest &req, FsMethodReadlinkResponse *resp) {
+    qDebug() << fmt::format("methodReadlink: {}", req.node()).data();
+
+    resp->set_serial(req.serial());
+
+    std::shared_lock lk(m_nodesMut);
+
+    auto node = m_nodes.find(req.node());
+    if (node == m_nodes.end()) {
+        resp->set_result(-ESTALE);
+        return;
+    }
+
+    // 空路径时读取 O_PATH 描述符所指的链接本身
+    char target[PATH_MAX];
+    ssize_t n = readlinkat(node->second.fd, "", target, sizeof(target));
+    if (n == -1) {
+        resp->set_result(-errno);
+        return;
+    }
+
+    resp->set_result(0);
+    resp->set_target(target, n);
+}
+
 void FuseServer::methodOpen(const FsMethodOpenRequest &req, FsMethodOpenResponse *resp) {
     qInfo() << fmt::format("methodOpen: {}", req.path()).data();
 
@@ -178,43 +757,86 @@ void FuseServer::methodOpen(const FsMethodOpenRequest &req, FsMethodOpenResponse
         flags = req.fi().flags();
     }
 
-    int result = 0;
-    int fd = open(req.path().c_str(), flags);
+    if (!m_writable && ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_TRUNC | O_CREAT)))) {
+        resp->set_result(-EROFS);
+        return;
+    }
+
+    int fd;
+    if (req.has_node()) {
+        std::shared_lock lk(m_nodesMut);
+
+        auto node = m_nodes.find(req.node());
+        if (node == m_nodes.end()) {
+            resp->set_result(-ESTALE);
+            return;
+        }
+
+        // O_PATH 打开的描述符不能读写，通过 /proc/self/fd 重新打开同一个 inode
+        auto procPath = fmt::format("/proc/self/fd/{}", node->second.fd);
+        fd = open(procPath.c_str(), (flags & ~O_NOFOLLOW) | O_CLOEXEC);
+    } else {
+        fd = openPath(req.path(), flags);
+    }
+
     if (fd == -1) {
-        result = errno;
+        resp->set_result(-errno);
+        return;
     }
 
-    resp->set_result(result);
-    resp->set_fh(fd);
+    resp->set_result(0);
+    resp->set_fh(addHandle(fd));
 }
 
-void FuseServer::methodRead(const FsMethodReadRequest &req, FsMethodReadResponse *resp) {
+size_t FuseServer::methodRead(const FsMethodReadRequest &req,
+                              FsMethodReadResponse *resp,
+                              size_t maxRead,
+                              std::vector<char> &buff) {
     resp->set_serial(req.serial());
 
     if (!req.has_fi()) {
         qWarning("methodRead: no fi");
         resp->set_result(-EBADF);
-        return;
+        return 0;
     }
 
-    qInfo() << fmt::format("methodRead: fh: {}", req.fi().fh()).data();
+    qDebug() << fmt::format("methodRead: fh: {}", req.fi().fh()).data();
+
+    auto handle = getHandle(req.fi().fh());
+    if (!handle) {
+        resp->set_result(-EBADF);
+        return 0;
+    }
+
+    size_t size = std::min<size_t>(req.size(), maxRead);
+
+    // trailing 模式下数据不经过 protobuf，直接跟在响应后面写出
+    char *data;
+    if (req.trailing()) {
+        if (buff.size() < size) {
+            buff.resize(size);
+        }
+        data = buff.data();
+    } else {
+        resp->mutable_data()->resize(size);
+        data = resp->mutable_data()->data();
+    }
 
-    off_t off = lseek(req.fi().fh(), req.offset(), SEEK_SET);
-    if (off == -1) {
-        qWarning() << fmt::format("lseek failed: {}({})", strerror(errno), errno).data();
+    // pread 不修改文件偏移，同一句柄上的并发读互不影响
+    ssize_t n = pread(handle->fd, data, size, req.offset());
+    if (n == -1) {
         resp->set_result(-errno);
-        return;
+        resp->clear_data();
+        return 0;
     }
 
-    size_t size = req.size();
-    if (size > maxRead) {
-        size = maxRead;
+    resp->set_result(n);
+    if (req.trailing()) {
+        return n;
     }
 
-    resp->mutable_data()->resize(size);
-    size = read(req.fi().fh(), resp->mutable_data()->data(), size);
-    resp->mutable_data()->resize(size);
-    resp->set_result(size);
+    resp->mutable_data()->resize(n);
+    return 0;
 }
 
 void FuseServer::methodRelease(const FsMethodReleaseRequest &req, FsMethodReleaseResponse *resp) {
@@ -222,13 +844,15 @@ void FuseServer::methodRelease(const FsMethodReleaseRequest &req, FsMethodReleas
 
     if (!req.has_fi()) {
         qWarning("methodRelease: no fi");
-        resp->set_result(EBADF);
+        resp->set_result(-EBADF);
         return;
     }
 
     qInfo() << fmt::format("methodRelease: fh: {}", req.fi().fh()).data();
-    int result = close(req.fi().fh());
-    resp->set_result(result);
+
+    std::unique_lock lk(m_handlesMut);
+    // 句柄上可能仍有未完成的读，fd 在最后一个引用释放时关闭
+    resp->set_result(m_handles.erase(req.fi().fh()) > 0 ? 0 : -EBADF);
 }
 
 void FuseServer::methodReaddir(const FsMethodReadDirRequest &req, FsMethodReadDirResponse *resp) {
@@ -236,18 +860,531 @@ void FuseServer::methodReaddir(const FsMethodReadDirRequest &req, FsMethodReadDi
 
     resp->set_serial(req.serial());
 
+    if (req.has_node()) {
+        int fd;
+        dev_t dev;
+        {
+            std::shared_lock lk(m_nodesMut);
+
+            auto node = m_nodes.find(req.node());
+            if (node == m_nodes.end()) {
+                resp->set_result(-ESTALE);
+                return;
+            }
+
+            fd = openat(node->second.fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            dev = node->second.dev;
+        }
+
+        if (fd == -1) {
+            resp->set_result(-errno);
+            return;
+        }
+
+        DIR *dir = fdopendir(fd);
+        if (!dir) {
+            resp->set_result(-errno);
+            close(fd);
+            return;
+        }
+
+        std::shared_lock lk(m_nodesMut);
+        while (struct dirent *ent = readdir(dir)) {
+            auto *entry = resp->add_entry();
+            entry->set_name(ent->d_name);
+            entry->set_mode(DTTOIF(ent->d_type));
+
+            auto iter = m_inodes.find(std::make_pair(dev, ent->d_ino));
+            if (iter != m_inodes.end()) {
+                entry->set_ino(iter->second);
+            }
+        }
+        closedir(dir);
+
+        resp->set_result(0);
+        return;
+    }
+
+    int fd = openPath(req.path(), O_RDONLY | O_DIRECTORY);
+    DIR *dir = fd == -1 ? nullptr : fdopendir(fd);
+    if (!dir) {
+        resp->set_result(-errno);
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    while (struct dirent *ent = readdir(dir)) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+        resp->mutable_item()->Add(ent->d_name);
+    }
+    closedir(dir);
+
+    resp->set_result(0);
+}
+
+void FuseServer::methodWrite(const FsMethodWriteRequest &req, FsMethodWriteResponse *resp) {
+    resp->set_serial(req.serial());
+
+    if (!m_writable) {
+        resp->set_result(-EROFS);
+        return;
+    }
+
+    if (!req.has_fi()) {
+        qWarning("methodWrite: no fi");
+        resp->set_result(-EBADF);
+        return;
+    }
+
+    qDebug() << fmt::format("methodWrite: fh: {}, offset: {}, size: {}",
+                            req.fi().fh(),
+                            req.offset(),
+                            req.data().size())
+                    .data();
+
+    auto handle = getHandle(req.fi().fh());
+    if (!handle) {
+        resp->set_result(-EBADF);
+        return;
+    }
+
+    const std::string &data = req.data();
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = pwrite(handle->fd,
+                           data.data() + written,
+                           data.size() - written,
+                           req.offset() + written);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            resp->set_result(-errno);
+            return;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        written += n;
+    }
+
+    resp->set_result(written);
+}
+
+void FuseServer::methodCreate(const FsMethodCreateRequest &req, FsMethodCreateResponse *resp) {
+    qInfo() << fmt::format("methodCreate: {}, {}", req.parent(), req.name()).data();
+
+    resp->set_serial(req.serial());
+
+    if (!m_writable) {
+        resp->set_result(-EROFS);
+        return;
+    }
+
+    if (!isValidName(req.name())) {
+        resp->set_result(-EINVAL);
+        return;
+    }
+
+    int flags = req.has_fi() ? req.fi().flags() : O_RDWR;
+
+    int fd;
+    int pathFd;
+    {
+        std::shared_lock lk(m_nodesMut);
+
+        auto parent = m_nodes.find(req.parent());
+        if (parent == m_nodes.end()) {
+            resp->set_result(-ESTALE);
+            return;
+        }
+
+        fd = openat(parent->second.fd, req.name().c_str(), flags | O_CREAT | O_CLOEXEC, req.mode());
+        if (fd == -1) {
+            resp->set_result(-errno);
+            return;
+        }
+
+        pathFd = openat(parent->second.fd, req.name().c_str(), O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    }
+
+    struct stat st;
+    if (pathFd == -1 || fstatat(pathFd, "", &st, AT_EMPTY_PATH) == -1) {
+        resp->set_result(-errno);
+        if (pathFd != -1) {
+            close(pathFd);
+        }
+        close(fd);
+        return;
+    }
+
+    uint64_t node = registerNode(pathFd, st);
+    if (node == 0) {
+        resp->set_result(-ENFILE);
+        close(fd);
+        return;
+    }
+
+    resp->set_result(0);
+    resp->set_node(node);
+    resp->set_fh(addHandle(fd));
+    fillStat(st, resp->mutable_stat());
+}
+
+void FuseServer::methodSetattr(const FsMethodSetAttrRequest &req, FsMethodSetAttrResponse *resp) {
+    qInfo() << fmt::format("methodSetattr: {}", req.node()).data();
+
+    resp->set_serial(req.serial());
+
+    if (!m_writable) {
+        resp->set_result(-EROFS);
+        return;
+    }
+
+    std::shared_ptr<Handle> handle;
+    if (req.has_fi()) {
+        handle = getHandle(req.fi().fh());
+    }
+
+    std::shared_lock lk(m_nodesMut);
+
+    auto node = m_nodes.find(req.node());
+    if (node == m_nodes.end()) {
+        resp->set_result(-ESTALE);
+        return;
+    }
+
+    int fd = node->second.fd;
+    // O_PATH 描述符不支持 fchmod/ftruncate 等调用，通过 /proc/self/fd 操作同一个 inode
+    auto procPath = fmt::format("/proc/self/fd/{}", fd);
+
+    int result = 0;
+    if (req.has_mode()) {
+        result = chmod(procPath.c_str(), req.mode());
+    }
+
+    if (result == 0 && (req.has_uid() || req.has_gid())) {
+        uid_t uid = req.has_uid() ? req.uid() : static_cast<uid_t>(-1);
+        gid_t gid = req.has_gid() ? req.gid() : static_cast<gid_t>(-1);
+        result = fchownat(fd, "", uid, gid, AT_EMPTY_PATH);
+    }
+
+    if (result == 0 && req.has_size()) {
+        result = handle ? ftruncate(handle->fd, req.size()) : truncate(procPath.c_str(), req.size());
+    }
+
+    if (result == 0
+        && (req.has_atime() || req.has_mtime() || req.atime_now() || req.mtime_now())) {
+        struct timespec times[2];
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_nsec = UTIME_OMIT;
+        if (req.atime_now()) {
+            times[0].tv_nsec = UTIME_NOW;
+        } else if (req.has_atime()) {
+            times[0].tv_sec = req.atime().seconds();
+            times[0].tv_nsec = req.atime().nanos();
+        }
+        if (req.mtime_now()) {
+            times[1].tv_nsec = UTIME_NOW;
+        } else if (req.has_mtime()) {
+            times[1].tv_sec = req.mtime().seconds();
+            times[1].tv_nsec = req.mtime().nanos();
+        }
+
+        result = utimensat(AT_FDCWD, procPath.c_str(), times, 0);
+    }
+
+    struct stat st;
+    if (result == -1 || fstatat(fd, "", &st, AT_EMPTY_PATH) == -1) {
+        resp->set_result(-errno);
+        return;
+    }
+
+    resp->set_result(0);
+    fillStat(st, resp->mutable_stat());
+}
+
+void FuseServer::methodRename(const FsMethodRenameRequest &req, FsMethodRenameResponse *resp) {
+    qInfo() << fmt::format("methodRename: {}, {} -> {}, {}",
+                           req.parent(),
+                           req.name(),
+                           req.new_parent(),
+                           req.new_name())
+                   .data();
+
+    resp->set_serial(req.serial());
+
+    if (!m_writable) {
+        resp->set_result(-EROFS);
+        return;
+    }
+
+    if (!isValidName(req.name()) || !isValidName(req.new_name())) {
+        resp->set_result(-EINVAL);
+        return;
+    }
+
+    std::shared_lock lk(m_nodesMut);
+
+    auto parent = m_nodes.find(req.parent());
+    auto newParent = m_nodes.find(req.new_parent());
+    if (parent == m_nodes.end() || newParent == m_nodes.end()) {
+        resp->set_result(-ESTALE);
+        return;
+    }
+
+    int result = renameat2(parent->second.fd,
+                           req.name().c_str(),
+                           newParent->second.fd,
+                           req.new_name().c_str(),
+                           req.flags());
+    resp->set_result(result == -1 ? -errno : 0);
+}
+
+void FuseServer::methodUnlink(const FsMethodUnlinkRequest &req, FsMethodUnlinkResponse *resp) {
+    qInfo() << fmt::format("methodUnlink: {}, {}", req.parent(), req.name()).data();
+
+    resp->set_serial(req.serial());
+
+    if (!m_writable) {
+        resp->set_result(-EROFS);
+        return;
+    }
+
+    if (!isValidName(req.name())) {
+        resp->set_result(-EINVAL);
+        return;
+    }
+
+    std::shared_lock lk(m_nodesMut);
+
+    auto parent = m_nodes.find(req.parent());
+    if (parent == m_nodes.end()) {
+        resp->set_result(-ESTALE);
+        return;
+    }
+
+    int result = unlinkat(parent->second.fd, req.name().c_str(), 0);
+    resp->set_result(result == -1 ? -errno : 0);
+}
+
+void FuseServer::methodMkdir(const FsMethodMkdirRequest &req, FsMethodMkdirResponse *resp) {
+    qInfo() << fmt::format("methodMkdir: {}, {}", req.parent(), req.name()).data();
+
+    resp->set_serial(req.serial());
+
+    if (!m_writable) {
+        resp->set_result(-EROFS);
+        return;
+    }
+
+    if (!isValidName(req.name())) {
+        resp->set_result(-EINVAL);
+        return;
+    }
+
+    int fd;
+    {
+        std::shared_lock lk(m_nodesMut);
+
+        auto parent = m_nodes.find(req.parent());
+        if (parent == m_nodes.end()) {
+            resp->set_result(-ESTALE);
+            return;
+        }
+
+        if (mkdirat(parent->second.fd, req.name().c_str(), req.mode()) == -1) {
+            resp->set_result(-errno);
+            return;
+        }
+
+        fd = openat(parent->second.fd, req.name().c_str(), O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    }
+
+    struct stat st;
+    if (fd == -1 || fstatat(fd, "", &st, AT_EMPTY_PATH) == -1) {
+        resp->set_result(-errno);
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    uint64_t node = registerNode(fd, st);
+    if (node == 0) {
+        resp->set_result(-ENFILE);
+        return;
+    }
+
     resp->set_result(0);
+    resp->set_node(node);
+    fillStat(st, resp->mutable_stat());
+}
 
-    fs::path p = req.path();
+void FuseServer::methodRmdir(const FsMethodRmdirRequest &req, FsMethodRmdirResponse *resp) {
+    qInfo() << fmt::format("methodRmdir: {}, {}", req.parent(), req.name()).data();
+
+    resp->set_serial(req.serial());
+
+    if (!m_writable) {
+        resp->set_result(-EROFS);
+        return;
+    }
+
+    if (!isValidName(req.name())) {
+        resp->set_result(-EINVAL);
+        return;
+    }
+
+    std::shared_lock lk(m_nodesMut);
+
+    auto parent = m_nodes.find(req.parent());
+    if (parent == m_nodes.end()) {
+        resp->set_result(-ESTALE);
+        return;
+    }
+
+    int result = unlinkat(parent->second.fd, req.name().c_str(), AT_REMOVEDIR);
+    resp->set_result(result == -1 ? -errno : 0);
+}
+
+void FuseServer::methodFsync(const FsMethodFsyncRequest &req, FsMethodFsyncResponse *resp) {
+    resp->set_serial(req.serial());
+
+    if (!req.has_fi()) {
+        qWarning("methodFsync: no fi");
+        resp->set_result(-EBADF);
+        return;
+    }
 
-    auto iter = fs::directory_iterator(p, fs::directory_options::skip_permission_denied);
-    auto end_iter = fs::end(iter);
-    auto ec = std::error_code();
-    for (; iter != end_iter; iter.increment(ec)) {
-        if (ec) {
+    auto handle = getHandle(req.fi().fh());
+    if (!handle) {
+        resp->set_result(-EBADF);
+        return;
+    }
+
+    int result = req.datasync() ? fdatasync(handle->fd) : fsync(handle->fd);
+    resp->set_result(result == -1 ? -errno : 0);
+}
+
+void FuseServer::methodSnapshot(const FsMethodSnapshotRequest &req, FsMethodSnapshotResponse *resp) {
+    qInfo() << fmt::format("methodSnapshot: {}, depth: {}, entries: {}",
+                           req.node(),
+                           req.max_depth(),
+                           req.max_entries())
+                   .data();
+
+    resp->set_serial(req.serial());
+
+    uint32_t maxEntries = req.max_entries() > 0 ? std::min(req.max_entries(), maxSnapshotEntries)
+                                                : maxSnapshotEntries;
+    {
+        // 预取最多使用剩余节点额度的一半，留给真正的 lookup
+        std::shared_lock lk(m_nodesMut);
+        size_t limit = maxNodes();
+        size_t available = limit > m_nodes.size() ? limit - m_nodes.size() : 0;
+        maxEntries = std::min<size_t>(maxEntries, available / 2);
+    }
+
+    // 按层遍历，队列中只保存节点，打开目录时再从节点表中取描述符，避免同时持有过多描述符
+    struct Dir {
+        uint64_t node;
+        uint32_t index;
+        uint32_t depth;
+    };
+    std::deque<Dir> queue{{req.node(), 0, 1}};
+
+    FsSnapshot snapshot;
+    while (!queue.empty()) {
+        Dir dir = queue.front();
+        queue.pop_front();
+
+        int fd;
+        {
+            std::shared_lock lk(m_nodesMut);
+
+            auto node = m_nodes.find(dir.node);
+            if (node == m_nodes.end()) {
+                if (dir.index == 0) {
+                    resp->set_result(-ESTALE);
+                    return;
+                }
+                continue;
+            }
+
+            fd = openat(node->second.fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+
+        DIR *dp = fd == -1 ? nullptr : fdopendir(fd);
+        if (!dp) {
+            if (dir.index == 0) {
+                resp->set_result(-errno);
+                if (fd != -1) {
+                    close(fd);
+                }
+                return;
+            }
+            if (fd != -1) {
+                close(fd);
+            }
             continue;
         }
 
-        resp->mutable_item()->Add(iter->path().filename().string());
+        bool complete = true;
+        struct dirent *ent;
+        while ((ent = readdir(dp)) != nullptr) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+
+            if (static_cast<uint32_t>(snapshot.entry_size()) >= maxEntries) {
+                complete = false;
+                break;
+            }
+
+            struct stat st;
+            int pathFd = openat(dirfd(dp), ent->d_name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+            if (pathFd == -1 || fstatat(pathFd, "", &st, AT_EMPTY_PATH) == -1) {
+                if (pathFd != -1) {
+                    close(pathFd);
+                }
+                complete = false;
+                continue;
+            }
+
+            uint64_t node = registerNode(pathFd, st);
+            if (node == 0) {
+                complete = false;
+                break;
+            }
+
+            FsSnapshotEntry *entry = snapshot.add_entry();
+            entry->set_parent(dir.index);
+            entry->set_name(ent->d_name);
+            entry->set_node(node);
+            fillStat(st, entry->mutable_stat());
+
+            if (S_ISDIR(st.st_mode) && dir.depth < req.max_depth()) {
+                queue.push_back(Dir{entry->node(), static_cast<uint32_t>(snapshot.entry_size()), dir.depth + 1});
+            }
+        }
+        closedir(dp);
+
+        if (dir.index == 0) {
+            resp->set_complete(complete);
+        } else {
+            snapshot.mutable_entry(dir.index - 1)->set_complete(complete);
+        }
     }
+
+    std::string data = snapshot.SerializeAsString();
+    QByteArray compressed = qCompress(reinterpret_cast<const uchar *>(data.data()), data.size());
+
+    resp->set_result(0);
+    resp->set_data(compressed.data(), compressed.size());
 }
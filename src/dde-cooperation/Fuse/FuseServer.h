@@ -7,40 +7,150 @@
 
 #include <filesystem>
 #include <thread>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "protocol/fs.pb.h"
 
 #include <QObject>
 
 class QTcpServer;
-class QTcpSocket;
 
 class Machine;
+class Message;
 
 class FuseServer : public QObject {
     Q_OBJECT
 
 public:
-    explicit FuseServer(const std::weak_ptr<Machine> &machine);
+    // 只接受来自 peer 的连接，root 为对端看到的根目录，测试时可以指向临时目录。
+    // writable 为 false 时拒绝所有修改文件系统的请求
+    FuseServer(const std::weak_ptr<Machine> &machine,
+               const std::string &peer,
+               const std::filesystem::path &root = "/",
+               bool writable = false);
     ~FuseServer();
 
     uint16_t port() const;
+    // 随 FsResponse 发给对端，连接上的第一个请求必须是带有该令牌的 init
+    const std::string &token() const { return m_token; }
 
 private:
+    // 客户端通过 lookup 获得的节点，fd 以 O_PATH 打开，后续操作都相对它进行，
+    // 不再每次从 / 开始解析路径
+    struct Node {
+        int fd;
+        dev_t dev;
+        ino_t ino;
+        uint64_t nlookup;
+    };
+
+    // open 返回给客户端的句柄，fd 不直接暴露给客户端
+    struct Handle {
+        int fd;
+        ~Handle();
+    };
+
+    // 每个连接由一个线程阻塞接收请求，交给工作线程处理，
+    // 客户端在一个连接上同一时间只有一个请求，并发来自多个连接
+    struct Connection {
+        int fd;
+        std::atomic<bool> closed{false};
+        size_t maxRead;
+        std::mutex writeMut;
+        std::thread reader;
+        ~Connection();
+    };
+
+    struct Task {
+        std::shared_ptr<Connection> conn;
+        std::unique_ptr<Message> msg;
+    };
+
     std::weak_ptr<Machine> m_machine;
+    const std::string m_peer;
+    const std::filesystem::path m_root;
+    const bool m_writable;
+    const std::string m_token;
+    // 根节点的描述符，由 m_nodes 持有，按路径访问时以它为起点
+    int m_rootFd;
 
     QTcpServer *m_listen;
-    QTcpSocket *m_conn;
 
-    void handleNewConnection() noexcept;
-    void handleDisconnected() noexcept;
-    void handleRequest() noexcept;
+    std::mutex m_connsMut;
+    std::list<std::shared_ptr<Connection>> m_conns;
+
+    std::mutex m_tasksMut;
+    std::condition_variable m_tasksCv;
+    std::deque<Task> m_tasks;
+    const size_t m_maxWorkers;
+    std::list<std::thread> m_workers;
+    // 空闲超时退出、尚未 join 的线程
+    std::vector<std::thread::id> m_exitedWorkers;
+    size_t m_idleWorkers;
+    bool m_stopping;
+
+    std::shared_mutex m_nodesMut;
+    uint64_t m_lastNode;
+    std::unordered_map<uint64_t, Node> m_nodes;
+    std::map<std::pair<dev_t, ino_t>, uint64_t> m_inodes;
+
+    std::shared_mutex m_handlesMut;
+    uint64_t m_lastHandle;
+    std::unordered_map<uint64_t, std::shared_ptr<Handle>> m_handles;
+
+    void handleNewConnection(qintptr fd) noexcept;
+    bool isPeer(int fd) const;
+    bool authorize(const Message &msg) const;
+    // 回收已经断开的连接，需持有 m_connsMut
+    void reapConnections();
+    void handleConnectionClosed();
+    void readRequests(const std::shared_ptr<Connection> &conn) noexcept;
+    // 需持有 m_tasksMut
+    void spawnWorker();
+    void workerLoop() noexcept;
+    void handleRequest(Connection &conn, const Message &msg) noexcept;
+    void sendResponse(Connection &conn, const Message &msg, const char *data = nullptr, size_t size = 0);
+
+    // 旧客户端按路径访问，解析限制在根目录之下
+    int openPath(const std::string &path, int flags) const;
+    // 节点数达到上限时关闭 fd 并返回 0
+    uint64_t registerNode(int fd, const struct stat &st);
+    void forgetNode(uint64_t node, uint64_t nlookup);
+    uint64_t addHandle(int fd);
+    std::shared_ptr<Handle> getHandle(uint64_t fh);
 
+    void methodInit(Connection &conn, const FsMethodInitRequest &req, FsMethodInitResponse *resp);
+    void methodLookup(const FsMethodLookupRequest &req, FsMethodLookupResponse *resp);
+    void methodForget(const FsMethodForgetRequest &req);
     void methodGetattr(const FsMethodGetAttrRequest &req, FsMethodGetAttrResponse *resp);
+    void methodReadlink(const FsMethodReadlinkRequest &req, FsMethodReadlinkResponse *resp);
     void methodOpen(const FsMethodOpenRequest &req, FsMethodOpenResponse *resp);
-    void methodRead(const FsMethodReadRequest &req, FsMethodReadResponse *resp);
+    size_t methodRead(const FsMethodReadRequest &req,
+                      FsMethodReadResponse *resp,
+                      size_t maxRead,
+                      std::vector<char> &buff);
     void methodRelease(const FsMethodReleaseRequest &req, FsMethodReleaseResponse *resp);
     void methodReaddir(const FsMethodReadDirRequest &req, FsMethodReadDirResponse *resp);
+    void methodWrite(const FsMethodWriteRequest &req, FsMethodWriteResponse *resp);
+    void methodCreate(const FsMethodCreateRequest &req, FsMethodCreateResponse *resp);
+    void methodSetattr(const FsMethodSetAttrRequest &req, FsMethodSetAttrResponse *resp);
+    void methodRename(const FsMethodRenameRequest &req, FsMethodRenameResponse *resp);
+    void methodUnlink(const FsMethodUnlinkRequest &req, FsMethodUnlinkResponse *resp);
+    void methodMkdir(const FsMethodMkdirRequest &req, FsMethodMkdirResponse *resp);
+    void methodRmdir(const FsMethodRmdirRequest &req, FsMethodRmdirResponse *resp);
+    void methodFsync(const FsMethodFsyncRequest &req, FsMethodFsyncResponse *resp);
+    void methodSnapshot(const FsMethodSnapshotRequest &req, FsMethodSnapshotResponse *resp);
 };
 
 #endif // !FUSE_FUSESERVER_H
@@ -0,0 +1,241 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "InputChannel.h"
+
+#include <algorithm>
+#include <random>
+
+#include <linux/input.h>
+
+#include <fmt/core.h>
+
+#include <QUdpSocket>
+#include <QTimer>
+
+#include "utils/message_helper.h"
+
+#include "protocol/message.pb.h"
+
+// 没有新的输入时补发未确认帧的间隔，也是丢包时按键延迟的上限
+static constexpr int resendInterval = 10;
+// 一个数据报中最多携带的未确认帧数
+static constexpr size_t maxUnackedFrames = 16;
+// 探测间隔，超过 probeTimeout 没有收到回复即认为 UDP 不通，改回 TCP
+static constexpr int probeInterval = 1000;
+static constexpr qint64 probeTimeout = 3000;
+
+// 只有相对移动可以丢失，后面的帧会带来新的增量；按键、按钮等都需要可靠送达，
+// 否则丢失的抬起会让按键卡住
+static bool isReliableFrame(const InputEventRequest &frame) {
+    auto lossy = [](int32_t type) { return type == EV_REL || type == EV_SYN; };
+    if (frame.events_size() == 0) {
+        return !lossy(frame.type());
+    }
+
+    return std::any_of(frame.events().begin(), frame.events().end(), [&lossy](const auto &ev) {
+        return !lossy(ev.type());
+    });
+}
+
+InputChannel::InputChannel(const QHostAddress &peer, QObject *parent)
+    : QObject(parent)
+    , m_socket(new QUdpSocket(this))
+    , m_resendTimer(new QTimer(this))
+    , m_probeTimer(new QTimer(this))
+    , m_peer(peer)
+    , m_localToken(std::random_device{}() | (static_cast<uint64_t>(std::random_device{}()) << 32))
+    , m_remotePort(0)
+    , m_remoteToken(0)
+    , m_reachable(false)
+    , m_maxSerial(0)
+    , m_reliableSerial(0) {
+    if (!m_socket->bind(QHostAddress::Any, 0)) {
+        qWarning() << "failed to bind input channel:" << m_socket->errorString();
+    }
+    m_socket->setSocketOption(QAbstractSocket::LowDelayOption, true);
+
+    connect(m_socket, &QUdpSocket::readyRead, this, &InputChannel::onReadyRead);
+
+    m_resendTimer->setSingleShot(true);
+    m_resendTimer->setInterval(resendInterval);
+    connect(m_resendTimer, &QTimer::timeout, this, &InputChannel::resend);
+
+    m_probeTimer->setInterval(probeInterval);
+    connect(m_probeTimer, &QTimer::timeout, this, &InputChannel::probe);
+}
+
+InputChannel::~InputChannel() {
+    m_socket->close();
+}
+
+uint16_t InputChannel::port() const {
+    return m_socket->localPort();
+}
+
+void InputChannel::setRemote(uint16_t port, uint64_t token) {
+    m_remotePort = port;
+    m_remoteToken = token;
+    m_reachable = false;
+
+    if (m_remotePort == 0) {
+        m_probeTimer->stop();
+        return;
+    }
+
+    sendControl(true, false);
+    m_probeTimer->start();
+}
+
+void InputChannel::probe() {
+    if (m_reachable && m_lastAck.elapsed() > probeTimeout) {
+        qWarning("input channel unreachable, fall back to TCP");
+        m_reachable = false;
+    }
+
+    sendControl(true, false);
+}
+
+void InputChannel::sendControl(bool probe, bool ack) {
+    Message msg;
+    auto *datagram = msg.mutable_inputeventdatagram();
+    datagram->set_token(m_remoteToken);
+    datagram->set_probe(probe);
+    datagram->set_ack(ack);
+    m_socket->writeDatagram(MessageHelper::genMessage(msg), m_peer, m_remotePort);
+}
+
+void InputChannel::sendReliableAck() {
+    Message msg;
+    auto *datagram = msg.mutable_inputeventdatagram();
+    datagram->set_token(m_remoteToken);
+    datagram->set_reliableack(m_reliableSerial);
+    m_socket->writeDatagram(MessageHelper::genMessage(msg), m_peer, m_remotePort);
+}
+
+void InputChannel::send(const InputEventRequest &req) {
+    if (isReliableFrame(req)) {
+        m_unacked.push_back(req);
+        sendDatagram(nullptr);
+    } else {
+        sendDatagram(&req);
+    }
+
+    if (!m_unacked.empty() && !m_resendTimer->isActive()) {
+        m_resendTimer->start();
+    }
+}
+
+void InputChannel::resend() {
+    if (m_unacked.empty()) {
+        return;
+    }
+
+    sendDatagram(nullptr);
+    m_resendTimer->start();
+}
+
+void InputChannel::sendDatagram(const InputEventRequest *current) {
+    Message msg;
+    auto *datagram = msg.mutable_inputeventdatagram();
+    datagram->set_token(m_remoteToken);
+
+    // 总是从最早未确认的帧开始发送，接收端据此累计确认
+    size_t count = std::min(m_unacked.size(), maxUnackedFrames);
+    for (size_t i = 0; i < count; i++) {
+        *datagram->add_frames() = m_unacked[i];
+    }
+    // 放不下全部未确认帧时丢弃当前的移动，不能让它排到之前的按键前面
+    if (current && count == m_unacked.size()) {
+        *datagram->add_frames() = *current;
+    }
+
+    if (datagram->frames_size() == 0) {
+        return;
+    }
+
+    m_socket->writeDatagram(MessageHelper::genMessage(msg), m_peer, m_remotePort);
+}
+
+void InputChannel::onReadyRead() {
+    while (m_socket->hasPendingDatagrams()) {
+        QByteArray buffer;
+        buffer.resize(m_socket->pendingDatagramSize());
+
+        QHostAddress addr;
+        m_socket->readDatagram(buffer.data(), buffer.size(), &addr);
+
+        if (!addr.isEqual(m_peer, QHostAddress::ConvertV4MappedToIPv4)) {
+            continue;
+        }
+
+        if (buffer.size() < header_size) {
+            continue;
+        }
+
+        auto &header = MessageHelper::parseMessageHeader(buffer);
+        if (!header.legal() || header.size() != static_cast<uint64_t>(buffer.size() - header_size)) {
+            qWarning() << "illegal datagram from input channel";
+            continue;
+        }
+
+        auto msg = MessageHelper::parseMessageBody<Message>(buffer.data() + header_size,
+                                                            buffer.size() - header_size);
+        if (msg.payload_case() != Message::PayloadCase::kInputEventDatagram ||
+            msg.inputeventdatagram().token() != m_localToken) {
+            qWarning() << "unexpected datagram from input channel";
+            continue;
+        }
+
+        const auto &datagram = msg.inputeventdatagram();
+        if (datagram.probe() && m_remotePort != 0) {
+            sendControl(false, true);
+        }
+        if (datagram.ack()) {
+            m_lastAck.start();
+            if (!m_reachable) {
+                qInfo("input channel reachable");
+                m_reachable = true;
+            }
+        }
+
+        if (datagram.reliableack() > 0) {
+            while (!m_unacked.empty() && m_unacked.front().serial() <= datagram.reliableack()) {
+                m_unacked.pop_front();
+            }
+            if (m_unacked.empty()) {
+                m_resendTimer->stop();
+            }
+        }
+
+        bool reliable = false;
+        for (const auto &frame : datagram.frames()) {
+            reliable = isReliableFrame(frame) || reliable;
+            handleFrame(frame);
+        }
+
+        // 重复收到的帧也要确认，之前的确认可能丢失了
+        if (reliable && m_remotePort != 0) {
+            sendReliableAck();
+        }
+    }
+}
+
+void InputChannel::handleFrame(const InputEventRequest &frame) {
+    int64_t serial = frame.serial();
+
+    if (isReliableFrame(frame)) {
+        // 可靠帧即使晚于后面的帧到达也要处理，避免按键卡住
+        if (serial <= m_reliableSerial) {
+            return;
+        }
+        m_reliableSerial = serial;
+    } else if (serial <= m_maxSerial) {
+        // 过时的移动事件直接丢弃
+        return;
+    }
+
+    m_maxSerial = std::max(m_maxSerial, serial);
+    emit received(frame);
+}
@@ -0,0 +1,74 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef MACHINE_INPUTCHANNEL_H
+#define MACHINE_INPUTCHANNEL_H
+
+#include <deque>
+
+#include <QObject>
+#include <QHostAddress>
+#include <QElapsedTimer>
+
+#include "protocol/device_sharing.pb.h"
+
+class QUdpSocket;
+class QTimer;
+
+// 输入事件的 UDP 通道，不和剪切板等大消息共用 TCP 连接，丢包时也不必等待重传。
+// 按键等帧在之后的数据报中重复发送直到对端确认，只有相对移动丢失后直接放弃。
+// 定时发送探测数据报，收到对端回复后才启用，UDP 被防火墙拦截时仍使用 TCP。
+class InputChannel : public QObject {
+    Q_OBJECT
+
+public:
+    explicit InputChannel(const QHostAddress &peer, QObject *parent = nullptr);
+    ~InputChannel();
+
+    // 本端监听的端口和对端发来数据报时需要携带的令牌，配对时发给对端
+    uint16_t port() const;
+    uint64_t token() const { return m_localToken; }
+
+    void setRemote(uint16_t port, uint64_t token);
+    bool ready() const { return m_remotePort != 0 && m_reachable; }
+
+    void send(const InputEventRequest &req);
+
+signals:
+    void received(const InputEventRequest &req);
+
+private slots:
+    void onReadyRead();
+    void resend();
+    void probe();
+
+private:
+    QUdpSocket *m_socket;
+    QTimer *m_resendTimer;
+    QTimer *m_probeTimer;
+    const QHostAddress m_peer;
+
+    uint64_t m_localToken;
+    uint16_t m_remotePort;
+    uint64_t m_remoteToken;
+
+    // 探测结果和最近一次收到回复的时间
+    bool m_reachable;
+    QElapsedTimer m_lastAck;
+
+    // 发送端：尚未被确认的可靠帧，按序号排列
+    std::deque<InputEventRequest> m_unacked;
+
+    // 接收端：收到的最大序号和已处理的可靠帧的最大序号。
+    // 发送端总是从最早未确认的可靠帧开始按序发送，不大于后者的可靠帧都已处理过
+    int64_t m_maxSerial;
+    int64_t m_reliableSerial;
+
+    void sendDatagram(const InputEventRequest *current);
+    void sendControl(bool probe, bool ack);
+    void sendReliableAck();
+    void handleFrame(const InputEventRequest &frame);
+};
+
+#endif // !MACHINE_INPUTCHANNEL_H
@@ -4,19 +4,27 @@
 
 #include "Machine.h"
 
+#include <algorithm>
 #include <condition_variable>
 
+#include <linux/input.h>
+
 #include <fmt/core.h>
 
 #include <QTcpSocket>
 #include <QHostAddress>
 #include <QTimer>
+#include <QStandardPaths>
+#include <QDBusMessage>
+#include <QDBusPendingCallWatcher>
+#include <QDBusPendingReply>
 
 #include <DDBusSender>
 
 #include "Manager.h"
 #include "MachineDBusAdaptor.h"
 #include "Wrappers/InputEmitterWrapper.h"
+#include "InputChannel.h"
 #include "ConfirmDialog.h"
 #include "Fuse/FuseServer.h"
 #include "Fuse/FuseClient.h"
@@ -26,6 +34,7 @@
 #include "SendTransfer.h"
 
 #include "protocol/message.pb.h"
+#include "protocol/ipc_message.pb.h"
 
 #include "utils/net.h"
 
@@ -39,6 +48,22 @@ const static QString dConfigName = "org.deepin.cooperation";
 
 static const uint64_t U10s = 10 * 1000;
 static const uint64_t U25s = 25 * 1000;
+// 流式输入事件的累计确认间隔
+static const int inputAckInterval = 200;
+// 连接中积压的数据超过此值时开始合并鼠标移动
+static const qint64 inputBacklogThreshold = 8 * 1024;
+// 已发出但对端尚未确认的帧数超过此值时也合并鼠标移动，对端处理不过来时不再继续堆积。
+// 约为 1000Hz 的鼠标在两个确认间隔内产生的帧数
+static const int64_t inputUnackedThreshold = 400;
+// 有合并的移动尚未发出时检查发送队列的间隔，毫秒
+static const int motionFlushInterval = 2;
+// 暂存的 UDP 输入等待 FlowRequest 的时间，超时后只注入按键等帧，毫秒
+static const int heldInputTimeout = 200;
+// 估计时钟偏差时保留的样本数，每 10 秒一个
+static const size_t clockSampleWindow = 6;
+// 读取不到键盘设置时使用的按键重复参数，和 dde 的默认值一致
+static const uint32_t keyRepeatDelay = 600;
+static const uint32_t keyRepeatInterval = 25;
 
 Machine::Machine(Manager *manager,
                  ClipboardBase *clipboard,
@@ -66,21 +91,25 @@ Machine::Machine(Manager *manager,
     , m_pingTimer(new QTimer(this))
     , m_offlineTimer(new QTimer(this))
     , m_pairTimeoutTimer(new QTimer(this))
+    , m_inputAckTimer(new QTimer(this))
+    , m_inputClockTimer(new QTimer(this))
+    , m_motionFlushTimer(new QTimer(this))
+    , m_heldInputTimer(new QTimer(this))
+    , m_inputSerial(0)
+    , m_inputAckedSerial(0)
+    , m_inputReceivedSerial(0)
+    , m_holdInput(true)
+    , m_peerInputPort(0)
+    , m_peerInputToken(0)
+    , m_peerRepeatDelay(0)
+    , m_peerRepeatInterval(0)
+    , m_clockOffset(0)
+    , m_clockSynced(false)
     , m_currentSendTransferId(0)
     , m_mounted(false)
     , m_conn(nullptr)
     , m_ip(ip) {
 
-    m_inputEmitters.emplace(
-        std::make_pair(InputDeviceType::KEYBOARD,
-                       std::make_unique<InputEmitterWrapper>(InputDeviceType::KEYBOARD)));
-    m_inputEmitters.emplace(
-        std::make_pair(InputDeviceType::MOUSE,
-                       std::make_unique<InputEmitterWrapper>(InputDeviceType::MOUSE)));
-    m_inputEmitters.emplace(
-        std::make_pair(InputDeviceType::TOUCHPAD,
-                       std::make_unique<InputEmitterWrapper>(InputDeviceType::TOUCHPAD)));
-
     QObject::connect(m_pingTimer, &QTimer::timeout, this, &Machine::ping);
     m_pingTimer->start(U10s);
 
@@ -88,6 +117,36 @@ Machine::Machine(Manager *manager,
     m_offlineTimer->setSingleShot(true);
     m_offlineTimer->start(U25s);
 
+    QObject::connect(m_inputAckTimer, &QTimer::timeout, this, &Machine::sendInputEventAck);
+    m_inputAckTimer->setSingleShot(true);
+    m_inputAckTimer->setInterval(inputAckInterval);
+
+    QObject::connect(m_inputClockTimer, &QTimer::timeout, this, &Machine::sendInputClockRequest);
+    m_inputClockTimer->setInterval(U10s);
+
+    QObject::connect(m_motionFlushTimer, &QTimer::timeout, this, [this]() {
+        if (!m_pendingMotion) {
+            return;
+        }
+
+        if (!inputCongested()) {
+            flushPendingMotion();
+        } else {
+            m_motionFlushTimer->start();
+        }
+    });
+    m_motionFlushTimer->setSingleShot(true);
+    m_motionFlushTimer->setTimerType(Qt::PreciseTimer);
+    m_motionFlushTimer->setInterval(motionFlushInterval);
+
+    // 超时仍没有 FlowRequest 时暂存的是上一次流转中晚到的帧，松开按键等仍需注入
+    QObject::connect(m_heldInputTimer, &QTimer::timeout, this, [this]() {
+        releaseHeldInput(INT64_MAX);
+        m_holdInput = true;
+    });
+    m_heldInputTimer->setSingleShot(true);
+    m_heldInputTimer->setInterval(heldInputTimeout);
+
     initPairRequestTimer();
 
     if (!m_bus.registerObject(m_dbusPath, this)) {
@@ -164,9 +223,11 @@ void Machine::receivedPing() {
     m_pingTimer->start();
 }
 
-void Machine::onPair(QTcpSocket *socket) {
+void Machine::onPair(QTcpSocket *socket, const PairRequest &req) {
     qDebug("request onPair");
     m_conn = socket;
+    m_peerInputPort = req.inputport();
+    m_peerInputToken = req.inputtoken();
 
     auto *confirmDialog = new ConfirmDialog(QString::fromStdString(m_ip),
                                             QString::fromStdString(m_name));
@@ -200,6 +261,7 @@ void Machine::setFlowDirection(FlowDirection direction) {
     if (m_direction != direction) {
         m_direction = (FlowDirection)direction;
         sendFlowDirectionNtf();
+        m_manager->onFlowEdgesChanged();
 
         m_dbusAdaptor->updateDirection(direction);
     }
@@ -216,6 +278,11 @@ void Machine::onOffline() {
 void Machine::initConnection() {
     QObject::connect(m_conn, &QTcpSocket::disconnected, this, &Machine::handleDisconnectedAux);
     QObject::connect(m_conn, &QTcpSocket::readyRead, this, &Machine::dispatcher);
+    QObject::connect(m_conn, &QTcpSocket::bytesWritten, this, [this]() {
+        if (!inputCongested()) {
+            flushPendingMotion();
+        }
+    });
     m_conn->setSocketOption(QAbstractSocket::LowDelayOption, true);
     Net::tcpSocketSetKeepAliveOption(m_conn->socketDescriptor());
 }
@@ -239,9 +306,11 @@ void Machine::handleDisconnectedAux() {
 
     if (m_connected) {
         m_manager->onStopDeviceSharing();
+        releaseInputEmitters();
 
         m_deviceSharing = false;
         m_dbusAdaptor->updateDeviceSharing(m_deviceSharing);
+        m_manager->onFlowEdgesChanged();
         m_connected = false;
         m_dbusAdaptor->updateConnected(m_connected);
     }
@@ -255,6 +324,21 @@ void Machine::handleDisconnectedAux() {
         m_fuseServer.reset();
     }
 
+    m_inputAckTimer->stop();
+    m_inputAckedSerial = m_inputSerial;
+    m_inputFailed.clear();
+    m_inputClockTimer->stop();
+    m_clockSamples.clear();
+    m_clockSynced = false;
+    m_peerRepeatDelay = 0;
+    m_peerRepeatInterval = 0;
+    m_inputChannel.reset();
+    m_heldInputTimer->stop();
+    m_heldInput.clear();
+    m_holdInput = true;
+    m_pendingMotion.reset();
+    m_motionFlushTimer->stop();
+
     m_conn->deleteLater();
     m_conn = nullptr;
 
@@ -328,6 +412,28 @@ void Machine::dispatcher() noexcept {
         }
 
         case Message::PayloadCase::kInputEventResponse: {
+            // 旧版本的对端逐个回复，同样视为确认
+            m_inputAckedSerial = std::max(m_inputAckedSerial, msg.inputeventresponse().serial());
+            break;
+        }
+
+        case Message::PayloadCase::kInputEventAck: {
+            handleInputEventAck(msg.inputeventack());
+            break;
+        }
+
+        case Message::PayloadCase::kInputClockRequest: {
+            handleInputClockRequest(msg.inputclockrequest());
+            break;
+        }
+
+        case Message::PayloadCase::kInputClockResponse: {
+            handleInputClockResponse(msg.inputclockresponse());
+            break;
+        }
+
+        case Message::PayloadCase::kKeyRepeatNtf: {
+            handleKeyRepeatNtf(msg.keyrepeatntf());
             break;
         }
 
@@ -345,6 +451,11 @@ void Machine::dispatcher() noexcept {
             break;
         }
 
+        case Message::PayloadCase::kFlowPrepare: {
+            handleFlowPrepare(msg.flowprepare());
+            break;
+        }
+
         case Message::PayloadCase::kFsRequest: {
             handleFsRequest(msg.fsrequest());
             break;
@@ -422,6 +533,15 @@ void Machine::handlePairResponseAux(const PairResponse &resp) {
 
     bool agree = resp.agree();
 
+    // 对端不支持或未开启 UDP 输入通道时继续使用 TCP
+    if (m_inputChannel) {
+        if (agree && resp.inputport() != 0) {
+            m_inputChannel->setRemote(resp.inputport(), resp.inputtoken());
+        } else {
+            m_inputChannel.reset();
+        }
+    }
+
     // send notification
     QString msgBody;
     if (agree) {
@@ -455,6 +575,9 @@ void Machine::handlePairResponseAux(const PairResponse &resp) {
     m_dbusAdaptor->updateConnected(m_connected);
 
     sendServiceStatusNotification();
+    sendKeyRepeatNtf();
+    sendInputClockRequest();
+    m_inputClockTimer->start();
     handleConnected();
 }
 
@@ -473,6 +596,7 @@ void Machine::handleDeviceSharingStartRequest() {
     if (accepted) {
         auto wptr = weak_from_this();
         m_manager->onStartDeviceSharing(wptr, true);
+        attachInputEmitters();
 
         m_deviceSharing = true;
         m_dbusAdaptor->updateDeviceSharing(m_deviceSharing);
@@ -481,6 +605,7 @@ void Machine::handleDeviceSharingStartRequest() {
 
         m_direction = FLOW_DIRECTION_LEFT;
         m_dbusAdaptor->updateDirection(m_direction);
+        m_manager->onFlowEdgesChanged();
     }
 }
 
@@ -491,6 +616,7 @@ void Machine::handleDeviceSharingStartResponse(const DeviceSharingStartResponse
 
     m_deviceSharing = true;
     m_dbusAdaptor->updateDeviceSharing(m_deviceSharing);
+    attachInputEmitters();
 
     m_manager->machineCooperated(m_uuid);
 
@@ -500,34 +626,227 @@ void Machine::handleDeviceSharingStartResponse(const DeviceSharingStartResponse
     sendFlowDirectionNtf();
 
     m_manager->onStartDeviceSharing(weak_from_this(), true);
+    m_manager->onFlowEdgesChanged();
 }
 
 void Machine::handleDeviceSharingStopRequest() {
     stopDeviceSharingAux();
 }
 
+bool Machine::emitInputEvents(const InputEventRequest &req) {
+    auto deviceType = static_cast<InputDeviceType>(req.devicetype());
+    auto *emitter = m_manager->inputEmitter(deviceType);
+    if (!emitter) {
+        qWarning()
+            << fmt::format("no deviceType {} found", static_cast<uint8_t>(deviceType)).data();
+        return false;
+    }
+
+    // 对端的时间戳换算到本机时钟，还没有估计出时钟偏差时不统计
+    int64_t timestamp = 0;
+    if (m_clockSynced && req.sendtime() != 0) {
+        m_networkLatency.record(Latency::toUs(Latency::now() - (req.sendtime() - m_clockOffset)));
+        if (req.timestamp() != 0) {
+            timestamp = req.timestamp() - m_clockOffset;
+        }
+    }
+
+    return emitter->emitEvents(req, timestamp);
+}
+
+void Machine::attachInputEmitters() {
+    for (auto type : {InputDeviceType::KEYBOARD, InputDeviceType::MOUSE, InputDeviceType::TOUCHPAD}) {
+        auto *emitter = m_manager->inputEmitter(type);
+        if (!emitter) {
+            continue;
+        }
+
+        emitter->setMachine(weak_from_this());
+        if (type == InputDeviceType::KEYBOARD) {
+            emitter->setKeyRepeat(m_peerRepeatDelay, m_peerRepeatInterval);
+        }
+    }
+}
+
+void Machine::releaseInputEmitters() {
+    for (auto type : {InputDeviceType::KEYBOARD, InputDeviceType::MOUSE, InputDeviceType::TOUCHPAD}) {
+        auto *emitter = m_manager->inputEmitter(type);
+        if (emitter) {
+            emitter->release(this);
+        }
+    }
+}
+
+void Machine::onInputEmitterLatency(const std::vector<uint32_t> &emitLatency,
+                                    const std::vector<uint32_t> &totalLatency) {
+    for (auto us : emitLatency) {
+        m_emitLatency.record(us);
+    }
+    for (auto us : totalLatency) {
+        m_totalLatency.record(us);
+    }
+}
+
 void Machine::handleInputEventRequest(const InputEventRequest &req) {
     qDebug("received input event");
 
-    bool success = true;
+    bool success = emitInputEvents(req);
 
-    auto deviceType = static_cast<InputDeviceType>(req.devicetype());
-    auto it = m_inputEmitters.find(deviceType);
-    if (it == m_inputEmitters.end()) {
-        success = false;
-        qWarning()
-            << fmt::format("no deviceType {} found", static_cast<uint8_t>(deviceType)).data();
-    } else {
-        auto &inputEmitter = it->second;
-        success = inputEmitter->emitEvent(req.type(), req.code(), req.value());
+    // 旧版本的请求不带序号，需要逐个回复
+    if (req.serial() == 0) {
+        Message resp;
+        InputEventResponse *response = resp.mutable_inputeventresponse();
+        response->set_serial(req.serial());
+        response->set_success(success);
+
+        m_conn->write(MessageHelper::genMessage(resp));
+        return;
+    }
+
+    m_inputReceivedSerial = req.serial();
+    if (!success) {
+        m_inputFailed.push_back(req.serial());
+        sendInputEventAck();
+        return;
+    }
+
+    if (!m_inputAckTimer->isActive()) {
+        m_inputAckTimer->start();
     }
+}
+
+void Machine::handleInputEventAck(const InputEventAck &ack) {
+    m_inputAckedSerial = std::max(m_inputAckedSerial, ack.serial());
+    for (auto serial : ack.failed()) {
+        qWarning() << fmt::format("peer failed to emit input event {}", serial).data();
+    }
+
+    if (!inputCongested()) {
+        flushPendingMotion();
+    }
+}
+
+void Machine::sendInputEventAck() {
+    m_inputAckTimer->stop();
+
+    Message msg;
+    auto *ack = msg.mutable_inputeventack();
+    ack->set_serial(m_inputReceivedSerial);
+    ack->mutable_failed()->Add(m_inputFailed.begin(), m_inputFailed.end());
+    m_inputFailed.clear();
+    sendMessage(msg);
+}
+
+void Machine::sendInputClockRequest() {
+    Message msg;
+    msg.mutable_inputclockrequest()->set_t1(Latency::now());
+    sendMessage(msg);
+}
 
-    Message resp;
-    InputEventResponse *response = resp.mutable_inputeventresponse();
-    response->set_serial(req.serial());
-    response->set_success(success);
+void Machine::handleInputClockRequest(const InputClockRequest &req) {
+    int64_t t2 = Latency::now();
 
-    m_conn->write(MessageHelper::genMessage(resp));
+    Message msg;
+    auto *resp = msg.mutable_inputclockresponse();
+    resp->set_t1(req.t1());
+    resp->set_t2(t2);
+    resp->set_t3(Latency::now());
+    sendMessage(msg);
+}
+
+void Machine::handleInputClockResponse(const InputClockResponse &resp) {
+    int64_t t4 = Latency::now();
+    int64_t rtt = (t4 - resp.t1()) - (resp.t3() - resp.t2());
+    int64_t offset = ((resp.t2() - resp.t1()) + (resp.t3() - t4)) / 2;
+
+    if (m_clockSamples.size() >= clockSampleWindow) {
+        m_clockSamples.pop_front();
+    }
+    m_clockSamples.emplace_back(rtt, offset);
+
+    // 往返时间最短的样本受排队影响最小
+    auto best = std::min_element(m_clockSamples.begin(), m_clockSamples.end());
+    m_clockOffset = best->second;
+    m_clockSynced = true;
+}
+
+void Machine::handleKeyRepeatNtf(const KeyRepeatNtf &ntf) {
+    m_peerRepeatDelay = ntf.delay();
+    m_peerRepeatInterval = ntf.interval();
+
+    if (m_deviceSharing) {
+        attachInputEmitters();
+    }
+}
+
+void Machine::sendKeyRepeatNtf() {
+    // 异步读取键盘设置，不阻塞处理输入事件的主线程
+    auto call = QDBusMessage::createMethodCall("org.deepin.dde.InputDevices1",
+                                               "/org/deepin/dde/InputDevice1/Keyboard",
+                                               "org.freedesktop.DBus.Properties",
+                                               "GetAll");
+    call << QString("org.deepin.dde.InputDevice1.Keyboard");
+    auto *watcher = new QDBusPendingCallWatcher(QDBusConnection::sessionBus().asyncCall(call), this);
+
+    QObject::connect(watcher, &QDBusPendingCallWatcher::finished, this, [this, watcher]() {
+        watcher->deleteLater();
+
+        uint32_t delay = keyRepeatDelay;
+        uint32_t interval = keyRepeatInterval;
+
+        QDBusPendingReply<QVariantMap> reply = *watcher;
+        if (reply.isError()) {
+            qWarning() << "failed to get keyboard settings:" << reply.error().message();
+        } else {
+            auto props = reply.value();
+            QVariant enabled = props.value("RepeatEnabled");
+            QVariant repeatDelay = props.value("RepeatDelay");
+            QVariant repeatInterval = props.value("RepeatInterval");
+            if (repeatDelay.isValid() && repeatInterval.isValid()) {
+                delay = repeatDelay.toUInt();
+                interval = repeatInterval.toUInt();
+            }
+            if (enabled.isValid() && !enabled.toBool()) {
+                delay = 0;
+            }
+        }
+
+        // 等待回复期间连接可能已经断开
+        if (!m_connected) {
+            return;
+        }
+
+        Message msg;
+        auto *ntf = msg.mutable_keyrepeatntf();
+        ntf->set_delay(delay);
+        ntf->set_interval(interval);
+        sendMessage(msg);
+    });
+}
+
+QVariantMap Machine::inputLatency() const {
+    auto toMap = [](const LatencyHistogram &histogram) {
+        QVariantMap map;
+        map.insert("count", static_cast<qulonglong>(histogram.count()));
+        map.insert("p50", histogram.percentile(0.5));
+        map.insert("p99", histogram.percentile(0.99));
+        map.insert("max", histogram.max());
+        return map;
+    };
+
+    QVariantMap result;
+    result.insert("capture", toMap(m_captureLatency));
+    result.insert("network", toMap(m_networkLatency));
+    result.insert("emit", toMap(m_emitLatency));
+    result.insert("total", toMap(m_totalLatency));
+    return result;
+}
+
+void Machine::resetInputLatency() {
+    m_captureLatency.reset();
+    m_networkLatency.reset();
+    m_emitLatency.reset();
+    m_totalLatency.reset();
 }
 
 void Machine::handleFlowDirectionNtf(const FlowDirectionNtf &ntf) {
@@ -548,38 +867,74 @@ void Machine::handleFlowDirectionNtf(const FlowDirectionNtf &ntf) {
     }
 
     m_dbusAdaptor->updateDirection(m_direction);
+    m_manager->onFlowEdgesChanged();
 }
 
 void Machine::handleFlowRequest(const FlowRequest &req) {
-    m_manager->onFlowBack(req.direction(), req.x(), req.y());
+    m_manager->onFlowBack(req.direction(),
+                          req.x(),
+                          req.y(),
+                          req.has_position() ? std::make_optional(req.position()) : std::nullopt);
+
+    // 光标已经在进入位置，之前暂存的这次流转的输入可以注入了
+    releaseHeldInput(req.inputserial());
+}
+
+void Machine::handleFlowPrepare(const FlowPrepare &req) {
+    m_manager->onFlowPrepare(req.direction(), req.position());
 }
 
 void Machine::handleFsRequest([[maybe_unused]] const FsRequest &req) {
-    if (m_fuseServer) {
-        Message msg;
-        auto *fsresponse = msg.mutable_fsresponse();
-        fsresponse->set_accepted(false);
-        fsresponse->set_port(0);
-        sendMessage(msg);
-        return;
+    // 对端挂载失败后会在下次访问时重新请求，已有的 FuseServer 直接复用
+    if (!m_fuseServer) {
+        // 默认只读，用户在配置中打开后对端才能修改本机文件
+        m_fuseServer = std::make_unique<FuseServer>(weak_from_this(), m_ip, "/", getFsWritable());
     }
 
-    m_fuseServer = std::make_unique<FuseServer>(weak_from_this());
-
     // TODO: request accept
     Message msg;
     auto *fsresponse = msg.mutable_fsresponse();
     fsresponse->set_accepted(true);
     fsresponse->set_port(m_fuseServer->port());
+    fsresponse->set_token(m_fuseServer->token());
     sendMessage(msg);
 }
 
 void Machine::handleFsResponse(const FsResponse &resp) {
-    if (!resp.accepted()) {
+    if (!m_fuseClient) {
         return;
     }
 
-    m_fuseClient = std::make_unique<FuseClient>(m_ip, resp.port(), m_mountpoint);
+    m_fuseClient->setRemote(resp.accepted() ? resp.port() : 0, resp.token());
+}
+
+void Machine::mountFs(const std::string &path) {
+    if (m_fuseClient) {
+        return;
+    }
+
+    std::unique_ptr<BlockCache> cache;
+    uint64_t cacheSize = getFsCacheSize();
+    if (cacheSize > 0) {
+        std::filesystem::path cacheDir
+            = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation).toStdString();
+        cache = std::make_unique<BlockCache>(cacheDir / "dde-cooperation" / "fs" / m_uuid,
+                                             cacheSize * 1024 * 1024);
+    }
+
+    // 挂载点在本地立即可用，第一次被访问时才请求对端启动 FuseServer
+    m_fuseClient = std::make_unique<FuseClient>(m_ip, m_mountpoint, std::move(cache));
+    QObject::connect(
+        m_fuseClient.get(),
+        &FuseClient::remoteRequested,
+        this,
+        [this, path] {
+            Message msg;
+            auto *request = msg.mutable_fsrequest();
+            request->set_path(path);
+            sendMessage(msg);
+        },
+        Qt::QueuedConnection);
 }
 
 void Machine::handleFsSendFileRequest(const FsSendFileRequest &req) {
@@ -789,16 +1144,131 @@ void Machine::handleClipboardGetContentResponse(const ClipboardGetContentRespons
     m_clipboard->updateTargetContent(target, std::vector<char>(content.begin(), content.end()));
 }
 
-void Machine::onInputGrabberEvent(uint8_t deviceType,
-                                  unsigned int type,
-                                  unsigned int code,
-                                  int value) {
+void Machine::onInputGrabberFrame(uint8_t deviceType, const InputEventFrame &frame) {
+    if (frame.timestamp() != 0) {
+        m_captureLatency.record(Latency::toUs(Latency::now() - frame.timestamp()));
+    }
+
+    InputEventRequest req;
+    req.set_devicetype(static_cast<DeviceType>(deviceType));
+    req.set_timestamp(frame.timestamp());
+    req.mutable_events()->Reserve(frame.events_size());
+    for (const auto &ev : frame.events()) {
+        auto *value = req.add_events();
+        value->set_type(ev.type());
+        value->set_code(ev.code());
+        value->set_value(ev.value());
+    }
+
+    if (m_inputChannel && m_inputChannel->ready()) {
+        sendInputFrame(req);
+        return;
+    }
+
+    // 连接拥塞时合并相对移动和滚轮，对端总能尽快收到最新的位置
+    if (isMotionFrame(req)) {
+        if (m_pendingMotion && m_pendingMotion->devicetype() != req.devicetype()) {
+            flushPendingMotion();
+        }
+
+        if (m_pendingMotion || inputCongested()) {
+            coalesceMotion(req);
+            if (!inputCongested()) {
+                flushPendingMotion();
+            } else if (!m_motionFlushTimer->isActive()) {
+                m_motionFlushTimer->start();
+            }
+            return;
+        }
+    } else {
+        // 按键和按钮必须在之前的移动之后发出
+        flushPendingMotion();
+    }
+
+    sendInputFrame(req);
+}
+
+bool Machine::isMotionFrame(const InputEventRequest &req) {
+    if (req.events_size() == 0) {
+        return false;
+    }
+
+    for (const auto &ev : req.events()) {
+        if (ev.type() == EV_REL || (ev.type() == EV_SYN && ev.code() == SYN_REPORT)) {
+            continue;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+qint64 Machine::inputBacklog() const {
+    if (!m_conn) {
+        return 0;
+    }
+
+    return m_conn->bytesToWrite() + Net::pendingSendBytes(m_conn->socketDescriptor());
+}
+
+bool Machine::inputCongested() const {
+    return inputBacklog() > inputBacklogThreshold
+           || m_inputSerial - m_inputAckedSerial > inputUnackedThreshold;
+}
+
+void Machine::coalesceMotion(const InputEventRequest &req) {
+    if (!m_pendingMotion) {
+        m_pendingMotion = req;
+        return;
+    }
+
+    // 同一个轴的增量相加，SYN_REPORT 保持在最后
+    auto *events = m_pendingMotion->mutable_events();
+    for (const auto &ev : req.events()) {
+        if (ev.type() != EV_REL) {
+            continue;
+        }
+
+        auto it = std::find_if(events->begin(), events->end(), [&ev](const auto &pending) {
+            return pending.type() == ev.type() && pending.code() == ev.code();
+        });
+        if (it != events->end()) {
+            it->set_value(it->value() + ev.value());
+        } else {
+            *events->Add() = ev;
+            int last = events->size() - 1;
+            if (last > 0 && events->Get(last - 1).type() == EV_SYN) {
+                events->SwapElements(last - 1, last);
+            }
+        }
+    }
+}
+
+void Machine::flushPendingMotion() {
+    if (!m_pendingMotion) {
+        return;
+    }
+
+    m_motionFlushTimer->stop();
+
+    InputEventRequest req = std::move(*m_pendingMotion);
+    m_pendingMotion.reset();
+    sendInputFrame(req);
+}
+
+void Machine::sendInputFrame(InputEventRequest &req) {
+    req.set_serial(++m_inputSerial);
+    req.set_sendtime(Latency::now());
+
+    if (m_inputChannel && m_inputChannel->ready()) {
+        // UDP 发出的帧不通过 TCP 确认，不计入未确认的帧数
+        m_inputAckedSerial = m_inputSerial;
+        m_inputChannel->send(req);
+        return;
+    }
+
     Message msg;
-    auto *inputEvent = msg.mutable_inputeventrequest();
-    inputEvent->set_devicetype(static_cast<DeviceType>(deviceType));
-    inputEvent->set_type(type);
-    inputEvent->set_code(code);
-    inputEvent->set_value(value);
+    msg.mutable_inputeventrequest()->Swap(&req);
     sendMessage(msg);
 }
 
@@ -814,12 +1284,25 @@ void Machine::onClipboardTargetsChanged(const std::vector<std::string> &targets)
     sendMessage(msg);
 }
 
-void Machine::flowTo(uint16_t direction, uint16_t x, uint16_t y) noexcept {
+void Machine::flowTo(uint16_t direction, uint16_t x, uint16_t y, double position) noexcept {
     Message msg;
     FlowRequest *flow = msg.mutable_flowrequest();
     flow->set_direction(FlowDirection(direction));
     flow->set_x(x);
     flow->set_y(y);
+    flow->set_position(position);
+    flow->set_inputserial(m_inputSerial);
+    sendMessage(msg);
+
+    // 对端的鼠标离开了本机，之后 UDP 收到的帧要等对端流转回来时再注入
+    m_holdInput = true;
+}
+
+void Machine::prepareFlow(uint16_t direction, double position) noexcept {
+    Message msg;
+    FlowPrepare *prepare = msg.mutable_flowprepare();
+    prepare->set_direction(FlowDirection(direction));
+    prepare->set_position(position);
     sendMessage(msg);
 }
 
@@ -832,9 +1315,11 @@ void Machine::readTarget(const std::string &target) {
 
 void Machine::stopDeviceSharingAux() {
     m_manager->onStopDeviceSharing();
+    releaseInputEmitters();
 
     m_deviceSharing = false;
     m_dbusAdaptor->updateDeviceSharing(m_deviceSharing);
+    m_manager->onFlowEdgesChanged();
 }
 
 void Machine::receivedUserConfirm(bool accepted) {
@@ -844,6 +1329,15 @@ void Machine::receivedUserConfirm(bool accepted) {
     m_manager->completeDeviceInfo(response->mutable_deviceinfo());
     response->set_agree(accepted); // 询问用户是否同意
 
+    if (accepted && m_peerInputPort != 0) {
+        setupInputChannel();
+        if (m_inputChannel) {
+            m_inputChannel->setRemote(m_peerInputPort, m_peerInputToken);
+            response->set_inputport(m_inputChannel->port());
+            response->set_inputtoken(m_inputChannel->token());
+        }
+    }
+
     sendMessage(msg);
 
     // send notification
@@ -864,6 +1358,9 @@ void Machine::receivedUserConfirm(bool accepted) {
         m_dbusAdaptor->updateConnected(m_connected);
 
         sendServiceStatusNotification();
+        sendKeyRepeatNtf();
+        sendInputClockRequest();
+        m_inputClockTimer->start();
         handleConnected();
     } else {
         m_conn->close();
@@ -916,12 +1413,106 @@ int Machine::getPairTimeoutInterval() {
     return interval;
 }
 
+uint64_t Machine::getFsCacheSize() {
+    uint64_t size = 0; // default, disabled
+
+    DConfig *dConfigPtr = DConfig::create(dConfigAppID, dConfigName);
+    if (dConfigPtr && dConfigPtr->isValid() && dConfigPtr->keyList().contains("fsCacheSize")) {
+        size = dConfigPtr->value("fsCacheSize").toULongLong();
+    }
+
+    if (dConfigPtr) {
+        dConfigPtr->deleteLater();
+    }
+
+    return size;
+}
+
+bool Machine::getFsWritable() {
+    bool writable = false; // default
+
+    DConfig *dConfigPtr = DConfig::create(dConfigAppID, dConfigName);
+    if (dConfigPtr && dConfigPtr->isValid() && dConfigPtr->keyList().contains("fsWritable")) {
+        writable = dConfigPtr->value("fsWritable").toBool();
+    }
+
+    if (dConfigPtr) {
+        dConfigPtr->deleteLater();
+    }
+
+    return writable;
+}
+
+bool Machine::getUdpInput() {
+    bool enabled = true; // default
+
+    DConfig *dConfigPtr = DConfig::create(dConfigAppID, dConfigName);
+    if (dConfigPtr && dConfigPtr->isValid() && dConfigPtr->keyList().contains("udpInput")) {
+        enabled = dConfigPtr->value("udpInput").toBool();
+    }
+
+    if (dConfigPtr) {
+        dConfigPtr->deleteLater();
+    }
+
+    return enabled;
+}
+
+void Machine::setupInputChannel() {
+    m_inputChannel.reset();
+    if (!getUdpInput()) {
+        return;
+    }
+
+    m_inputChannel = std::make_unique<InputChannel>(QHostAddress(QString::fromStdString(m_ip)));
+    if (m_inputChannel->port() == 0) {
+        m_inputChannel.reset();
+        return;
+    }
+
+    QObject::connect(m_inputChannel.get(),
+                     &InputChannel::received,
+                     this,
+                     &Machine::handleInputChannelFrame);
+}
+
+void Machine::handleInputChannelFrame(const InputEventRequest &req) {
+    if (!m_holdInput) {
+        emitInputEvents(req);
+        return;
+    }
+
+    m_heldInput.push_back(req);
+    if (!m_heldInputTimer->isActive()) {
+        m_heldInputTimer->start();
+    }
+}
+
+void Machine::releaseHeldInput(int64_t serial) {
+    m_holdInput = false;
+    m_heldInputTimer->stop();
+
+    std::vector<InputEventRequest> held;
+    held.swap(m_heldInput);
+    for (const auto &req : held) {
+        if (req.serial() > serial || !isMotionFrame(req)) {
+            emitInputEvents(req);
+        }
+    }
+}
+
 void Machine::sendPairRequest() {
     Message msg;
     auto *request = msg.mutable_pairrequest();
     request->set_key(SCAN_KEY);
     m_manager->completeDeviceInfo(request->mutable_deviceinfo());
 
+    setupInputChannel();
+    if (m_inputChannel) {
+        request->set_inputport(m_inputChannel->port());
+        request->set_inputtoken(m_inputChannel->token());
+    }
+
     sendMessage(msg);
 }
 
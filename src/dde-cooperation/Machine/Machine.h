@@ -5,7 +5,9 @@
 #ifndef MACHINE_MACHINE_H
 #define MACHINE_MACHINE_H
 
+#include <deque>
 #include <filesystem>
+#include <optional>
 
 #include <QVector>
 #include <QString>
@@ -13,6 +15,7 @@
 #include <QtDBus>
 
 #include "common.h"
+#include "utils/latency.h"
 
 #include "protocol/message.pb.h"
 
@@ -22,7 +25,8 @@ class Manager;
 class MachineDBusAdaptor;
 class ClipboardBase;
 class Request;
-class InputEmitterWrapper;
+class InputEventFrame;
+class InputChannel;
 class FuseServer;
 class FuseClient;
 class ReceiveTransfer;
@@ -52,11 +56,14 @@ public:
     void updateMachineInfo(const std::string &ip, uint16_t port, const DeviceInfo &devInfo);
 
     void receivedPing();
-    void onPair(QTcpSocket *socket);
-    void onInputGrabberEvent(uint8_t deviceType, unsigned int type, unsigned int code, int value);
+    void onPair(QTcpSocket *socket, const PairRequest &req);
+    void onInputGrabberFrame(uint8_t deviceType, const InputEventFrame &frame);
+    void onInputEmitterLatency(const std::vector<uint32_t> &emitLatency,
+                               const std::vector<uint32_t> &totalLatency);
     void onClipboardTargetsChanged(const std::vector<std::string> &targets);
 
-    void flowTo(uint16_t direction, uint16_t x, uint16_t y) noexcept;
+    void flowTo(uint16_t direction, uint16_t x, uint16_t y, double position) noexcept;
+    void prepareFlow(uint16_t direction, double position) noexcept;
     void readTarget(const std::string &target);
 
     bool isPcMachine() const;
@@ -64,6 +71,10 @@ public:
     bool isAndroid() const;
 
     bool connected() const { return !!m_conn; }
+
+    // 各环节输入延迟的统计，单位微秒
+    QVariantMap inputLatency() const;
+    void resetInputLatency();
     Manager *manager() const { return m_manager; }
 
 protected:
@@ -94,8 +105,45 @@ private:
     QTimer *m_pingTimer;
     QTimer *m_offlineTimer;
     QTimer *m_pairTimeoutTimer;
-
-    std::unordered_map<InputDeviceType, std::unique_ptr<InputEmitterWrapper>> m_inputEmitters;
+    QTimer *m_inputAckTimer;
+    QTimer *m_inputClockTimer;
+    QTimer *m_motionFlushTimer;
+    QTimer *m_heldInputTimer;
+
+    // 发送端最近发出和已被确认的输入事件序号
+    int64_t m_inputSerial;
+    int64_t m_inputAckedSerial;
+    // 接收端已处理的最大序号和尚未上报的失败序号
+    int64_t m_inputReceivedSerial;
+    std::vector<int64_t> m_inputFailed;
+
+    // UDP 输入通道，对端不支持时为空
+    std::unique_ptr<InputChannel> m_inputChannel;
+    // 对端的鼠标不在本机时，UDP 收到的帧可能早于走 TCP 的 FlowRequest，
+    // 先暂存起来，应用 FlowRequest 后再注入
+    bool m_holdInput;
+    std::vector<InputEventRequest> m_heldInput;
+    uint16_t m_peerInputPort;
+    uint64_t m_peerInputToken;
+
+    // 对端的按键重复设置，由本端生成按键重复，对端不支持时为 0
+    uint32_t m_peerRepeatDelay;
+    uint32_t m_peerRepeatInterval;
+
+    // 拥塞时合并起来尚未发出的鼠标移动，内核发送队列排空时不一定有 bytesWritten，
+    // 由 m_motionFlushTimer 定时检查
+    std::optional<InputEventRequest> m_pendingMotion;
+
+    // 最近几次时钟同步的 (往返时间, 对端时钟 - 本机时钟)，取往返时间最短的一次
+    std::deque<std::pair<int64_t, int64_t>> m_clockSamples;
+    int64_t m_clockOffset;
+    bool m_clockSynced;
+
+    // 发送端：内核时间戳到 daemon；接收端：网络传输、daemon 到 uinput、内核时间戳到 uinput
+    LatencyHistogram m_captureLatency;
+    LatencyHistogram m_networkLatency;
+    LatencyHistogram m_emitLatency;
+    LatencyHistogram m_totalLatency;
 
     std::unique_ptr<FuseServer> m_fuseServer;
     std::unique_ptr<FuseClient> m_fuseClient;
@@ -120,8 +168,28 @@ private:
     void handleDeviceSharingStartResponse(const DeviceSharingStartResponse &resp);
     void handleDeviceSharingStopRequest();
     void handleInputEventRequest(const InputEventRequest &req);
+    void handleInputEventAck(const InputEventAck &ack);
+    void handleInputClockRequest(const InputClockRequest &req);
+    void handleInputClockResponse(const InputClockResponse &resp);
+    void handleKeyRepeatNtf(const KeyRepeatNtf &ntf);
+    bool emitInputEvents(const InputEventRequest &req);
+    void handleInputChannelFrame(const InputEventRequest &req);
+    // 注入暂存的帧，序号不大于 serial 的移动属于上一次流转，直接丢弃
+    void releaseHeldInput(int64_t serial);
+    // 开始共享或对端的按键重复设置变化时把共用的虚拟设备交给本机
+    void attachInputEmitters();
+    // 松开本机通过共用的虚拟设备按下的键，避免断开后按键卡住
+    void releaseInputEmitters();
+    static bool isMotionFrame(const InputEventRequest &req);
+    qint64 inputBacklog() const;
+    // 连接积压或对端未确认的帧过多，需要合并鼠标移动
+    bool inputCongested() const;
+    void coalesceMotion(const InputEventRequest &req);
+    void flushPendingMotion();
+    void sendInputFrame(InputEventRequest &req);
     void handleFlowDirectionNtf(const FlowDirectionNtf &ntf);
     void handleFlowRequest(const FlowRequest &req);
+    void handleFlowPrepare(const FlowPrepare &req);
     void handleFsRequest(const FsRequest &req);
     void handleFsResponse(const FsResponse &resp);
     void handleFsSendFileRequest(const FsSendFileRequest &req);
@@ -138,8 +206,15 @@ private:
     void receivedUserConfirm(bool accepted);
     void receivedUserOperated(bool tryAgain);
     void sendFlowDirectionNtf();
+    void sendInputEventAck();
+    void sendInputClockRequest();
+    void sendKeyRepeatNtf();
     void sendReceivedFilesSystemNtf(const QString &body);
     int getPairTimeoutInterval();
+    uint64_t getFsCacheSize();
+    bool getFsWritable();
+    bool getUdpInput();
+    void setupInputChannel();
     void sendPairRequest();
 
 protected:
@@ -153,6 +228,7 @@ protected:
     void stopDeviceSharing();
     void setFlowDirection(FlowDirection direction);
     void transferSendFiles(const QStringList &filePaths);
+    void mountFs(const std::string &path);
     void sendMessage(const Message &msg);
 
     virtual void handleConnected() = 0;
@@ -139,6 +139,14 @@ void MachineDBusAdaptor::SendFiles(const QStringList &paths, const QDBusMessage
     m_machine->sendFiles(paths);
 }
 
+QVariantMap MachineDBusAdaptor::GetInputLatency() const {
+    return m_machine->inputLatency();
+}
+
+void MachineDBusAdaptor::ResetInputLatency() const {
+    m_machine->resetInputLatency();
+}
+
 void MachineDBusAdaptor::updateName(const QString &name) {
     propertiesChanged("Name", name);
 }
@@ -57,6 +57,9 @@ public slots: // D-Bus methods
     void StopDeviceSharing(const QDBusMessage &message) const;
     void SetFlowDirection(quint16 direction, const QDBusMessage &message) const;
     void SendFiles(const QStringList &paths, const QDBusMessage &message) const;
+    // 各环节输入延迟：capture、network、emit、total -> {count, p50, p99, max}，单位微秒
+    QVariantMap GetInputLatency() const;
+    void ResetInputLatency() const;
 
 protected: // update properties
     void updateName(const QString &name);
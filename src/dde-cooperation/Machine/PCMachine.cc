@@ -35,10 +35,3 @@ void PCMachine::sendFiles(const QStringList &filePaths) {
         sendMessage(msg);
     }
 }
-
-void PCMachine::mountFs(const std::string &path) {
-    Message msg;
-    auto *request = msg.mutable_fsrequest();
-    request->set_path(path);
-    sendMessage(msg);
-}
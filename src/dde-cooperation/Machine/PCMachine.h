@@ -25,9 +25,6 @@ protected:
     virtual void handleDisconnected() override;
     virtual void handleCastRequest([[maybe_unused]] const CastRequest &req) override {}
     virtual void sendFiles(const QStringList &filePaths) override;
-
-private:
-    void mountFs(const std::string &path);
 };
 
 #endif // !MACHINE_PCMACHINE_H
@@ -27,6 +27,7 @@
 #include "utils/net.h"
 #include "protocol/message.pb.h"
 #include "Wrappers/InputGrabbersManager.h"
+#include "Wrappers/InputEmitterPool.h"
 
 namespace fs = std::filesystem;
 
@@ -48,7 +49,8 @@ Manager::Manager(const std::filesystem::path &dataDir)
                         "org.freedesktop.ScreenSaver")
     , m_dConfig(DConfig::create(dConfigAppID, dConfigName))
     , m_androidMainWindow(nullptr)
-    , m_inputGrabbersManager(new InputGrabbersManager(this)) {
+    , m_inputGrabbersManager(new InputGrabbersManager(this))
+    , m_inputEmitterPool(new InputEmitterPool(this)) {
     ensureDataDirExists();
     initUUID();
     initFileStoragePath();
@@ -56,6 +58,7 @@ Manager::Manager(const std::filesystem::path &dataDir)
     initSharedDevicesStatus();
     initCooperatedMachines();
     initServiceSwitch();
+    initPredictiveFlow();
 
     connect(m_socketScan, &QUdpSocket::readyRead, this, &Manager::handleReceivedSocketScan);
     m_socketScan->bind(QHostAddress::Any, m_scanPort);
@@ -190,6 +193,16 @@ void Manager::initServiceSwitch() {
     m_deviceSharingSwitch = m_dConfig->value("serviceSwitch").toBool();
 }
 
+void Manager::initPredictiveFlow() {
+    if (!m_dConfig || !m_dConfig->isValid() || !m_dConfig->keyList().contains("predictiveFlow")) {
+        qWarning("dConfig is invalid or does not has predictiveFlow key!");
+        m_predictiveFlow = false;
+        return;
+    }
+
+    m_predictiveFlow = m_dConfig->value("predictiveFlow").toBool();
+}
+
 void Manager::completeDeviceInfo(DeviceInfo *info) {
     info->set_uuid(m_uuid);
     info->set_name(Net::getHostname());
@@ -304,6 +317,31 @@ bool Manager::setDeviceSharingSwitch(bool value) noexcept {
     return true;
 }
 
+InputEmitterWrapper *Manager::inputEmitter(InputDeviceType type) const {
+    return m_inputEmitterPool->emitter(type);
+}
+
+bool Manager::isInputDebug() const noexcept {
+    // 每次调用时读取，修改配置后不需要重启服务
+    if (!m_dConfig || !m_dConfig->isValid() || !m_dConfig->keyList().contains("inputDebug")) {
+        return false;
+    }
+
+    return m_dConfig->value("inputDebug").toBool();
+}
+
+bool Manager::startInputRecording(const QString &path) noexcept {
+    return m_inputGrabbersManager->startRecording(path);
+}
+
+void Manager::stopInputRecording() noexcept {
+    m_inputGrabbersManager->stopRecording();
+}
+
+bool Manager::replayInput(const QString &path, double speed) noexcept {
+    return m_inputGrabbersManager->replay(path, speed);
+}
+
 bool Manager::hasPcMachinePaired() const {
     for (const auto &v : m_machines) {
         const std::shared_ptr<Machine> &machine = v.second;
@@ -364,16 +402,20 @@ void Manager::connectNewAndroidDevice() noexcept {
     m_androidMainWindow->showConnectDevice();
 }
 
-bool Manager::tryFlowOut(uint16_t direction, uint16_t x, uint16_t y, bool evFromPeer) {
+bool Manager::tryFlowOut(uint16_t direction,
+                         uint16_t x,
+                         uint16_t y,
+                         double position,
+                         bool evFromPeer) {
     for (const auto &v : m_machines) {
         const std::shared_ptr<Machine> &machine = v.second;
         if (machine->m_deviceSharing && machine->m_direction == direction) {
             if (evFromPeer) {
                 qInfo() << fmt::format("flow back to machine: {}", machine->m_name).data();
-                machine->flowTo(direction, x, y);
+                machine->flowTo(direction, x, y, position);
             } else if (isSharedDevices()) {
                 qInfo() << fmt::format("flow out to machine: {}", machine->m_name).data();
-                machine->flowTo(direction, x, y);
+                machine->flowTo(direction, x, y, position);
                 onFlowOut(machine);
             }
             return true;
@@ -383,6 +425,32 @@ bool Manager::tryFlowOut(uint16_t direction, uint16_t x, uint16_t y, bool evFrom
     return false;
 }
 
+void Manager::prepareFlow(uint16_t direction, double position, bool evFromPeer) {
+    if (!evFromPeer && !isSharedDevices()) {
+        return;
+    }
+
+    for (const auto &v : m_machines) {
+        const std::shared_ptr<Machine> &machine = v.second;
+        if (machine->m_deviceSharing && machine->m_direction == direction) {
+            machine->prepareFlow(direction, position);
+            return;
+        }
+    }
+}
+
+uint8_t Manager::flowEdges() const {
+    uint8_t edges = 0;
+    for (const auto &v : m_machines) {
+        const std::shared_ptr<Machine> &machine = v.second;
+        if (machine->m_deviceSharing) {
+            edges |= 1 << machine->m_direction;
+        }
+    }
+
+    return edges;
+}
+
 void Manager::cooperationStatusChanged(bool enable) {
     if (enable) {
         scan();
@@ -599,7 +667,7 @@ void Manager::handleNewConnection() noexcept {
                            .data();
 
             socket->disconnect();
-            machine->onPair(socket);
+            machine->onPair(socket, request);
         });
     }
 }
@@ -647,10 +715,27 @@ void Manager::onStopDeviceSharing() {
     unInhibitScreensaver();
 }
 
-void Manager::onFlowBack(uint16_t direction, uint16_t x, uint16_t y) {
+void Manager::onFlowEdgesChanged() {
+    m_displayServer->updateEdges();
+}
+
+void Manager::onFlowPrepare(uint16_t direction, double position) {
+    // 本机的鼠标已经流转到对端时光标是隐藏的，可以直接移动。
+    // 否则是对端的鼠标即将流转过来，本机用户正在使用鼠标时不移动，避免打断本机的操作
+    if (!m_inputGrabbersManager->grabbing() && !m_displayServer->pointerIdle()) {
+        return;
+    }
+
+    m_displayServer->prepareFlowBack(direction, position);
+}
+
+void Manager::onFlowBack(uint16_t direction,
+                         uint16_t x,
+                         uint16_t y,
+                         std::optional<double> position) {
     m_inputGrabbersManager->stopGrab();
 
-    m_displayServer->flowBack(direction, x, y);
+    m_displayServer->flowBack(direction, x, y, position);
 }
 
 void Manager::onFlowOut(const std::weak_ptr<Machine> &machine) {
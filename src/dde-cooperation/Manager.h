@@ -8,6 +8,7 @@
 #include <unordered_map>
 #include <filesystem>
 #include <memory>
+#include <optional>
 #include <thread>
 
 #include <arpa/inet.h>
@@ -37,6 +38,8 @@ class DisplayBase;
 class ClipboardBase;
 class AndroidMainWindow;
 class InputGrabbersManager;
+class InputEmitterPool;
+class InputEmitterWrapper;
 
 class Manager : public QObject, public ClipboardObserver {
     friend class ManagerDBusAdaptor;
@@ -52,8 +55,11 @@ public:
     QString fileStoragePath() const noexcept { return m_fileStoragePath; }
     bool isSharedClipboard() const noexcept { return m_sharedClipboard; }
     bool isSharedDevices() const noexcept { return m_sharedDevices; }
+    bool isPredictiveFlow() const noexcept { return m_predictiveFlow; }
 
-    bool tryFlowOut(uint16_t direction, uint16_t x, uint16_t y, bool evFromPeer);
+    bool tryFlowOut(uint16_t direction, uint16_t x, uint16_t y, double position, bool evFromPeer);
+    uint8_t flowEdges() const;
+    void prepareFlow(uint16_t direction, double position, bool evFromPeer);
     bool hasPcMachinePaired() const;
     bool hasAndroidPaired() const;
     void machineCooperated(const std::string &machineId);
@@ -62,7 +68,9 @@ public:
     void onMachineOffline(const std::string &uuid);
     void onStartDeviceSharing(const std::weak_ptr<Machine> &machine, bool proactively);
     void onStopDeviceSharing();
-    void onFlowBack(uint16_t direction, uint16_t x, uint16_t y);
+    void onFlowBack(uint16_t direction, uint16_t x, uint16_t y, std::optional<double> position);
+    void onFlowEdgesChanged();
+    void onFlowPrepare(uint16_t direction, double position);
     void onFlowOut(const std::weak_ptr<Machine> &machine);
     virtual void onClipboardTargetsChanged(const std::vector<std::string> &targets) override;
     virtual bool onReadClipboardContent(const std::string &target) override;
@@ -73,6 +81,7 @@ public:
     const QString &getFileStoragePath() const { return m_fileStoragePath; }
     void completeDeviceInfo(DeviceInfo *info);
     QPointer<AndroidMainWindow> getAndroidMainWindow();
+    InputEmitterWrapper *inputEmitter(InputDeviceType type) const;
 
 protected:
     void scan() noexcept;
@@ -82,6 +91,11 @@ protected:
     void openSharedClipboard(bool on) noexcept;
     void openSharedDevices(bool on) noexcept;
     bool setDeviceSharingSwitch(bool value) noexcept;
+    // 录制和重放输入事件只在打开 inputDebug 配置时可用
+    bool isInputDebug() const noexcept;
+    bool startInputRecording(const QString &path) noexcept;
+    void stopInputRecording() noexcept;
+    bool replayInput(const QString &path, double speed) noexcept;
 
 private:
     QDBusConnection m_bus;
@@ -113,11 +127,13 @@ private:
 
     bool m_sharedClipboard;
     bool m_sharedDevices;
+    bool m_predictiveFlow;
     QStringList m_cooperatedMachines;
     std::shared_ptr<DConfig> m_dConfig;
 
     QPointer<AndroidMainWindow> m_androidMainWindow;
     InputGrabbersManager *m_inputGrabbersManager;
+    InputEmitterPool *m_inputEmitterPool;
 
     void ensureDataDirExists();
     void initUUID();
@@ -130,6 +146,7 @@ private:
     void initSharedDevicesStatus();
     void initCooperatedMachines();
     void initServiceSwitch();
+    void initPredictiveFlow();
 
     void cooperationStatusChanged(bool enable);
     void updateMachine(const std::string &ip, uint16_t port, const DeviceInfo &devInfo);
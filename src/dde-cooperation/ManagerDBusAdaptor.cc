@@ -107,6 +107,51 @@ void ManagerDBusAdaptor::SetDeviceSharingSwitch(bool value) const {
     m_manager->setDeviceSharingSwitch(value);
 }
 
+void ManagerDBusAdaptor::StartInputRecording(const QString &path,
+                                             const QDBusMessage &message) const {
+    // 录制文件包含键入的所有内容，任何会话总线上的客户端都能调用，默认关闭
+    if (!m_manager->isInputDebug()) {
+        m_bus.send(message.createErrorReply(
+            {QDBusError::AccessDenied, QStringLiteral("input debug is disabled")}));
+        return;
+    }
+
+    if (path.isEmpty()) {
+        m_bus.send(message.createErrorReply({QDBusError::InvalidArgs, QStringLiteral("empty path")}));
+        return;
+    }
+
+    if (!m_manager->startInputRecording(path)) {
+        m_bus.send(message.createErrorReply(
+            {QDBusError::Failed, QStringLiteral("failed to open recording file")}));
+    }
+}
+
+void ManagerDBusAdaptor::StopInputRecording() const {
+    m_manager->stopInputRecording();
+}
+
+void ManagerDBusAdaptor::ReplayInput(const QString &path,
+                                     double speed,
+                                     const QDBusMessage &message) const {
+    if (!m_manager->isInputDebug()) {
+        m_bus.send(message.createErrorReply(
+            {QDBusError::AccessDenied, QStringLiteral("input debug is disabled")}));
+        return;
+    }
+
+    if (path.isEmpty() || speed < 0) {
+        m_bus.send(message.createErrorReply({QDBusError::InvalidArgs, QStringLiteral("invalid args")}));
+        return;
+    }
+
+    if (!m_manager->replayInput(path, speed)) {
+        m_bus.send(message.createErrorReply(
+            {QDBusError::Failed,
+             QStringLiteral("start device sharing first, or recording is invalid or busy")}));
+    }
+}
+
 void ManagerDBusAdaptor::updateMachines(const QVector<QDBusObjectPath> &machines) {
     QList<QDBusObjectPath> list;
     for (const QDBusObjectPath &path : machines) {
@@ -46,6 +46,11 @@ public slots: // D-Bus methods
     void OpenSharedClipboard(bool on) const;
     void OpenSharedDevices(bool on) const;
     void SetDeviceSharingSwitch(bool value) const;
+    // 录制共享出去的输入事件，并重放到当前共享设备的机器，speed 为 0 时不限速。
+    // 需要打开 inputDebug 配置，否则返回 AccessDenied
+    void StartInputRecording(const QString &path, const QDBusMessage &message) const;
+    void StopInputRecording() const;
+    void ReplayInput(const QString &path, double speed, const QDBusMessage &message) const;
 
 protected: // update properties
     void updateMachines(const QVector<QDBusObjectPath> &machines);
@@ -0,0 +1,26 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "InputEmitterPool.h"
+
+#include "InputEmitterWrapper.h"
+
+InputEmitterPool::InputEmitterPool(QObject *parent)
+    : QObject(parent) {
+    for (auto type : {InputDeviceType::KEYBOARD, InputDeviceType::MOUSE, InputDeviceType::TOUCHPAD}) {
+        m_emitters.emplace(type, std::make_unique<InputEmitterWrapper>(type));
+    }
+}
+
+InputEmitterPool::~InputEmitterPool() {
+}
+
+InputEmitterWrapper *InputEmitterPool::emitter(InputDeviceType type) const {
+    auto it = m_emitters.find(type);
+    if (it == m_emitters.end()) {
+        return nullptr;
+    }
+
+    return it->second.get();
+}
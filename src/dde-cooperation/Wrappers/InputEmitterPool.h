@@ -0,0 +1,32 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef WRAPPERS_INPUTEMITTERPOOL_H
+#define WRAPPERS_INPUTEMITTERPOOL_H
+
+#include <memory>
+#include <unordered_map>
+
+#include <QObject>
+
+#include "common.h"
+
+class InputEmitterWrapper;
+
+// daemon 启动时就创建好各类虚拟输入设备，所有对端共用，
+// 开始、停止共享设备和切换对端时不再重新创建，udev、libinput 和 X 也无需重新识别
+class InputEmitterPool : public QObject {
+    Q_OBJECT
+
+public:
+    explicit InputEmitterPool(QObject *parent = nullptr);
+    ~InputEmitterPool();
+
+    InputEmitterWrapper *emitter(InputDeviceType type) const;
+
+private:
+    std::unordered_map<InputDeviceType, std::unique_ptr<InputEmitterWrapper>> m_emitters;
+};
+
+#endif // !WRAPPERS_INPUTEMITTERPOOL_H
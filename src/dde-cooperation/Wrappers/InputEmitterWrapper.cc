@@ -4,24 +4,35 @@
 
 #include "InputEmitterWrapper.h"
 
+#include <linux/input.h>
+
 #include <QLocalServer>
 #include <QLocalSocket>
 #include <QProcess>
+#include <QTimer>
 
 #include "config.h"
+#include "Machine/Machine.h"
+#include "utils/latency.h"
 #include "utils/message_helper.h"
 #include "protocol/ipc_message.pb.h"
+#include "protocol/device_sharing.pb.h"
+
+static constexpr uint32_t ringCapacity = 4096;
+// input-emitter 异常退出后重新拉起的间隔
+static constexpr int restartInterval = 1000;
 
 InputEmitterWrapper::InputEmitterWrapper(InputDeviceType type)
     : m_server(new QLocalServer(this))
     , m_conn(nullptr)
     , m_process(new QProcess(this))
-    , m_type(type) {
-    m_server->listen(QString("DDECooperationInputEmitter-%1-%2")
-                         .arg(reinterpret_cast<quintptr>(this))
-                         .arg(static_cast<uint8_t>(type)));
+    , m_fallbackSerial(0)
+    , m_ackedSerial(0)
+    , m_ringOverflows(0)
+    , m_type(type)
+    , m_repeatDelay(0)
+    , m_repeatInterval(0) {
     m_server->setMaxPendingConnections(1);
-    qDebug() << "InputEmitter listen addr:" << m_server->serverName();
 
     connect(m_server,
             &QLocalServer::newConnection,
@@ -33,12 +44,12 @@ InputEmitterWrapper::InputEmitterWrapper(InputDeviceType type)
             this,
             &InputEmitterWrapper::onProcessClosed);
     m_process->setProcessChannelMode(QProcess::ForwardedChannels);
-    m_process->start(
-        INPUT_EMITTER_PATH,
-        QStringList{m_server->serverName(), QString::number(static_cast<uint8_t>(type))});
+    startProcess();
 }
 
 InputEmitterWrapper::~InputEmitterWrapper() {
+    disconnect(m_process, nullptr, this, nullptr);
+
     m_server->close();
     if (m_conn) {
         m_conn->close();
@@ -47,17 +58,166 @@ InputEmitterWrapper::~InputEmitterWrapper() {
     m_process->waitForFinished(100);
 }
 
-bool InputEmitterWrapper::emitEvent(unsigned int type, unsigned int code, int value) noexcept {
+void InputEmitterWrapper::setMachine(const std::weak_ptr<Machine> &machine) {
+    m_machine = machine;
+}
+
+void InputEmitterWrapper::setKeyRepeat(uint32_t delay, uint32_t interval) {
+    if (delay == m_repeatDelay && interval == m_repeatInterval) {
+        return;
+    }
+
+    m_repeatDelay = delay;
+    m_repeatInterval = interval;
+    sendKeyRepeat();
+}
+
+void InputEmitterWrapper::release(const Machine *machine) {
+    auto owner = m_machine.lock();
+    if (owner && owner.get() != machine) {
+        return;
+    }
+    m_machine.reset();
+
+    if (!m_pressed.empty()) {
+        releasePressed();
+    }
+    sendReset();
+}
+
+void InputEmitterWrapper::releasePressed() {
+    qInfo() << "releasing" << m_pressed.size() << "pressed keys of input emitter"
+            << static_cast<uint8_t>(m_type);
+
+    InputEventRequest req;
+    for (auto code : m_pressed) {
+        auto *ev = req.add_events();
+        ev->set_type(EV_KEY);
+        ev->set_code(code);
+        ev->set_value(0);
+    }
+    auto *syn = req.add_events();
+    syn->set_type(EV_SYN);
+    syn->set_code(SYN_REPORT);
+    syn->set_value(0);
+
+    emitEvents(req, 0);
+    m_pressed.clear();
+}
+
+void InputEmitterWrapper::trackPressed(int32_t type, int32_t code, int32_t value) {
+    if (type != EV_KEY) {
+        return;
+    }
+
+    if (value == 0) {
+        m_pressed.erase(code);
+    } else {
+        m_pressed.insert(code);
+    }
+}
+
+void InputEmitterWrapper::sendKeyRepeat() {
+    if (!m_conn) {
+        return;
+    }
+
+    InputEmitterParent msg;
+    auto *keyRepeat = msg.mutable_keyrepeat();
+    keyRepeat->set_delay(m_repeatDelay);
+    keyRepeat->set_interval(m_repeatInterval);
+    m_conn->write(MessageHelper::genMessage(msg));
+}
+
+void InputEmitterWrapper::sendReset() {
+    if (!m_conn) {
+        return;
+    }
+
+    InputEmitterParent msg;
+    msg.mutable_reset();
+    m_conn->write(MessageHelper::genMessage(msg));
+}
+
+void InputEmitterWrapper::startProcess() {
+    // 每次拉起进程都重新监听，连接建立后关闭
+    if (!m_server->isListening()) {
+        m_server->listen(QString("DDECooperationInputEmitter-%1-%2")
+                             .arg(reinterpret_cast<quintptr>(this))
+                             .arg(static_cast<uint8_t>(m_type)));
+        qDebug() << "InputEmitter listen addr:" << m_server->serverName();
+    }
+
+    m_process->start(
+        INPUT_EMITTER_PATH,
+        QStringList{m_server->serverName(), QString::number(static_cast<uint8_t>(m_type))});
+}
+
+bool InputEmitterWrapper::emitEvents(const InputEventRequest &req, int64_t timestamp) noexcept {
     if (!m_conn) {
         return false;
     }
 
+    int64_t sendTime = Latency::now();
+
+    if (req.events_size() == 0) {
+        trackPressed(req.type(), req.code(), req.value());
+    }
+    for (const auto &ev : req.events()) {
+        trackPressed(ev.type(), ev.code(), ev.value());
+    }
+
+    if (m_ring && m_fallbackSerial == m_ackedSerial) {
+        m_ringFrame.clear();
+        if (req.events_size() == 0) {
+            m_ringFrame.push_back({0,
+                                   0,
+                                   static_cast<uint16_t>(req.type()),
+                                   static_cast<uint16_t>(req.code()),
+                                   req.value(),
+                                   timestamp,
+                                   sendTime});
+        }
+        for (const auto &ev : req.events()) {
+            m_ringFrame.push_back({0,
+                                   0,
+                                   static_cast<uint16_t>(ev.type()),
+                                   static_cast<uint16_t>(ev.code()),
+                                   ev.value(),
+                                   timestamp,
+                                   sendTime});
+        }
+        if (m_ring->push(m_ringFrame.data(), m_ringFrame.size())) {
+            return true;
+        }
+
+        // input-emitter 处理不过来，丢帧可能丢掉松开按键的事件，改走 socket
+        qWarning() << "input-emitter ring full, fall back to socket, overflows:" << ++m_ringOverflows;
+    }
+
     InputEmitterParent msg;
-    auto *inputEvent = msg.mutable_inputevent();
-    inputEvent->set_type(type);
-    inputEvent->set_code(code);
-    inputEvent->set_value(value);
-    return m_conn->write(MessageHelper::genMessage(msg));
+    auto *frame = msg.mutable_frame();
+    frame->set_timestamp(timestamp);
+    frame->set_sendtime(sendTime);
+    if (m_ring) {
+        frame->set_serial(++m_fallbackSerial);
+    }
+    if (req.events_size() == 0) {
+        // 旧版本每个消息只带一个事件
+        auto *inputEvent = frame->add_events();
+        inputEvent->set_type(req.type());
+        inputEvent->set_code(req.code());
+        inputEvent->set_value(req.value());
+    } else {
+        frame->mutable_events()->Reserve(req.events_size());
+        for (const auto &ev : req.events()) {
+            auto *inputEvent = frame->add_events();
+            inputEvent->set_type(ev.type());
+            inputEvent->set_code(ev.code());
+            inputEvent->set_value(ev.value());
+        }
+    }
+    return m_conn->write(MessageHelper::genMessage(msg)) != -1;
 }
 
 void InputEmitterWrapper::handleNewConnection() {
@@ -68,19 +228,80 @@ void InputEmitterWrapper::handleNewConnection() {
     m_conn = m_server->nextPendingConnection();
     m_server->close();
 
+    m_fallbackSerial = 0;
+    m_ackedSerial = 0;
+
+    // 必须先于其他消息发出，失败时退回到用 socket 传递事件
+    m_ring = ShmRing<InputRingEvent>::create(ringCapacity);
+    if (!m_ring || !ShmRingHelper::sendFds(m_conn->socketDescriptor(),
+                                           {m_ring->memfd(), m_ring->eventfd()})) {
+        qWarning("failed to set up shared memory ring for input-emitter");
+        m_ring.reset();
+    }
+
     connect(m_conn, &QLocalSocket::readyRead, this, &InputEmitterWrapper::onReceived);
     connect(m_conn, &QLocalSocket::disconnected, this, &InputEmitterWrapper::onDisconnected);
+
+    // 进程重启后恢复之前的设置
+    if (m_repeatDelay != 0) {
+        sendKeyRepeat();
+    }
 }
 
 void InputEmitterWrapper::onReceived() {
-    qDebug("input-emitter onReceived");
+    while (m_conn->size() >= header_size) {
+        QByteArray buffer = m_conn->peek(header_size);
+        auto header = MessageHelper::parseMessageHeader(buffer);
+        if (!header.legal()) {
+            qWarning() << "illegal message from input-emitter";
+            return;
+        }
+
+        if (m_conn->size() < static_cast<qint64>(header_size + header.size())) {
+            qDebug() << "partial content";
+            return;
+        }
+
+        m_conn->read(header_size);
+        auto size = header.size();
+        buffer = m_conn->read(size);
+
+        auto base = MessageHelper::parseMessageBody<InputEmitterChild>(buffer.data(),
+                                                                       buffer.size());
+
+        switch (base.payload_case()) {
+        case InputEmitterChild::PayloadCase::kLatency: {
+            const auto &latency = base.latency();
+            auto machine = m_machine.lock();
+            if (machine) {
+                machine->onInputEmitterLatency(
+                    {latency.emitlatency().begin(), latency.emitlatency().end()},
+                    {latency.totallatency().begin(), latency.totallatency().end()});
+            }
+            break;
+        }
+        case InputEmitterChild::PayloadCase::kFrameAck: {
+            m_ackedSerial = base.frameack().serial();
+            break;
+        }
+        case InputEmitterChild::PAYLOAD_NOT_SET: {
+            break;
+        }
+        }
+    }
 }
 
-void InputEmitterWrapper::onProcessClosed([[maybe_unused]] int exitCode,
-                                          [[maybe_unused]] QProcess::ExitStatus exitStatus) {
-    // todo: remove emitter
+void InputEmitterWrapper::onProcessClosed(int exitCode, QProcess::ExitStatus exitStatus) {
+    qWarning() << "input-emitter exited:" << exitCode << exitStatus;
+    QTimer::singleShot(restartInterval, this, &InputEmitterWrapper::startProcess);
 }
 
 void InputEmitterWrapper::onDisconnected() {
-    // todo: remove emitter
+    m_conn->deleteLater();
+    m_conn = nullptr;
+    m_ring.reset();
+    // 进程退出时内核销毁虚拟设备，按下的键随之松开
+    m_pressed.clear();
+
+    m_process->kill();
 }
@@ -6,27 +6,40 @@
 #define WRAPPERS_INPUTEMITTERWRAPPER_H
 
 #include <filesystem>
+#include <memory>
+#include <set>
+#include <vector>
 
 #include <QObject>
 #include <QProcess>
 
 #include "common.h"
+#include "utils/shm_ring.h"
 
 class QLocalServer;
 class QLocalSocket;
 class QProcess;
+class QSocketNotifier;
 
 class Manager;
 class Machine;
+class InputEventRequest;
 
+// 管理一个 input-emitter 进程及其虚拟设备，进程退出后自动重新拉起
 class InputEmitterWrapper : public QObject {
     Q_OBJECT
 
 public:
     explicit InputEmitterWrapper(InputDeviceType type);
     ~InputEmitterWrapper();
+    // 延迟统计上报给最近一次注入事件的 Machine
     void setMachine(const std::weak_ptr<Machine> &machine);
-    bool emitEvent(unsigned int type, unsigned int code, int value) noexcept;
+    // timestamp 为换算到本机时钟的内核时间戳，未知时为 0
+    bool emitEvents(const InputEventRequest &req, int64_t timestamp) noexcept;
+    // 对端的按键重复设置，与当前设置不同时才通知 input-emitter
+    void setKeyRepeat(uint32_t delay, uint32_t interval);
+    // machine 断开或停止共享时松开它按下的键并停止按键重复，设备由其他 Machine 使用时忽略
+    void release(const Machine *machine);
 
 private slots:
     void onProcessClosed(int exitCode, QProcess::ExitStatus exitStatus);
@@ -39,7 +52,27 @@ private:
     QLocalSocket *m_conn;
     QProcess *m_process;
 
+    std::unique_ptr<ShmRing<InputRingEvent>> m_ring;
+    std::vector<InputRingEvent> m_ringFrame;
+    // 队列满后改走 socket，直到 input-emitter 确认处理完最后一个经 socket 发出的帧，
+    // 期间的帧都走 socket，保证先后顺序
+    uint64_t m_fallbackSerial;
+    uint64_t m_ackedSerial;
+    uint64_t m_ringOverflows;
+
     InputDeviceType m_type;
+    std::weak_ptr<Machine> m_machine;
+    // 已按下尚未松开的键和按钮
+    std::set<uint16_t> m_pressed;
+
+    uint32_t m_repeatDelay;
+    uint32_t m_repeatInterval;
+
+    void startProcess();
+    void sendKeyRepeat();
+    void sendReset();
+    void releasePressed();
+    void trackPressed(int32_t type, int32_t code, int32_t value);
 };
 
 #endif // !WRAPPERS_INPUTEMITTERWRAPPER_H
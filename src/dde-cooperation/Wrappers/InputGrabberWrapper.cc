@@ -4,29 +4,37 @@
 
 #include "InputGrabberWrapper.h"
 
-#include "InputGrabbersManager.h"
+#include <linux/input.h>
 
 #include <QLocalServer>
 #include <QLocalSocket>
 #include <QProcess>
+#include <QSocketNotifier>
+#include <QTimer>
 
 #include "config.h"
 #include "Manager.h"
 #include "Machine/Machine.h"
+#include "InputRecorder.h"
 #include "utils/message_helper.h"
 #include "protocol/ipc_message.pb.h"
 
-InputGrabberWrapper::InputGrabberWrapper(InputGrabbersManager *manager, const QString &path)
-    : m_manager(manager)
+static const QString serverName = "DDECooperationInputGrabber";
+
+// input-grabber 异常退出后重新拉起的间隔
+static constexpr int restartInterval = 1000;
+static constexpr uint32_t ringCapacity = 4096;
+
+InputGrabberWrapper::InputGrabberWrapper(QObject *parent)
+    : QObject(parent)
     , m_server(new QLocalServer(this))
     , m_conn(nullptr)
     , m_process(new QProcess(this))
-    , m_path(path) {
-    auto name = QString("DDECooperationInputEmitter-%1")
-                    .arg(QString(m_path).replace("/", "_"));
-
-    QLocalServer::removeServer(name);
-    if (!m_server->listen(name)) {
+    , m_recorder(new InputRecorder(this))
+    , m_ringNotifier(nullptr)
+    , m_grabbing(false) {
+    QLocalServer::removeServer(serverName);
+    if (!m_server->listen(serverName)) {
         qWarning() << "InputGrabber listen addr:" << m_server->serverName()
                    << " errStr:" << m_server->errorString();
     }
@@ -43,11 +51,12 @@ InputGrabberWrapper::InputGrabberWrapper(InputGrabbersManager *manager, const QS
             this,
             &InputGrabberWrapper::onProcessClosed);
     m_process->setProcessChannelMode(QProcess::ForwardedChannels);
-    m_process->start(INPUT_GRABBER_PATH,
-                     QStringList{m_server->serverName(), path});
+    startProcess();
 }
 
 InputGrabberWrapper::~InputGrabberWrapper() {
+    disconnect(m_process, nullptr, this, nullptr);
+
     m_server->close();
     if (m_conn) {
         m_conn->close();
@@ -61,45 +70,130 @@ void InputGrabberWrapper::setMachine(const std::weak_ptr<Machine> &machine) {
 }
 
 void InputGrabberWrapper::start() {
-    qDebug() << "start" << m_path;
-    InputGrabberParent msg;
-    msg.mutable_start();
-    m_conn->write(MessageHelper::genMessage(msg));
+    m_grabbing = true;
+    sendStart();
 }
 
 void InputGrabberWrapper::stop() {
+    m_grabbing = false;
+    m_machine.reset();
     if (!m_conn) {
         return;
     }
 
-    qDebug() << "stop" << m_path;
+    qDebug() << "stop input-grabber";
     InputGrabberParent msg;
     msg.mutable_stop();
     m_conn->write(MessageHelper::genMessage(msg));
 }
 
+bool InputGrabberWrapper::replay(const QString &path, double speed) {
+    if (m_machine.expired()) {
+        return false;
+    }
+
+    return m_recorder->replay(path, speed, [this](uint8_t deviceType, const InputEventFrame &frame) {
+        auto machine = m_machine.lock();
+        if (!machine) {
+            return false;
+        }
+        machine->onInputGrabberFrame(deviceType, frame);
+        return true;
+    });
+}
+
+void InputGrabberWrapper::dispatchFrame(uint8_t deviceType, const InputEventFrame &frame) {
+    // 停止抓取后 input-grabber 可能还有已经发出的帧，不能再发给对端
+    if (!m_grabbing) {
+        return;
+    }
+
+    m_recorder->record(deviceType, frame);
+
+    auto machine = m_machine.lock();
+    if (machine) {
+        machine->onInputGrabberFrame(deviceType, frame);
+    }
+}
+
+void InputGrabberWrapper::startProcess() {
+    m_process->start(INPUT_GRABBER_PATH, QStringList{m_server->serverName()});
+}
+
+void InputGrabberWrapper::sendStart() {
+    if (!m_conn) {
+        return;
+    }
+
+    qDebug() << "start input-grabber";
+    InputGrabberParent msg;
+    msg.mutable_start();
+    m_conn->write(MessageHelper::genMessage(msg));
+}
+
 void InputGrabberWrapper::handleNewConnection() {
+    auto *conn = m_server->nextPendingConnection();
     if (m_conn) {
+        conn->close();
+        conn->deleteLater();
         return;
     }
 
-    qDebug() << "InputGrabber new connection" << m_path;
-    m_conn = m_server->nextPendingConnection();
-    m_server->close();
+    qDebug() << "InputGrabber new connection";
+    m_conn = conn;
+
+    // 必须先于其他消息发出
+    setupRing();
 
     connect(m_conn, &QLocalSocket::readyRead, this, &InputGrabberWrapper::onReceived);
     connect(m_conn, &QLocalSocket::disconnected, this, &InputGrabberWrapper::onDisconnected);
+
+    // 进程重启后恢复之前的抓取状态
+    if (m_grabbing) {
+        sendStart();
+    }
 }
 
-void InputGrabberWrapper::onProcessClosed([[maybe_unused]] int exitCode,
-                                          [[maybe_unused]] QProcess::ExitStatus exitStatus) {
-    qDebug() << "onProcessClosed" << m_path;
-    m_manager->removeInputGrabber(m_path);
+void InputGrabberWrapper::setupRing() {
+    m_ring = ShmRing<InputRingEvent>::create(ringCapacity);
+    if (!m_ring || !ShmRingHelper::sendFds(m_conn->socketDescriptor(),
+                                           {m_ring->memfd(), m_ring->eventfd()})) {
+        qWarning("failed to set up shared memory ring for input-grabber");
+        m_ring.reset();
+        return;
+    }
+
+    m_ringNotifier = new QSocketNotifier(m_ring->eventfd(), QSocketNotifier::Read, this);
+    connect(m_ringNotifier, &QSocketNotifier::activated, this, &InputGrabberWrapper::onRingReadable);
 }
 
-void InputGrabberWrapper::onReceived() {
-    qDebug() << "input-grabber onReceived";
+void InputGrabberWrapper::onRingReadable() {
+    m_ring->drain([this](const InputRingEvent &ev) {
+        auto &frame = m_frames[ev.device];
+        if (!frame) {
+            frame = std::make_unique<InputEventFrame>();
+        }
+
+        auto *inputEvent = frame->add_events();
+        inputEvent->set_type(ev.type);
+        inputEvent->set_code(ev.code);
+        inputEvent->set_value(ev.value);
+
+        if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+            frame->set_timestamp(ev.timestamp);
+            frame->set_sendtime(ev.sendTime);
+            dispatchFrame(ev.deviceType, *frame);
+            frame->Clear();
+        }
+    });
+}
+
+void InputGrabberWrapper::onProcessClosed(int exitCode, QProcess::ExitStatus exitStatus) {
+    qWarning() << "input-grabber exited:" << exitCode << exitStatus;
+    QTimer::singleShot(restartInterval, this, &InputGrabberWrapper::startProcess);
+}
 
+void InputGrabberWrapper::onReceived() {
     while (m_conn->size() >= header_size) {
         QByteArray buffer = m_conn->peek(header_size);
         auto header = MessageHelper::parseMessageHeader(buffer);
@@ -121,18 +215,34 @@ void InputGrabberWrapper::onReceived() {
                                                                                     buffer.size());
 
         switch (base.payload_case()) {
-        case InputGrabberChild::PayloadCase::kDeviceType: {
-            m_type = base.devicetype();
+        case InputGrabberChild::PayloadCase::kDeviceAdded: {
+            const auto &device = base.deviceadded();
+            qInfo() << "input device added:" << device.device() << device.name().c_str();
+            m_types[device.device()] = device.type();
             break;
         }
-        case InputGrabberChild::PayloadCase::kInputEvent: {
-            auto machine = m_machine.lock();
-            if (machine) {
-                auto inputEvent = base.inputevent();
-                machine->onInputGrabberEvent(m_type,
-                                             inputEvent.type(),
-                                             inputEvent.code(),
-                                             inputEvent.value());
+        case InputGrabberChild::PayloadCase::kDeviceRemoved: {
+            qInfo() << "input device removed:" << base.deviceremoved().device();
+            m_types.erase(base.deviceremoved().device());
+            break;
+        }
+        case InputGrabberChild::PayloadCase::kFrame: {
+            const auto &frame = base.frame();
+
+            // 队列满时 input-grabber 改走 socket，队列中的帧更早，需要先处理
+            if (m_ring) {
+                onRingReadable();
+            }
+
+            auto type = m_types.find(frame.device());
+            if (type != m_types.end()) {
+                dispatchFrame(type->second, frame);
+            }
+
+            if (frame.serial() != 0) {
+                InputGrabberParent ack;
+                ack.mutable_frameack()->set_serial(frame.serial());
+                m_conn->write(MessageHelper::genMessage(ack));
             }
             break;
         }
@@ -144,5 +254,16 @@ void InputGrabberWrapper::onReceived() {
 }
 
 void InputGrabberWrapper::onDisconnected() {
+    m_conn->deleteLater();
+    m_conn = nullptr;
+    m_types.clear();
+
+    if (m_ringNotifier) {
+        m_ringNotifier->deleteLater();
+        m_ringNotifier = nullptr;
+    }
+    m_ring.reset();
+    m_frames.clear();
+
     m_process->kill();
 }
@@ -5,44 +5,67 @@
 #ifndef WRAPPERS_INPUTGRABBERWRAPPER_H
 #define WRAPPERS_INPUTGRABBERWRAPPER_H
 
-#include <filesystem>
+#include <memory>
+#include <unordered_map>
 
 #include <QObject>
 #include <QProcess>
 
+#include "common.h"
+#include "utils/shm_ring.h"
+
 class QLocalServer;
 class QLocalSocket;
 class QProcess;
+class QSocketNotifier;
+class InputEventFrame;
 
-class InputGrabbersManager;
 class Machine;
+class InputRecorder;
 
+// 管理唯一的 input-grabber 进程，所有输入设备的事件都通过同一个连接上报
 class InputGrabberWrapper : public QObject {
     Q_OBJECT
 
 public:
-    explicit InputGrabberWrapper(InputGrabbersManager *manager, const QString &path);
+    explicit InputGrabberWrapper(QObject *parent = nullptr);
     ~InputGrabberWrapper();
     void setMachine(const std::weak_ptr<Machine> &machine);
     void start();
     void stop();
+    bool grabbing() const { return m_grabbing; }
+
+    InputRecorder *recorder() const { return m_recorder; }
+    // 把录制的输入帧注入到当前共享设备的 Machine
+    bool replay(const QString &path, double speed);
 
 private slots:
     void onProcessClosed(int exitCode, QProcess::ExitStatus exitStatus);
     void handleNewConnection();
     void onReceived();
     void onDisconnected();
+    void onRingReadable();
 
 private:
-    InputGrabbersManager *m_manager;
     QLocalServer *m_server;
     QLocalSocket *m_conn;
     QProcess *m_process;
+    InputRecorder *m_recorder;
 
-    const QString m_path;
+    std::unique_ptr<ShmRing<InputRingEvent>> m_ring;
+    QSocketNotifier *m_ringNotifier;
+    // 设备序号 -> 尚未收到 SYN_REPORT 的事件
+    std::unordered_map<uint32_t, std::unique_ptr<InputEventFrame>> m_frames;
 
-    uint8_t m_type;
+    bool m_grabbing;
+    // 设备序号 -> 设备类型
+    std::unordered_map<uint32_t, uint8_t> m_types;
     std::weak_ptr<Machine> m_machine;
+
+    void startProcess();
+    void sendStart();
+    void setupRing();
+    void dispatchFrame(uint8_t deviceType, const InputEventFrame &frame);
 };
 
 #endif // !WRAPPERS_INPUTGRABBERWRAPPER_H
@@ -6,13 +6,10 @@
 #define DDE_COOPERATION_INPUT_GRABBERS_MANAGER_H
 
 #include <QObject>
-#include <QMap>
 
 #include "InputGrabberWrapper.h"
 
-class QTimer;
 class Machine;
-class QFileSystemWatcher;
 
 class InputGrabbersManager : public QObject {
     Q_OBJECT
@@ -23,19 +20,15 @@ public:
 
     void stopGrab();
     void startGrabEvents(const std::weak_ptr<Machine> &machine);
-    void removeInputGrabber(const QString &path);
-    void addInputGrabber(const QString &path);
+    bool grabbing() const;
 
-private:
-    void initGrabbers();
-    void dirChanged();
+    bool startRecording(const QString &path);
+    void stopRecording();
+    bool replay(const QString &path, double speed);
 
 private:
-    bool m_isGrabbing;
-    QTimer *m_timer;
-    std::weak_ptr<Machine> m_curMachine;
-    QStringList m_files;
-    QMap<QString, InputGrabberWrapper *> m_inputGrabbers;
+    // 设备的热插拔由 input-grabber 进程自己处理
+    InputGrabberWrapper *m_inputGrabber;
 };
 
-#endif // DDE_COOPERATION_INPUT_GRABBERS_MANAGER_H
\ No newline at end of file
+#endif // DDE_COOPERATION_INPUT_GRABBERS_MANAGER_H
@@ -0,0 +1,211 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "InputRecorder.h"
+
+#include <cmath>
+
+#include <fmt/core.h>
+
+#include <QDebug>
+#include <QFile>
+#include <QTimer>
+
+#include "utils/latency.h"
+#include "utils/message_helper.h"
+#include "protocol/ipc_message.pb.h"
+
+// 录制时每攒够这么多帧写一次文件
+static constexpr int chunkFrames = 256;
+// 不限速回放时每轮注入的帧数，之后让出事件循环处理网络收发
+static constexpr size_t replayBatch = 256;
+
+InputRecorder::InputRecorder(QObject *parent)
+    : QObject(parent)
+    , m_file(nullptr)
+    , m_lastTimestamp(0)
+    , m_recordedFrames(0)
+    , m_replayTimer(new QTimer(this))
+    , m_next(0)
+    , m_speed(1)
+    , m_replayStart(0) {
+    m_replayTimer->setSingleShot(true);
+    m_replayTimer->setTimerType(Qt::PreciseTimer);
+    connect(m_replayTimer, &QTimer::timeout, this, &InputRecorder::replayNext);
+}
+
+InputRecorder::~InputRecorder() {
+    stopRecording();
+}
+
+bool InputRecorder::startRecording(const QString &path) {
+    stopRecording();
+
+    m_file = new QFile(path, this);
+    if (!m_file->open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "failed to open input recording:" << path << m_file->errorString();
+        m_file->deleteLater();
+        m_file = nullptr;
+        return false;
+    }
+
+    m_chunk = std::make_unique<InputRecordChunk>();
+    m_lastTimestamp = 0;
+    m_recordedFrames = 0;
+    qInfo() << "start recording input to" << path;
+    return true;
+}
+
+void InputRecorder::stopRecording() {
+    if (!m_file) {
+        return;
+    }
+
+    flushChunk();
+    m_file->close();
+    m_file->deleteLater();
+    m_file = nullptr;
+    m_chunk.reset();
+
+    qInfo() << fmt::format("input recording stopped, {} frames", m_recordedFrames).data();
+}
+
+void InputRecorder::record(uint8_t deviceType, const InputEventFrame &frame) {
+    if (!m_file) {
+        return;
+    }
+
+    auto *record = m_chunk->add_records();
+    record->set_devicetype(deviceType);
+    // 第一帧的差值为 0
+    if (m_lastTimestamp != 0 && frame.timestamp() != 0) {
+        record->set_delta(frame.timestamp() - m_lastTimestamp);
+    }
+    if (frame.timestamp() != 0) {
+        m_lastTimestamp = frame.timestamp();
+    }
+    *record->mutable_events() = frame.events();
+    m_recordedFrames++;
+
+    if (m_chunk->records_size() >= chunkFrames) {
+        flushChunk();
+    }
+}
+
+void InputRecorder::flushChunk() {
+    if (m_chunk->records_size() == 0) {
+        return;
+    }
+
+    if (m_file->write(MessageHelper::genMessage(*m_chunk)) == -1) {
+        qWarning() << "failed to write input recording:" << m_file->errorString();
+    }
+    m_file->flush();
+    m_chunk->Clear();
+}
+
+bool InputRecorder::load(const QString &path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "failed to open input recording:" << path << file.errorString();
+        return false;
+    }
+
+    QByteArray data = file.readAll();
+    m_records.clear();
+    m_offsets.clear();
+
+    int64_t offset = 0;
+    qint64 pos = 0;
+    while (data.size() - pos >= header_size) {
+        auto &header = MessageHelper::parseMessageHeader(data.constData() + pos);
+        if (!header.legal() || header.size() > static_cast<uint64_t>(data.size() - pos - header_size)) {
+            qWarning() << "corrupted input recording at" << pos;
+            return false;
+        }
+
+        auto chunk = MessageHelper::parseMessageBody<InputRecordChunk>(data.constData() + pos +
+                                                                           header_size,
+                                                                       header.size());
+        for (auto &record : *chunk.mutable_records()) {
+            offset += std::max<int64_t>(record.delta(), 0);
+            m_offsets.push_back(offset);
+            m_records.emplace_back(std::move(record));
+        }
+
+        pos += header_size + header.size();
+    }
+
+    return !m_records.empty();
+}
+
+bool InputRecorder::replay(const QString &path, double speed, const FrameHandler &handler) {
+    if (m_handler || speed < 0 || !load(path)) {
+        return false;
+    }
+
+    m_handler = handler;
+    m_speed = speed;
+    m_next = 0;
+    m_replayStart = Latency::now();
+
+    qInfo() << fmt::format("replaying {} input frames at speed {}", m_records.size(), speed).data();
+    replayNext();
+    return true;
+}
+
+void InputRecorder::stopReplay() {
+    if (!m_handler) {
+        return;
+    }
+
+    m_replayTimer->stop();
+    finishReplay();
+}
+
+void InputRecorder::replayNext() {
+    InputEventFrame frame;
+    size_t batch = 0;
+
+    while (m_next < m_records.size()) {
+        int64_t now = Latency::now();
+
+        if (m_speed > 0) {
+            int64_t due = m_replayStart + static_cast<int64_t>(m_offsets[m_next] / m_speed);
+            if (due > now) {
+                m_replayTimer->start(static_cast<int>(std::ceil((due - now) / 1e6)));
+                return;
+            }
+        } else if (batch++ >= replayBatch) {
+            m_replayTimer->start(0);
+            return;
+        }
+
+        // 注入的时刻作为内核时间戳，各环节的延迟统计仍然有效
+        const auto &record = m_records[m_next++];
+        frame.set_timestamp(now);
+        frame.set_sendtime(now);
+        *frame.mutable_events() = record.events();
+        if (!m_handler(record.devicetype(), frame)) {
+            break;
+        }
+    }
+
+    finishReplay();
+}
+
+void InputRecorder::finishReplay() {
+    double elapsed = (Latency::now() - m_replayStart) / 1e9;
+    qInfo() << fmt::format("input replay finished: {}/{} frames in {:.3f}s, {:.0f} frames/s",
+                           m_next,
+                           m_records.size(),
+                           elapsed,
+                           elapsed > 0 ? m_next / elapsed : 0)
+                   .data();
+
+    m_handler = nullptr;
+    m_records.clear();
+    m_offsets.clear();
+    m_next = 0;
+}
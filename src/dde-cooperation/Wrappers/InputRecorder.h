@@ -0,0 +1,66 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef WRAPPERS_INPUTRECORDER_H
+#define WRAPPERS_INPUTRECORDER_H
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <QObject>
+
+class QFile;
+class QTimer;
+class InputEventFrame;
+class InputRecord;
+class InputRecordChunk;
+
+// 录制 input-grabber 上报的输入帧，之后按原始节奏或加速重放到 daemon 的输入路径，
+// 不需要两台机器和真人操作就能复现输入转发的性能问题
+class InputRecorder : public QObject {
+    Q_OBJECT
+
+public:
+    // 返回 false 时结束回放，不能在 handler 中调用 stopReplay
+    using FrameHandler = std::function<bool(uint8_t deviceType, const InputEventFrame &frame)>;
+
+    explicit InputRecorder(QObject *parent = nullptr);
+    ~InputRecorder();
+
+    bool startRecording(const QString &path);
+    void stopRecording();
+    bool recording() const { return !!m_file; }
+    void record(uint8_t deviceType, const InputEventFrame &frame);
+
+    // speed 为回放倍速，为 0 时不等待，尽快注入所有帧
+    bool replay(const QString &path, double speed, const FrameHandler &handler);
+    void stopReplay();
+    bool replaying() const { return !!m_handler; }
+
+private slots:
+    void replayNext();
+
+private:
+    // 录制
+    QFile *m_file;
+    std::unique_ptr<InputRecordChunk> m_chunk;
+    int64_t m_lastTimestamp;
+    uint64_t m_recordedFrames;
+
+    // 回放
+    QTimer *m_replayTimer;
+    std::vector<InputRecord> m_records;
+    std::vector<int64_t> m_offsets; // 每帧相对第一帧的时间，纳秒
+    size_t m_next;
+    double m_speed;
+    int64_t m_replayStart;
+    FrameHandler m_handler;
+
+    void flushChunk();
+    bool load(const QString &path);
+    void finishReplay();
+};
+
+#endif // !WRAPPERS_INPUTRECORDER_H
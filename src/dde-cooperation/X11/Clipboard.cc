@@ -4,6 +4,7 @@
 
 #include "Clipboard.h"
 
+#include <algorithm>
 #include <stdexcept>
 
 #include <climits>
@@ -16,6 +17,7 @@
 #include <fmt/ranges.h>
 
 #include <QDebug>
+#include <QTimer>
 
 using namespace X11;
 
@@ -32,14 +34,31 @@ const std::string Clipboard::ATOMS_NAME[] = {
     "STRING",
     "UTF8_STRING",
     "TEXT",
+    "INCR",
 };
 
+// INCR 每段的上限，还会受服务器请求长度的限制
+static constexpr size_t maxIncrChunkSize = 256 * 1024;
+// INCR 两段之间的最长等待时间，毫秒
+static constexpr int incrTimeout = 5000;
+static constexpr int incrCheckInterval = 1000;
+
 Clipboard::Clipboard(ClipboardObserver *observer, QObject *parent)
     : X11(parent)
     , ClipboardBase(observer)
-    , m_printingProperty(false) {
+    , m_printingProperty(false)
+    , m_generation(0)
+    , m_incrTimer(new QTimer(this)) {
+    // 请求长度以 4 字节为单位，留出请求头的空间
+    m_incrChunkSize = std::min<size_t>(maxIncrChunkSize,
+                                       xcb_get_maximum_request_length(m_conn) * 4 - 32);
+
+    m_incrTimer->setInterval(incrCheckInterval);
+    connect(m_incrTimer, &QTimer::timeout, this, &Clipboard::expireIncrTransfers);
+
     m_dummyWindow = xcb_generate_id(m_conn);
-    uint32_t valueList[] = {XCB_BACK_PIXMAP_NONE};
+    // INCR 读取时需要知道属性的变化
+    uint32_t valueList[] = {XCB_BACK_PIXMAP_NONE, XCB_EVENT_MASK_PROPERTY_CHANGE};
     auto cookie = xcb_create_window_checked(m_conn,
                                             m_screen->root_depth,
                                             m_dummyWindow,
@@ -51,7 +70,7 @@ Clipboard::Clipboard(ClipboardObserver *observer, QObject *parent)
                                             0,
                                             XCB_WINDOW_CLASS_INPUT_OUTPUT,
                                             m_screen->root_visual,
-                                            XCB_CW_BACK_PIXMAP,
+                                            XCB_CW_BACK_PIXMAP | XCB_CW_EVENT_MASK,
                                             valueList);
     auto *err = xcb_request_check(m_conn, cookie);
     if (err != nullptr) {
@@ -60,9 +79,18 @@ Clipboard::Clipboard(ClipboardObserver *observer, QObject *parent)
 
     qInfo() << fmt::format("clipboard window id: {}", m_dummyWindow).data();
 
+    initAtoms();
     m_selection = getAtom(ATOM_LIST::CLIPBOARD);
 
     initXfixesExtension();
+
+    subscribe(XCB_SELECTION_REQUEST);
+    subscribe(XCB_SELECTION_NOTIFY);
+    subscribe(XCB_PROPERTY_NOTIFY);
+    subscribe(XCB_DESTROY_NOTIFY);
+    if (m_xfixes->present) {
+        subscribe(m_xfixes->first_event + XCB_XFIXES_SELECTION_NOTIFY);
+    }
 }
 
 Clipboard::~Clipboard() {
@@ -85,11 +113,79 @@ xcb_atom_t Clipboard::getAtom(const std::string &name, bool onlyIfExists) {
     }
 
     auto reply = XCB_REPLY(xcb_intern_atom, m_conn, onlyIfExists, name.length(), name.c_str());
+    if (!reply) {
+        qWarning() << fmt::format("failed to intern atom: {}", name).data();
+        return XCB_ATOM_NONE;
+    }
+
     qWarning() << fmt::format("ATOM: {}, {}", name, reply->atom).data();
-    m_atoms.emplace(name, reply->atom);
+    cacheAtom(name, reply->atom);
     return reply->atom;
 }
 
+void Clipboard::initAtoms() {
+    // 常用的 atom 一次性发出请求，只等待一个来回
+    constexpr size_t count = sizeof(ATOMS_NAME) / sizeof(ATOMS_NAME[0]);
+    xcb_intern_atom_cookie_t cookies[count];
+    for (size_t i = 0; i < count; i++) {
+        cookies[i] = xcb_intern_atom(m_conn, false, ATOMS_NAME[i].length(), ATOMS_NAME[i].c_str());
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        auto reply = std::unique_ptr<xcb_intern_atom_reply_t>(
+            xcb_intern_atom_reply(m_conn, cookies[i], nullptr));
+        if (!reply) {
+            qWarning() << fmt::format("failed to intern atom: {}", ATOMS_NAME[i]).data();
+            continue;
+        }
+
+        cacheAtom(ATOMS_NAME[i], reply->atom);
+    }
+}
+
+void Clipboard::internAtoms(const std::vector<std::string> &names,
+                            const std::function<void(std::vector<xcb_atom_t> atoms)> &callback) {
+    auto atoms = std::make_shared<std::vector<xcb_atom_t>>(names.size(), XCB_ATOM_NONE);
+    auto remaining = std::make_shared<size_t>(0);
+
+    for (size_t i = 0; i < names.size(); i++) {
+        auto it = m_atoms.find(names[i]);
+        if (it != m_atoms.end()) {
+            (*atoms)[i] = it->second;
+            continue;
+        }
+
+        (*remaining)++;
+        asyncReply<xcb_intern_atom_reply_t>(
+            xcb_intern_atom(m_conn, false, names[i].length(), names[i].c_str()),
+            [this, atoms, remaining, callback, i, name = names[i]](auto reply) {
+                if (reply) {
+                    cacheAtom(name, reply->atom);
+                    (*atoms)[i] = reply->atom;
+                } else {
+                    qWarning() << fmt::format("failed to intern atom: {}", name).data();
+                }
+
+                if (--*remaining == 0) {
+                    callback(std::move(*atoms));
+                }
+            });
+    }
+
+    if (*remaining == 0) {
+        callback(std::move(*atoms));
+    }
+}
+
+void Clipboard::cacheAtom(const std::string &name, xcb_atom_t atom) {
+    if (atom == XCB_ATOM_NONE) {
+        return;
+    }
+
+    m_atoms[name] = atom;
+    m_atomNames[atom] = name;
+}
+
 void Clipboard::initXfixesExtension() {
     m_xfixes = xcb_get_extension_data(m_conn, &xcb_xfixes_id);
     if (!m_xfixes->present) {
@@ -123,11 +219,11 @@ void Clipboard::initXfixesExtension() {
     }
 }
 
-void Clipboard::handleEvent(std::shared_ptr<xcb_generic_event_t> event) {
+void Clipboard::handleEvent(xcb_generic_event_t *event) {
     auto response_type = event->response_type & ~0x80;
     qDebug() << fmt::format("event: {}", response_type).data();
     if (response_type == m_xfixes->first_event + XCB_XFIXES_SELECTION_NOTIFY) {
-        auto ev = reinterpret_cast<xcb_xfixes_selection_notify_event_t *>(event.get());
+        auto ev = reinterpret_cast<xcb_xfixes_selection_notify_event_t *>(event);
         if (ev->owner != m_dummyWindow) {
             reset();
             printPropertyTargets();
@@ -135,95 +231,265 @@ void Clipboard::handleEvent(std::shared_ptr<xcb_generic_event_t> event) {
     } else {
         switch (response_type) {
         case XCB_SELECTION_REQUEST: {
-            auto ev = std::reinterpret_pointer_cast<xcb_selection_request_event_t>(event);
-            handleXcbSelectionRequest(ev);
+            auto ev = reinterpret_cast<xcb_selection_request_event_t *>(event);
+            handleXcbSelectionRequest(*ev);
             break;
         }
         case XCB_SELECTION_NOTIFY: {
-            auto ev = std::reinterpret_pointer_cast<xcb_selection_notify_event_t>(event);
+            auto ev = reinterpret_cast<xcb_selection_notify_event_t *>(event);
             // if (ev->requestor != m_dummyWindow) {
-            handleXcbSelectionNotify(ev);
+            handleXcbSelectionNotify(*ev);
             // }
             break;
         }
+        case XCB_PROPERTY_NOTIFY: {
+            auto ev = reinterpret_cast<xcb_property_notify_event_t *>(event);
+            handleXcbPropertyNotify(*ev);
+            break;
+        }
+        case XCB_DESTROY_NOTIFY: {
+            // 请求方在 INCR 传输结束前退出
+            auto ev = reinterpret_cast<xcb_destroy_notify_event_t *>(event);
+            stopIncrWrites(ev->window);
+            break;
+        }
         }
     }
 }
 
 void Clipboard::reset() {
+    m_generation++;
     m_cachedTargets.clear();
     m_cachedProperties.clear();
     m_sectionPropertyNotifyCb.clear();
 }
 
-std::vector<char> Clipboard::readProperty(xcb_window_t requestor, xcb_atom_t property) {
-    // Don't read anything, just get the size of the property data
-    auto reply = XCB_REPLY(xcb_get_property,
-                           m_conn,
-                           false,
-                           requestor,
-                           property,
-                           XCB_GET_PROPERTY_TYPE_ANY,
-                           0,
-                           0);
-    if (!reply || reply->type == XCB_NONE) {
-        qWarning("no reply");
-        return {};
-    }
-
-    decltype(reply->bytes_after) buffOffset = 0, offset = 0;
-    auto bytesLeft = reply->bytes_after;
-    qInfo() << fmt::format("target {} size: {}", getTargetName(property), bytesLeft).data();
-    std::vector<char> buff(bytesLeft);
-
-    while (bytesLeft > 0) {
-        reply = XCB_REPLY(xcb_get_property,
-                          m_conn,
-                          false,
-                          m_dummyWindow,
-                          property,
-                          XCB_GET_PROPERTY_TYPE_ANY,
-                          offset,
-                          UINT_MAX / 4);
-        if (!reply || reply->type == XCB_NONE) {
-            qWarning("no reply");
-            break;
-        }
+void Clipboard::readProperty(xcb_window_t requestor,
+                             xcb_atom_t property,
+                             const PropertyCallback &callback) {
+    readPropertyFrom(requestor, property, std::make_shared<std::vector<char>>(), callback);
+}
+
+void Clipboard::readPropertyFrom(xcb_window_t requestor,
+                                 xcb_atom_t property,
+                                 std::shared_ptr<std::vector<char>> buff,
+                                 const PropertyCallback &callback) {
+    // 偏移量以 4 字节为单位，长度不限，一般一次就能读完
+    asyncReply<xcb_get_property_reply_t>(
+        xcb_get_property(m_conn,
+                         false,
+                         requestor,
+                         property,
+                         XCB_GET_PROPERTY_TYPE_ANY,
+                         buff->size() / 4,
+                         UINT_MAX / 4),
+        [this, requestor, property, buff, callback](auto reply) {
+            if (!reply || reply->type == XCB_NONE) {
+                qWarning("no reply");
+                callback(std::move(*buff));
+                return;
+            }
+
+            // 内容较大时所有者分段发送，删除 INCR 属性后开始传输，每段到达时收到 PropertyNotify
+            if (buff->empty() && reply->type == getAtom(ATOM_LIST::INCR)) {
+                qInfo() << fmt::format("target {} is transferred incrementally",
+                                       getTargetName(property))
+                               .data();
+                IncrRead &read = m_incrReads[property];
+                read = {buff, callback, m_generation, {}};
+                read.lastChunk.start();
+                startIncrTimer();
+                xcb_delete_property(m_conn, requestor, property);
+                xcb_flush(m_conn);
+                return;
+            }
+
+            char *data = static_cast<char *>(xcb_get_property_value(reply.get()));
+            int length = xcb_get_property_value_length(reply.get());
+            buff->insert(buff->end(), data, data + length);
+
+            if (reply->bytes_after > 0 && length > 0) {
+                readPropertyFrom(requestor, property, buff, callback);
+                return;
+            }
+
+            qInfo() << fmt::format("target {} size: {}", getTargetName(property), buff->size())
+                           .data();
+            callback(std::move(*buff));
+        });
+}
+
+void Clipboard::readIncrChunk(xcb_atom_t property) {
+    // 读取的同时删除属性，通知所有者写入下一段
+    asyncReply<xcb_get_property_reply_t>(
+        xcb_get_property(m_conn,
+                         true,
+                         m_dummyWindow,
+                         property,
+                         XCB_GET_PROPERTY_TYPE_ANY,
+                         0,
+                         UINT_MAX / 4),
+        [this, property](auto reply) {
+            auto it = m_incrReads.find(property);
+            if (it == m_incrReads.end()) {
+                return;
+            }
+
+            // 剪切板内容已经变化，不再接收后续的段
+            if (it->second.generation != m_generation) {
+                qInfo() << fmt::format("drop outdated incremental transfer of {}",
+                                       getTargetName(property))
+                               .data();
+                it->second.buff->clear();
+                finishIncrRead(it);
+                return;
+            }
+
+            int length = reply ? xcb_get_property_value_length(reply.get()) : 0;
+            if (length > 0) {
+                char *data = static_cast<char *>(xcb_get_property_value(reply.get()));
+                it->second.buff->insert(it->second.buff->end(), data, data + length);
+                it->second.lastChunk.start();
+                return;
+            }
+
+            // 长度为 0 的一段表示传输结束
+            finishIncrRead(it);
+        });
+}
+
+void Clipboard::finishIncrRead(std::unordered_map<xcb_atom_t, IncrRead>::iterator it) {
+    xcb_atom_t property = it->first;
+    IncrRead read = std::move(it->second);
+    m_incrReads.erase(it);
+    qInfo() << fmt::format("target {} size: {}", getTargetName(property), read.buff->size()).data();
+    read.callback(std::move(*read.buff));
+}
+
+void Clipboard::startIncrWrite(xcb_window_t requestor,
+                               xcb_atom_t property,
+                               xcb_atom_t target,
+                               const std::vector<char> &data) {
+    qInfo() << fmt::format("send target {} incrementally, size: {}", getTargetName(target), data.size())
+                   .data();
+
+    // 请求方删除 INCR 属性后写入第一段，之后每次删除写入下一段
+    uint32_t mask = XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    xcb_change_window_attributes(m_conn, requestor, XCB_CW_EVENT_MASK, &mask);
+
+    uint32_t size = data.size();
+    xcb_change_property(m_conn,
+                        XCB_PROP_MODE_REPLACE,
+                        requestor,
+                        property,
+                        getAtom(ATOM_LIST::INCR),
+                        32,
+                        1,
+                        &size);
+
+    IncrWrite &write = m_incrWrites[{requestor, property}];
+    write = {target, data, 0, {}};
+    write.lastChunk.start();
+    startIncrTimer();
+}
+
+void Clipboard::writeIncrChunk(
+    std::map<std::pair<xcb_window_t, xcb_atom_t>, IncrWrite>::iterator it) {
+    auto [requestor, property] = it->first;
+    IncrWrite &write = it->second;
+
+    // 数据写完后再写入一段空的内容表示结束
+    size_t length = std::min(m_incrChunkSize, write.data.size() - write.offset);
+    xcb_change_property(m_conn,
+                        XCB_PROP_MODE_REPLACE,
+                        requestor,
+                        property,
+                        write.target,
+                        8,
+                        length,
+                        write.data.data() + write.offset);
+    write.offset += length;
+    write.lastChunk.start();
+
+    if (length == 0) {
+        eraseIncrWrite(it);
+    }
+
+    xcb_flush(m_conn);
+}
 
-        bytesLeft = reply->bytes_after;
-        char *data = static_cast<char *>(xcb_get_property_value(reply.get()));
-        int length = xcb_get_property_value_length(reply.get());
+void Clipboard::eraseIncrWrite(std::map<std::pair<xcb_window_t, xcb_atom_t>, IncrWrite>::iterator it) {
+    xcb_window_t requestor = it->first.first;
+    m_incrWrites.erase(it);
+    if (std::none_of(m_incrWrites.begin(), m_incrWrites.end(), [requestor](const auto &v) {
+            return v.first.first == requestor;
+        })) {
+        uint32_t mask = XCB_EVENT_MASK_NO_EVENT;
+        xcb_change_window_attributes(m_conn, requestor, XCB_CW_EVENT_MASK, &mask);
+    }
+}
 
-        if ((buffOffset + length) > buff.size()) {
-            qWarning("buffer overflow");
-            length = buff.size() - buffOffset;
-            // escape loop
-            bytesLeft = 0;
+void Clipboard::stopIncrWrites(xcb_window_t requestor) {
+    for (auto it = m_incrWrites.begin(); it != m_incrWrites.end();) {
+        if (it->first.first == requestor) {
+            qWarning() << fmt::format("requestor {} is destroyed during INCR transfer", requestor)
+                              .data();
+            it = m_incrWrites.erase(it);
+        } else {
+            ++it;
         }
+    }
+}
+
+void Clipboard::startIncrTimer() {
+    if (!m_incrTimer->isActive()) {
+        m_incrTimer->start();
+    }
+}
 
-        memcpy(buff.data() + buffOffset, data, length);
-        buffOffset += length;
+void Clipboard::expireIncrTransfers() {
+    // 读取超时时交出已经收到的内容，回调中可能发起新的读取，先取出超时的属性
+    std::vector<xcb_atom_t> expiredReads;
+    for (const auto &[property, read] : m_incrReads) {
+        if (read.lastChunk.hasExpired(incrTimeout)) {
+            expiredReads.push_back(property);
+        }
+    }
+    for (auto property : expiredReads) {
+        auto it = m_incrReads.find(property);
+        if (it != m_incrReads.end()) {
+            qWarning() << fmt::format("incremental transfer of {} timed out", getTargetName(property))
+                              .data();
+            finishIncrRead(it);
+        }
+    }
 
-        if (bytesLeft) {
-            offset += length / 4;
+    // 请求方一直不删除属性，不再等待
+    for (auto it = m_incrWrites.begin(); it != m_incrWrites.end();) {
+        auto cur = it++;
+        if (cur->second.lastChunk.hasExpired(incrTimeout)) {
+            qWarning() << fmt::format("requestor {} stopped reading INCR transfer of {}",
+                                      cur->first.first,
+                                      getTargetName(cur->second.target))
+                              .data();
+            eraseIncrWrite(cur);
         }
     }
+    xcb_flush(m_conn);
 
-    return buff;
+    if (m_incrReads.empty() && m_incrWrites.empty()) {
+        m_incrTimer->stop();
+    }
 }
 
 void Clipboard::printPropertyTargets() {
-    auto cookie = xcb_convert_selection_checked(m_conn,
-                                                m_dummyWindow,
-                                                m_selection,
-                                                getAtom(ATOM_LIST::TARGETS),
-                                                getAtom(ATOM_LIST::CPRT_TARGETS),
-                                                XCB_CURRENT_TIME);
-    auto *err = xcb_request_check(m_conn, cookie);
-    if (err != nullptr) {
-        qWarning() << fmt::format("xcb_convert_selection_checked: {}", err->error_code).data();
-        return;
-    }
+    xcb_convert_selection(m_conn,
+                          m_dummyWindow,
+                          m_selection,
+                          getAtom(ATOM_LIST::TARGETS),
+                          getAtom(ATOM_LIST::CPRT_TARGETS),
+                          XCB_CURRENT_TIME);
+    xcb_flush(m_conn);
 }
 
 /**
@@ -246,99 +512,85 @@ void Clipboard::printNextPenddingProperty() {
     xcb_atom_t atom = m_penddingPrint.front();
     m_penddingPrint.pop_front();
 
-    auto cookie = xcb_convert_selection_checked(m_conn,
-                                                m_dummyWindow,
-                                                m_selection,
-                                                atom,
-                                                getAtom(ATOM_LIST::CPRT_PROPERTY),
-                                                XCB_CURRENT_TIME);
-    auto *err = xcb_request_check(m_conn, cookie);
-    if (err != nullptr) {
-        qWarning() << fmt::format("xcb_convert_selection_checked: {}", err->error_code).data();
-        return;
-    }
+    xcb_convert_selection(m_conn,
+                          m_dummyWindow,
+                          m_selection,
+                          atom,
+                          getAtom(ATOM_LIST::CPRT_PROPERTY),
+                          XCB_CURRENT_TIME);
+    xcb_flush(m_conn);
 }
 
 void Clipboard::printProperties(const std::vector<xcb_atom_t> &pairs) {
-    {
-        auto cookie = xcb_change_property_checked(m_conn,
-                                                  XCB_PROP_MODE_REPLACE,
-                                                  m_dummyWindow,
-                                                  getAtom(ATOM_LIST::CPRT_PROPERTIES),
-                                                  getAtom(ATOM_LIST::ATOM_PAIR),
-                                                  8 * sizeof(xcb_atom_t),
-                                                  pairs.size(),
-                                                  pairs.data());
-        auto *err = xcb_request_check(m_conn, cookie);
-        if (err != nullptr) {
-            qWarning() << fmt::format("xcb_change_property_checked: {}", err->error_code).data();
-            return;
-        }
-    }
-    {
-        auto cookie = xcb_convert_selection_checked(m_conn,
-                                                    m_dummyWindow,
-                                                    m_selection,
-                                                    getAtom(ATOM_LIST::MULTIPLE),
-                                                    getAtom(ATOM_LIST::CPRT_PROPERTIES),
-                                                    XCB_CURRENT_TIME);
-        auto *err = xcb_request_check(m_conn, cookie);
-        if (err != nullptr) {
-            qWarning() << fmt::format("xcb_convert_selection_checked: {}", err->error_code).data();
-            return;
-        }
-    }
-}
-
-std::vector<xcb_atom_t> Clipboard::getTargets() {
-    std::vector<xcb_atom_t> targets;
-
-    auto buff = readProperty(m_dummyWindow, getAtom(ATOM_LIST::CPRT_TARGETS));
-    size_t atomsCnt = buff.size() / 4;
-    xcb_atom_t *atoms = reinterpret_cast<xcb_atom_t *>(buff.data());
-
-    for (size_t i = 0; i < atomsCnt; i++) {
-        targets.emplace_back(atoms[i]);
-    }
-
-    return targets;
+    xcb_change_property(m_conn,
+                        XCB_PROP_MODE_REPLACE,
+                        m_dummyWindow,
+                        getAtom(ATOM_LIST::CPRT_PROPERTIES),
+                        getAtom(ATOM_LIST::ATOM_PAIR),
+                        8 * sizeof(xcb_atom_t),
+                        pairs.size(),
+                        pairs.data());
+    xcb_convert_selection(m_conn,
+                          m_dummyWindow,
+                          m_selection,
+                          getAtom(ATOM_LIST::MULTIPLE),
+                          getAtom(ATOM_LIST::CPRT_PROPERTIES),
+                          XCB_CURRENT_TIME);
+    xcb_flush(m_conn);
 }
 
-std::vector<std::string> Clipboard::getTargetsName(const std::vector<xcb_atom_t> &atoms) {
-    std::vector<std::string> targets;
-
-    xcb_get_atom_name_cookie_t cookies[atoms.size()];
-    for (size_t i = 0; i < atoms.size(); i++) {
-        cookies[i] = xcb_get_atom_name_unchecked(m_conn, atoms[i]);
-    }
+void Clipboard::getTargetsName(const std::vector<xcb_atom_t> &atoms,
+                               const std::function<void(std::vector<std::string> names)> &callback) {
+    // 只查询没有缓存的名称，请求一起发出
+    auto collect = [this, atoms, callback]() {
+        std::vector<std::string> targets;
+        for (auto atom : atoms) {
+            auto it = m_atomNames.find(atom);
+            if (it != m_atomNames.end()) {
+                targets.emplace_back(it->second);
+            }
+        }
+        callback(std::move(targets));
+    };
 
-    for (size_t i = 0; i < atoms.size(); i++) {
-        auto reply = std::unique_ptr<xcb_get_atom_name_reply_t>(
-            xcb_get_atom_name_reply(m_conn, cookies[i], nullptr));
-        if (!reply) {
-            qWarning("no reply");
+    auto remaining = std::make_shared<size_t>(0);
+    for (auto atom : atoms) {
+        if (m_atomNames.find(atom) != m_atomNames.end()) {
             continue;
         }
 
-        targets.emplace_back(
-            std::string{xcb_get_atom_name_name(reply.get()),
-                        static_cast<size_t>(xcb_get_atom_name_name_length(reply.get()))});
+        (*remaining)++;
+        asyncReply<xcb_get_atom_name_reply_t>(
+            xcb_get_atom_name(m_conn, atom),
+            [this, atom, remaining, collect](auto reply) {
+                if (reply) {
+                    cacheAtom(std::string{xcb_get_atom_name_name(reply.get()),
+                                          static_cast<size_t>(
+                                              xcb_get_atom_name_name_length(reply.get()))},
+                              atom);
+                } else {
+                    qWarning("no reply");
+                }
+
+                if (--*remaining == 0) {
+                    collect();
+                }
+            });
     }
 
-    return targets;
+    if (*remaining == 0) {
+        collect();
+    }
 }
 
 std::string Clipboard::getTargetName(xcb_atom_t atom) {
-    auto cookie = xcb_get_atom_name_unchecked(m_conn, atom);
-    auto reply = std::unique_ptr<xcb_get_atom_name_reply_t>(
-        xcb_get_atom_name_reply(m_conn, cookie, nullptr));
-    if (!reply) {
-        qWarning("no reply");
-        return "";
+    auto it = m_atomNames.find(atom);
+    if (it != m_atomNames.end()) {
+        return it->second;
     }
 
-    return std::string{xcb_get_atom_name_name(reply.get()),
-                       static_cast<size_t>(xcb_get_atom_name_name_length(reply.get()))};
+    // 只用于日志时不值得等待服务器，直接打印数值
+    return std::to_string(atom);
 }
 
 void Clipboard::setTargets(xcb_window_t requestor,
@@ -357,6 +609,12 @@ void Clipboard::setTargets(xcb_window_t requestor,
 bool Clipboard::setRequestorPropertyWithClipboardContent(const xcb_atom_t requestor,
                                                          const xcb_atom_t property,
                                                          const xcb_atom_t target) {
+    const auto &content = m_cachedProperties[target];
+    if (content.size() > m_incrChunkSize) {
+        startIncrWrite(requestor, property, target, content);
+        return true;
+    }
+
     xcb_change_property(m_conn,
                         XCB_PROP_MODE_REPLACE,
                         requestor,
@@ -368,45 +626,45 @@ bool Clipboard::setRequestorPropertyWithClipboardContent(const xcb_atom_t reques
     return true;
 }
 
-void Clipboard::notifyRequestor(std::shared_ptr<xcb_selection_request_event_t> event) {
+void Clipboard::notifyRequestor(const xcb_selection_request_event_t &event) {
     // Notify the "requestor" that we've already updated the property.
     xcb_selection_notify_event_t notify;
     notify.response_type = XCB_SELECTION_NOTIFY;
     notify.pad0 = 0;
     notify.sequence = 0;
-    notify.time = event->time;
-    notify.requestor = event->requestor;
-    notify.selection = event->selection;
-    notify.target = event->target;
-    notify.property = event->property;
+    notify.time = event.time;
+    notify.requestor = event.requestor;
+    notify.selection = event.selection;
+    notify.target = event.target;
+    notify.property = event.property;
 
     xcb_send_event(m_conn,
                    false,
-                   event->requestor,
+                   event.requestor,
                    XCB_EVENT_MASK_NO_EVENT, // SelectionNotify events go without mask
                    reinterpret_cast<const char *>(&notify));
     xcb_flush(m_conn);
 }
 
-void Clipboard::handleXcbSelectionRequest(std::shared_ptr<xcb_selection_request_event_t> event) {
-    if (event->target == getAtom("TARGETS")) {
+void Clipboard::handleXcbSelectionRequest(const xcb_selection_request_event_t &event) {
+    if (event.target == getAtom(ATOM_LIST::TARGETS)) {
         qDebug() << fmt::format("print TARGETS").data();
-        setTargets(event->requestor, event->property, m_cachedTargets);
+        setTargets(event.requestor, event.property, m_cachedTargets);
         notifyRequestor(event);
 
-    } else if (event->target == getAtom("MULTIPLE")) {
-        // auto data = readProperty(event->requestor, event->property);
+    } else if (event.target == getAtom(ATOM_LIST::MULTIPLE)) {
+        // auto data = readProperty(event.requestor, event.property);
         // xcb_atom_t *pairs = reinterpret_cast<xcb_atom_t *>(data.data());
         // size_t pairCnt = data.size() / sizeof(xcb_atom_t);
         // for (size_t i = 0; i < pairCnt; i += 2) {
         //     xcb_atom_t target = pairs[i];
         //     xcb_atom_t property = pairs[i + 1];
 
-        //     if (!setRequestorPropertyWithClipboardContent(event->requestor, property, target)) {
+        //     if (!setRequestorPropertyWithClipboardContent(event.requestor, property, target)) {
         //         xcb_change_property(m_conn,
         //                             XCB_PROP_MODE_REPLACE,
-        //                             event->requestor,
-        //                             event->property,
+        //                             event.requestor,
+        //                             event.property,
         //                             XCB_ATOM_NONE,
         //                             0,
         //                             0,
@@ -416,27 +674,27 @@ void Clipboard::handleXcbSelectionRequest(std::shared_ptr<xcb_selection_request_
 
         // notifyRequestor(event);
     } else {
-        auto targetName = getTargetName(event->target);
+        auto targetName = getTargetName(event.target);
         qDebug() << fmt::format("print target: {}", targetName).data();
-        if (std::find(m_cachedTargets.begin(), m_cachedTargets.end(), event->target) ==
+        if (std::find(m_cachedTargets.begin(), m_cachedTargets.end(), event.target) ==
             m_cachedTargets.end()) {
-            qWarning() << fmt::format("target {} is not exist", event->target).data();
+            qWarning() << fmt::format("target {} is not exist", event.target).data();
 
-            setRequestorPropertyWithClipboardContent(event->requestor,
-                                                     event->property,
-                                                     event->target);
+            setRequestorPropertyWithClipboardContent(event.requestor,
+                                                     event.property,
+                                                     event.target);
             notifyRequestor(event);
             return;
         }
 
         auto cb = [this, event]() {
-            if (m_cachedProperties.find(event->target) == m_cachedProperties.end()) {
+            if (m_cachedProperties.find(event.target) == m_cachedProperties.end()) {
                 return false;
             }
 
-            setRequestorPropertyWithClipboardContent(event->requestor,
-                                                     event->property,
-                                                     event->target);
+            setRequestorPropertyWithClipboardContent(event.requestor,
+                                                     event.property,
+                                                     event.target);
             notifyRequestor(event);
             return true;
         };
@@ -450,72 +708,122 @@ void Clipboard::handleXcbSelectionRequest(std::shared_ptr<xcb_selection_request_
     }
 }
 
-void Clipboard::handleXcbSelectionNotify(std::shared_ptr<xcb_selection_notify_event_t> event) {
-    if (event->property == getAtom(ATOM_LIST::CPRT_TARGETS)) {
-        m_cachedTargets = getTargets();
-        auto targetsName = getTargetsName(m_cachedTargets);
-        qDebug() << fmt::format("targets: {}", fmt::join(targetsName, ", ")).data();
+void Clipboard::handleXcbSelectionNotify(const xcb_selection_notify_event_t &event) {
+    uint64_t generation = m_generation;
 
-        notifyTargetsChanged(targetsName);
-
-    } else if (event->property == getAtom(ATOM_LIST::CPRT_PROPERTY)) {
-        m_cachedProperties[event->target] = readProperty(event->requestor, event->property);
-        qDebug() << fmt::format("target: {}, content: [{}] {}",
-                                getTargetName(event->target),
-                                m_cachedProperties[event->target].size(),
-                                m_cachedProperties[event->target])
-                        .data();
+    if (event.property == getAtom(ATOM_LIST::CPRT_TARGETS)) {
+        readProperty(m_dummyWindow, event.property, [this, generation](std::vector<char> buff) {
+            if (generation != m_generation) {
+                return;
+            }
 
-        m_sectionPropertyNotifyCb.remove_if([](auto &cb) -> bool { return cb(); });
+            std::vector<xcb_atom_t> targets(buff.size() / sizeof(xcb_atom_t));
+            memcpy(targets.data(), buff.data(), targets.size() * sizeof(xcb_atom_t));
+
+            getTargetsName(targets,
+                           [this, generation, targets](std::vector<std::string> targetsName) {
+                               if (generation != m_generation) {
+                                   return;
+                               }
+
+                               m_cachedTargets = targets;
+                               qDebug() << fmt::format("targets: {}", fmt::join(targetsName, ", "))
+                                               .data();
+
+                               notifyTargetsChanged(targetsName);
+                           });
+        });
+
+    } else if (event.property == getAtom(ATOM_LIST::CPRT_PROPERTY)) {
+        xcb_atom_t target = event.target;
+        readProperty(event.requestor,
+                     event.property,
+                     [this, generation, target](std::vector<char> data) {
+                         if (generation == m_generation) {
+                             m_cachedProperties[target] = std::move(data);
+                             qDebug() << fmt::format("target: {}, content: [{}] {}",
+                                                     getTargetName(target),
+                                                     m_cachedProperties[target].size(),
+                                                     m_cachedProperties[target])
+                                             .data();
+
+                             m_sectionPropertyNotifyCb.remove_if(
+                                 [](auto &cb) -> bool { return cb(); });
+                         }
+
+                         // CPRT_PROPERTY 读完之后才能请求下一个
+                         if (m_penddingPrint.empty()) {
+                             m_printingProperty = false;
+                         } else {
+                             printNextPenddingProperty();
+                         }
+                     });
+
+    } else if (event.property == getAtom(ATOM_LIST::CPRT_PROPERTIES)) {
+        readProperty(m_dummyWindow, event.property, [this, generation](std::vector<char> data) {
+            if (generation != m_generation) {
+                return;
+            }
 
-        if (m_penddingPrint.empty()) {
-            m_printingProperty = false;
-        } else {
-            printNextPenddingProperty();
-        }
+            xcb_atom_t *pairs = reinterpret_cast<xcb_atom_t *>(data.data());
+            size_t pairCnt = data.size() / sizeof(xcb_atom_t);
+            for (size_t i = 0; i + 1 < pairCnt; i += 2) {
+                xcb_atom_t target = pairs[i];
+                xcb_atom_t property = pairs[i + 1];
+
+                readProperty(m_dummyWindow,
+                             property,
+                             [this, generation, target](std::vector<char> content) {
+                                 if (generation != m_generation) {
+                                     return;
+                                 }
+
+                                 m_cachedProperties[target] = std::move(content);
+                                 qDebug() << fmt::format("target: {}, content: {}",
+                                                         getTargetName(target),
+                                                         m_cachedProperties[target])
+                                                 .data();
+
+                                 m_sectionPropertyNotifyCb.remove_if(
+                                     [](auto &cb) -> bool { return cb(); });
+                             });
+            }
+        });
+    }
+}
 
-    } else if (event->property == getAtom(ATOM_LIST::CPRT_PROPERTIES)) {
-        auto data = readProperty(m_dummyWindow, getAtom(ATOM_LIST::CPRT_PROPERTIES));
-        xcb_atom_t *pairs = reinterpret_cast<xcb_atom_t *>(data.data());
-        size_t pairCnt = data.size() / sizeof(xcb_atom_t);
-        for (size_t i = 0; i < pairCnt; i += 2) {
-            xcb_atom_t target = pairs[i];
-            xcb_atom_t property = pairs[i + 1];
-
-            m_cachedProperties[target] = readProperty(m_dummyWindow, property);
-            qDebug() << fmt::format("target: {}, content: {}",
-                                    getTargetName(target),
-                                    m_cachedProperties[target])
-                            .data();
+void Clipboard::handleXcbPropertyNotify(const xcb_property_notify_event_t &event) {
+    if (event.state == XCB_PROPERTY_NEW_VALUE) {
+        if (event.window == m_dummyWindow &&
+            m_incrReads.find(event.atom) != m_incrReads.end()) {
+            readIncrChunk(event.atom);
         }
-
-        m_sectionPropertyNotifyCb.remove_if([](auto &cb) -> bool { return cb(); });
+        return;
     }
-}
 
-bool Clipboard::ownSelection() {
-    xcb_void_cookie_t cookie = xcb_set_selection_owner_checked(m_conn,
-                                                               m_dummyWindow,
-                                                               m_selection,
-                                                               XCB_CURRENT_TIME);
-    auto err = std::unique_ptr<xcb_generic_error_t>(xcb_request_check(m_conn, cookie));
-    if (err) {
-        return false;
+    auto it = m_incrWrites.find({event.window, event.atom});
+    if (it != m_incrWrites.end()) {
+        writeIncrChunk(it);
     }
+}
 
-    return true;
+void Clipboard::ownSelection() {
+    xcb_set_selection_owner(m_conn, m_dummyWindow, m_selection, XCB_CURRENT_TIME);
+    xcb_flush(m_conn);
 }
 
 void Clipboard::newClipboardOwnerTargets(const std::vector<std::string> &targets) {
-    decltype(m_cachedTargets) targets_;
-    targets_.reserve(targets.size());
-    for (const std::string &target : targets) {
-        targets_.emplace_back(getAtom(target));
-    }
-
     reset();
-    m_cachedTargets.swap(targets_);
-    ownSelection();
+
+    uint64_t generation = m_generation;
+    internAtoms(targets, [this, generation](std::vector<xcb_atom_t> atoms) {
+        if (generation != m_generation) {
+            return;
+        }
+
+        m_cachedTargets.swap(atoms);
+        ownSelection();
+    });
 }
 
 void Clipboard::readTargetContent(
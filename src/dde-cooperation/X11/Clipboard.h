@@ -7,6 +7,7 @@
 
 #include <vector>
 #include <list>
+#include <map>
 #include <queue>
 #include <string>
 #include <unordered_map>
@@ -15,8 +16,12 @@
 
 #include <xcb/xcb.h>
 
+#include <QElapsedTimer>
+
 #include "../ClipboardBase.h"
 
+class QTimer;
+
 namespace X11 {
 
 class Clipboard : public X11, public ClipboardBase {
@@ -24,7 +29,7 @@ public:
     explicit Clipboard(ClipboardObserver *observer, QObject *parent = nullptr);
     virtual ~Clipboard();
 
-    virtual void handleEvent(std::shared_ptr<xcb_generic_event_t> event) override;
+    virtual void handleEvent(xcb_generic_event_t *event) override;
 
     virtual void newClipboardOwnerTargets(const std::vector<std::string> &targets) override;
     virtual void readTargetContent(
@@ -40,7 +45,9 @@ private:
     uint8_t m_xinput2OPCode;
     const struct xcb_query_extension_reply_t *m_xfixes;
 
+    // 双向缓存，避免每次读写属性时都向服务器查询名称
     std::unordered_map<std::string, xcb_atom_t> m_atoms;
+    std::unordered_map<xcb_atom_t, std::string> m_atomNames;
 
     xcb_atom_t m_selection;
 
@@ -57,6 +64,7 @@ private:
         STRING,
         UTF8_STRING,
         TEXT,
+        INCR,
     };
     static const std::string ATOMS_NAME[];
 
@@ -69,11 +77,42 @@ private:
     std::list<xcb_atom_t> m_penddingPrint;
     bool m_printingProperty;
 
-    xcb_screen_t *screenOfDisplay(int screen);
+    // 每次剪切板内容变化时加一，异步回复到达时已经过时的直接丢弃
+    uint64_t m_generation;
+
+    using PropertyCallback = std::function<void(std::vector<char> data)>;
+
+    // 超过这个大小的内容通过 INCR 分段传输
+    size_t m_incrChunkSize;
+
+    // 正在分段读取的属性，窗口都是 m_dummyWindow
+    struct IncrRead {
+        std::shared_ptr<std::vector<char>> buff;
+        PropertyCallback callback;
+        uint64_t generation;
+        QElapsedTimer lastChunk;
+    };
+    std::unordered_map<xcb_atom_t, IncrRead> m_incrReads;
+
+    // 正在分段写给请求方的内容，以请求方的窗口和属性为键
+    struct IncrWrite {
+        xcb_atom_t target;
+        std::vector<char> data;
+        size_t offset;
+        QElapsedTimer lastChunk;
+    };
+    std::map<std::pair<xcb_window_t, xcb_atom_t>, IncrWrite> m_incrWrites;
+
+    // 对方长时间没有继续传输时放弃，避免分段传输的状态一直保留
+    QTimer *m_incrTimer;
 
     xcb_atom_t getAtom(ATOM_LIST atom, bool onlyIfExists = false);
     xcb_atom_t getAtom(const char *name, bool onlyIfExists = false);
     xcb_atom_t getAtom(const std::string &name, bool onlyIfExists = false);
+    void initAtoms();
+    void internAtoms(const std::vector<std::string> &names,
+                     const std::function<void(std::vector<xcb_atom_t> atoms)> &callback);
+    void cacheAtom(const std::string &name, xcb_atom_t atom);
 
     void initRandrExtension();
     void initXinputExtension();
@@ -81,26 +120,42 @@ private:
 
     void reset();
 
-    std::vector<char> readProperty(xcb_window_t requestor, xcb_atom_t property);
+    void readProperty(xcb_window_t requestor, xcb_atom_t property, const PropertyCallback &callback);
+    void readPropertyFrom(xcb_window_t requestor,
+                          xcb_atom_t property,
+                          std::shared_ptr<std::vector<char>> buff,
+                          const PropertyCallback &callback);
+    void readIncrChunk(xcb_atom_t property);
+    void finishIncrRead(std::unordered_map<xcb_atom_t, IncrRead>::iterator it);
+    void startIncrWrite(xcb_window_t requestor,
+                        xcb_atom_t property,
+                        xcb_atom_t target,
+                        const std::vector<char> &data);
+    void writeIncrChunk(std::map<std::pair<xcb_window_t, xcb_atom_t>, IncrWrite>::iterator it);
+    void eraseIncrWrite(std::map<std::pair<xcb_window_t, xcb_atom_t>, IncrWrite>::iterator it);
+    void stopIncrWrites(xcb_window_t requestor);
+    void startIncrTimer();
+    void expireIncrTransfers();
 
     void printPropertyTargets();
     void printProperty(xcb_atom_t atom);
     void printNextPenddingProperty();
     void printProperties(const std::vector<xcb_atom_t> &pairs);
-    std::vector<xcb_atom_t> getTargets();
-    std::vector<std::string> getTargetsName(const std::vector<xcb_atom_t> &atoms);
-    std::string getTargetName(xcb_atom_t atoms);
+    void getTargetsName(const std::vector<xcb_atom_t> &atoms,
+                        const std::function<void(std::vector<std::string> names)> &callback);
+    std::string getTargetName(xcb_atom_t atom);
     void setTargets(xcb_window_t requestor,
                     xcb_atom_t property,
                     const std::vector<xcb_atom_t> &targets);
     bool setRequestorPropertyWithClipboardContent(const xcb_atom_t requestor,
                                                   const xcb_atom_t property,
                                                   const xcb_atom_t target);
-    bool ownSelection();
-    void notifyRequestor(std::shared_ptr<xcb_selection_request_event_t> event);
+    void ownSelection();
+    void notifyRequestor(const xcb_selection_request_event_t &event);
 
-    void handleXcbSelectionRequest(std::shared_ptr<xcb_selection_request_event_t> event);
-    void handleXcbSelectionNotify(std::shared_ptr<xcb_selection_notify_event_t> event);
+    void handleXcbSelectionRequest(const xcb_selection_request_event_t &event);
+    void handleXcbSelectionNotify(const xcb_selection_notify_event_t &event);
+    void handleXcbPropertyNotify(const xcb_property_notify_event_t &event);
 };
 
 } // namespace X11
@@ -0,0 +1,163 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "Connection.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <cstdlib>
+
+#include <xcb/xcbext.h>
+
+#include <fmt/core.h>
+
+#include <QDebug>
+#include <QSocketNotifier>
+
+#include "X11.h"
+
+namespace X11 {
+
+std::shared_ptr<Connection> Connection::instance() {
+    static std::weak_ptr<Connection> instance;
+
+    auto connection = instance.lock();
+    if (!connection) {
+        connection.reset(new Connection());
+        instance = connection;
+    }
+
+    return connection;
+}
+
+Connection::Connection()
+    : QObject(nullptr) {
+    int screenDefaultNbr;
+    m_conn = xcb_connect(nullptr, &screenDefaultNbr);
+
+    if (int err = xcb_connection_has_error(m_conn)) {
+        throw std::runtime_error(fmt::format("failed to connect to X11: {}", err));
+    }
+
+    m_xcbFd = xcb_get_file_descriptor(m_conn);
+    qInfo() << fmt::format("xcb fd: {}", m_xcbFd).data();
+    m_socketNotifier = new QSocketNotifier(m_xcbFd, QSocketNotifier::Type::Read, this);
+    connect(m_socketNotifier, &QSocketNotifier::activated, this, &Connection::onEvent);
+
+    m_setup = xcb_get_setup(m_conn);
+    m_screen = screenOfDisplay(screenDefaultNbr);
+}
+
+Connection::~Connection() {
+    xcb_disconnect(m_conn);
+}
+
+xcb_screen_t *Connection::screenOfDisplay(int screen) {
+    xcb_screen_iterator_t iter = xcb_setup_roots_iterator(m_setup);
+    for (; iter.rem; --screen, xcb_screen_next(&iter)) {
+        if (screen == 0) {
+            return iter.data;
+        }
+    }
+
+    return nullptr;
+}
+
+void Connection::subscribe(uint8_t responseType, X11 *handler) {
+    m_handlers[responseType & ~0x80].push_back(handler);
+}
+
+void Connection::subscribeGeneric(uint8_t extension, X11 *handler) {
+    m_genericHandlers[extension].push_back(handler);
+}
+
+void Connection::unsubscribe(X11 *handler) {
+    auto remove = [handler](std::vector<X11 *> &handlers) {
+        handlers.erase(std::remove(handlers.begin(), handlers.end(), handler), handlers.end());
+    };
+    std::for_each(m_handlers.begin(), m_handlers.end(), remove);
+    std::for_each(m_genericHandlers.begin(), m_genericHandlers.end(), remove);
+
+    // 回复仍然要从连接中取出，只是不再回调
+    for (auto &pending : m_pendingReplies) {
+        if (pending.owner == handler) {
+            pending.owner = nullptr;
+            pending.handler = nullptr;
+        }
+    }
+}
+
+void Connection::addPendingReply(unsigned int sequence,
+                                 X11 *owner,
+                                 std::function<void(void *reply)> handler) {
+    m_pendingReplies.push_back({sequence, owner, std::move(handler)});
+    xcb_flush(m_conn);
+}
+
+void Connection::onEvent() {
+    std::unique_ptr<xcb_generic_event_t, decltype(&free)> event(nullptr, &free);
+    while (event.reset(xcb_poll_for_event(m_conn)), event) {
+        dispatchEvent(event.get());
+    }
+    processReplies();
+
+    // 读取回复时可能顺带读入了新的事件，这些事件不会再触发 socket 的可读通知
+    while (event.reset(xcb_poll_for_queued_event(m_conn)), event) {
+        dispatchEvent(event.get());
+        processReplies();
+    }
+}
+
+void Connection::dispatchEvent(xcb_generic_event_t *event) {
+    // 不检查的请求出错时，错误作为事件送达
+    if (event->response_type == 0) {
+        auto *err = reinterpret_cast<xcb_generic_error_t *>(event);
+        qWarning() << fmt::format("X11 error: {}, request: {}.{}",
+                                  err->error_code,
+                                  err->major_code,
+                                  err->minor_code)
+                          .data();
+        return;
+    }
+
+    uint8_t responseType = event->response_type & ~0x80;
+    const auto &handlers = responseType == XCB_GE_GENERIC
+                               ? m_genericHandlers[reinterpret_cast<xcb_ge_generic_event_t *>(event)
+                                                       ->extension]
+                               : m_handlers[responseType];
+    for (X11 *handler : handlers) {
+        handler->handleEvent(event);
+    }
+}
+
+void Connection::processReplies() {
+    while (!m_pendingReplies.empty()) {
+        void *reply = nullptr;
+        xcb_generic_error_t *err = nullptr;
+        if (!xcb_poll_for_reply(m_conn, m_pendingReplies.front().sequence, &reply, &err)) {
+            break;
+        }
+
+        if (err != nullptr) {
+            qWarning() << fmt::format("X11 error: {}, request: {}.{}",
+                                      err->error_code,
+                                      err->major_code,
+                                      err->minor_code)
+                              .data();
+            free(err);
+        }
+
+        // handler 中可能发出新的请求
+        auto pending = std::move(m_pendingReplies.front());
+        m_pendingReplies.pop_front();
+        if (pending.handler) {
+            pending.handler(reply);
+        } else {
+            free(reply);
+        }
+    }
+}
+
+} // namespace X11
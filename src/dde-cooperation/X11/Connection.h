@@ -0,0 +1,77 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef X11_CONNECTION_H
+#define X11_CONNECTION_H
+
+#include <array>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <xcb/xcb.h>
+
+#include <QObject>
+
+class QSocketNotifier;
+
+namespace X11 {
+
+class X11;
+
+// 所有 X11 后端共用的连接。事件按类型分发给订阅的后端，XGE 事件按扩展的 major opcode 分发
+class Connection : public QObject {
+    Q_OBJECT
+
+public:
+    // 第一个后端创建时连接，最后一个后端析构时断开
+    static std::shared_ptr<Connection> instance();
+    ~Connection();
+
+    xcb_connection_t *conn() const { return m_conn; }
+    const xcb_setup_t *setup() const { return m_setup; }
+    xcb_screen_t *screen() const { return m_screen; }
+
+    void subscribe(uint8_t responseType, X11 *handler);
+    void subscribeGeneric(uint8_t extension, X11 *handler);
+    // 同时丢弃 handler 还没有收到的回复
+    void unsubscribe(X11 *handler);
+
+    void addPendingReply(unsigned int sequence,
+                         X11 *owner,
+                         std::function<void(void *reply)> handler);
+
+private:
+    struct PendingReply {
+        unsigned int sequence;
+        X11 *owner;
+        std::function<void(void *reply)> handler;
+    };
+
+    QSocketNotifier *m_socketNotifier;
+    xcb_connection_t *m_conn;
+    int m_xcbFd;
+    const xcb_setup_t *m_setup;
+    xcb_screen_t *m_screen;
+
+    // 以去掉 SendEvent 标志位后的 response_type 为下标
+    std::array<std::vector<X11 *>, 128> m_handlers;
+    // 以扩展的 major opcode 为下标
+    std::array<std::vector<X11 *>, 256> m_genericHandlers;
+
+    // 按请求的顺序排列，回复也按这个顺序到达
+    std::deque<PendingReply> m_pendingReplies;
+
+    Connection();
+
+    xcb_screen_t *screenOfDisplay(int screen);
+    void onEvent();
+    void dispatchEvent(xcb_generic_event_t *event);
+    void processReplies();
+};
+
+} // namespace X11
+
+#endif // !X11_CONNECTION_H
@@ -16,29 +16,95 @@
 
 #include <QDebug>
 
+#include "protocol/device_sharing.pb.h"
+
 using namespace X11;
 
 Display::Display(Manager *manager, QObject *parent)
     : X11(parent)
-    , DisplayBase(manager) {
+    , DisplayBase(manager)
+    , m_randr(nullptr)
+    , m_barrierSupported(false)
+    , m_barrierEventId(0) {
 
-    initXinputExtension();
+    initRandrExtension();
     initXfixesExtension();
+    initXinputExtension();
+    refreshDevices();
 
     uint32_t mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
     xcb_change_window_attributes(m_conn, m_screen->root, XCB_CW_EVENT_MASK, &mask);
 
+    subscribe(XCB_CONFIGURE_NOTIFY);
+    subscribeGeneric(m_xinput2OPCode);
+    if (m_randr->present) {
+        subscribe(m_randr->first_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY);
+        subscribe(m_randr->first_event + XCB_RANDR_NOTIFY);
+    }
+
     handleScreenSizeChange(m_screen->width_in_pixels, m_screen->height_in_pixels);
+    updateMonitors();
 }
 
 Display::~Display() {
+    destroyBarriers();
+    xcb_flush(m_conn);
 }
 
 void Display::initRandrExtension() {
-    const xcb_query_extension_reply_t *reply = xcb_get_extension_data(m_conn, &xcb_randr_id);
-    if (!reply->present) {
-        throw std::runtime_error("randr extension not found");
+    m_randr = xcb_get_extension_data(m_conn, &xcb_randr_id);
+    if (!m_randr->present) {
+        qWarning("randr is not present, treat the root window as one monitor");
+        return;
     }
+
+    xcb_randr_select_input(m_conn,
+                           m_screen->root,
+                           XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE | XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE);
+}
+
+void Display::updateMonitors() {
+    if (!m_randr->present) {
+        handleMonitorsChange({});
+        updateEdges();
+        return;
+    }
+
+    asyncReply<xcb_randr_get_screen_resources_current_reply_t>(
+        xcb_randr_get_screen_resources_current(m_conn, m_screen->root),
+        [this](auto resources) {
+            if (!resources) {
+                qWarning("failed to get screen resources");
+                return;
+            }
+
+            auto *crtcs = xcb_randr_get_screen_resources_current_crtcs(resources.get());
+            int len = xcb_randr_get_screen_resources_current_crtcs_length(resources.get());
+            if (len == 0) {
+                handleMonitorsChange({});
+                updateEdges();
+                return;
+            }
+
+            // 所有 CRTC 的请求一起发出，最后一个回复到达后更新
+            auto monitors = std::make_shared<std::vector<Monitor>>();
+            auto remaining = std::make_shared<int>(len);
+            for (int i = 0; i < len; i++) {
+                asyncReply<xcb_randr_get_crtc_info_reply_t>(
+                    xcb_randr_get_crtc_info(m_conn, crtcs[i], resources->config_timestamp),
+                    [this, monitors, remaining](auto crtc) {
+                        if (crtc && crtc->mode != XCB_NONE && crtc->width != 0 &&
+                            crtc->height != 0) {
+                            monitors->push_back({crtc->x, crtc->y, crtc->width, crtc->height});
+                        }
+
+                        if (--*remaining == 0) {
+                            handleMonitorsChange(*monitors);
+                            updateEdges();
+                        }
+                    });
+            }
+        });
 }
 
 void Display::initXinputExtension() {
@@ -62,6 +128,11 @@ void Display::initXinputExtension() {
 
         qDebug() << fmt::format("XInput version {}.{}", reply->major_version, reply->minor_version)
                         .data();
+
+        // BarrierHit 事件从 XInput 2.3 开始支持
+        if (reply->minor_version < 3) {
+            m_barrierSupported = false;
+        }
     }
 
     struct {
@@ -70,8 +141,15 @@ void Display::initXinputExtension() {
     } mask;
     mask.head.deviceid = XCB_INPUT_DEVICE_ALL;
     mask.head.mask_len = sizeof(mask.mask) / sizeof(uint32_t);
-    mask.mask = static_cast<xcb_input_xi_event_mask_t>(XCB_INPUT_XI_EVENT_MASK_HIERARCHY |
-                                                       XCB_INPUT_XI_EVENT_MASK_RAW_MOTION);
+    // 预测流转需要持续知道鼠标的位置和速度，有屏障时也要监听 RawMotion
+    uint32_t eventMask = XCB_INPUT_XI_EVENT_MASK_HIERARCHY;
+    if (m_barrierSupported) {
+        eventMask |= XCB_INPUT_XI_EVENT_MASK_BARRIER_HIT;
+    }
+    if (!m_barrierSupported || predictiveFlow()) {
+        eventMask |= XCB_INPUT_XI_EVENT_MASK_RAW_MOTION;
+    }
+    mask.mask = static_cast<xcb_input_xi_event_mask_t>(eventMask);
     auto cookie = xcb_input_xi_select_events(m_conn, m_screen->root, 1, &mask.head);
     auto err = xcb_request_check(m_conn, cookie);
     if (err) {
@@ -86,78 +164,222 @@ void Display::initXfixesExtension() {
         return;
     }
 
-    xcb_generic_error_t *err = nullptr;
     auto reply = XCB_REPLY(xcb_xfixes_query_version,
                            m_conn,
                            XCB_XFIXES_MAJOR_VERSION,
                            XCB_XFIXES_MINOR_VERSION);
-    if (err != nullptr) {
-        qWarning() << fmt::format("xcb_xfixes_query_version: {}", err->error_code).data();
+    if (!reply) {
+        qWarning("failed to query xfixes version");
         return;
     }
 
     qDebug()
         << fmt::format("Xfixes version {}.{}", reply->major_version, reply->minor_version).data();
+
+    // 指针屏障从 XFixes 5 开始支持
+    m_barrierSupported = reply->major_version >= 5;
+    if (!m_barrierSupported) {
+        qWarning("pointer barriers are not supported, fallback to raw motion");
+    }
+}
+
+void Display::updateEdges() {
+    if (!m_barrierSupported) {
+        return;
+    }
+
+    destroyBarriers();
+
+    if (edgeDetectionStarted()) {
+        uint8_t edges = flowEdges();
+        for (uint16_t direction = 0; direction < 8; direction++) {
+            if (!(edges & (1 << direction))) {
+                continue;
+            }
+
+            for (const auto &segment : edgeSegments(direction)) {
+                createBarrier(direction, segment);
+            }
+        }
+    }
+
+    xcb_flush(m_conn);
 }
 
-void Display::handleEvent(std::shared_ptr<xcb_generic_event_t> event) {
+void Display::createBarrier(uint16_t direction, const EdgeSegment &segment) {
+    // 屏障只挡住离开屏幕的方向，从边缘往屏幕里移动不受影响。
+    // 屏障所在的线位于像素之间，右侧和下侧的屏障要放在边缘像素之后
+    uint16_t x1, y1, x2, y2;
+    uint32_t directions;
+    switch (direction) {
+    case FLOW_DIRECTION_LEFT:
+        x1 = x2 = segment.pos;
+        y1 = segment.start;
+        y2 = segment.end + 1;
+        directions = XCB_XFIXES_BARRIER_DIRECTIONS_POSITIVE_X;
+        break;
+    case FLOW_DIRECTION_RIGHT:
+        x1 = x2 = segment.pos + 1;
+        y1 = segment.start;
+        y2 = segment.end + 1;
+        directions = XCB_XFIXES_BARRIER_DIRECTIONS_NEGATIVE_X;
+        break;
+    case FLOW_DIRECTION_TOP:
+        x1 = segment.start;
+        x2 = segment.end + 1;
+        y1 = y2 = segment.pos;
+        directions = XCB_XFIXES_BARRIER_DIRECTIONS_POSITIVE_Y;
+        break;
+    case FLOW_DIRECTION_BOTTOM:
+        x1 = segment.start;
+        x2 = segment.end + 1;
+        y1 = y2 = segment.pos + 1;
+        directions = XCB_XFIXES_BARRIER_DIRECTIONS_NEGATIVE_Y;
+        break;
+    default:
+        return;
+    }
+
+    xcb_xfixes_barrier_t barrier = xcb_generate_id(m_conn);
+    xcb_xfixes_create_pointer_barrier(m_conn,
+                                      barrier,
+                                      m_screen->root,
+                                      x1,
+                                      y1,
+                                      x2,
+                                      y2,
+                                      directions,
+                                      0,
+                                      nullptr);
+    m_barriers.emplace(barrier, direction);
+}
+
+void Display::destroyBarriers() {
+    for (const auto &[barrier, _] : m_barriers) {
+        xcb_xfixes_delete_pointer_barrier(m_conn, barrier);
+    }
+    m_barriers.clear();
+}
+
+void Display::handleEvent(xcb_generic_event_t *event) {
     auto response_type = event->response_type & ~0x80;
+
+    if (m_randr->present && (response_type == m_randr->first_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY ||
+                             response_type == m_randr->first_event + XCB_RANDR_NOTIFY)) {
+        updateMonitors();
+        return;
+    }
+
     switch (response_type) {
     case XCB_CONFIGURE_NOTIFY: {
-        auto *cne = reinterpret_cast<xcb_configure_notify_event_t *>(event.get());
+        auto *cne = reinterpret_cast<xcb_configure_notify_event_t *>(event);
+        if (cne->window != m_screen->root) {
+            break;
+        }
+
         handleScreenSizeChange(cne->width, cne->height);
+        updateEdges();
 
         break;
     }
     case XCB_GE_GENERIC: {
-        auto *ge = reinterpret_cast<xcb_ge_generic_event_t *>(event.get());
+        auto *ge = reinterpret_cast<xcb_ge_generic_event_t *>(event);
+        if (ge->extension != m_xinput2OPCode) {
+            break;
+        }
 
-        if (edgeDetectionStarted() && ge->extension == m_xinput2OPCode &&
-            ge->event_type == XCB_INPUT_RAW_MOTION) {
-            auto reply = XCB_REPLY(xcb_query_pointer, m_conn, m_screen->root);
-            if (!reply) {
-                qWarning("failed to query pointer");
-                break;
-            }
+        if (ge->event_type == XCB_INPUT_HIERARCHY) {
+            refreshDevices();
+            break;
+        }
 
-            bool eventFromPeer = false;
-            auto *ev = reinterpret_cast<xcb_input_property_event_t *>(event.get());
-            if (ev) {
-                // eventFromPeer = ev->deviceid >= 14;
-                auto reply1 = XCB_REPLY(xcb_input_xi_query_device, m_conn, XCB_INPUT_DEVICE_ALL);
-                auto it = xcb_input_xi_query_device_infos_iterator(reply1.get());
-                for (; it.rem; xcb_input_xi_device_info_next(&it)) {
-                    if (eventFromPeer) {
-                        break;
-                    }
-
-                    xcb_input_xi_device_info_t *deviceInfo = it.data;
-                    if (!deviceInfo || deviceInfo->deviceid != ev->deviceid) {
-                        continue;
-                    }
-
-                    switch (deviceInfo->type) {
-                    case XCB_INPUT_DEVICE_TYPE_SLAVE_POINTER:
-                    case XCB_INPUT_DEVICE_TYPE_MASTER_POINTER: {
-                        std::string deviceName(xcb_input_xi_device_info_name(deviceInfo),
-                                               deviceInfo->name_len);
-                        if (!deviceName.empty() && deviceName.rfind("DDE", 0) == 0) {
-                            eventFromPeer = true;
-                        }
-                    } break;
-                    default:
-                        break;
-                    }
-                }
-            }
+        if (!edgeDetectionStarted()) {
+            break;
+        }
 
-            handleMotion(reply->root_x, reply->root_y, eventFromPeer);
+        switch (ge->event_type) {
+        case XCB_INPUT_BARRIER_HIT:
+            handleBarrierHit(reinterpret_cast<xcb_input_barrier_hit_event_t *>(event));
+            break;
+        case XCB_INPUT_RAW_MOTION:
+            handleRawMotion(reinterpret_cast<xcb_input_raw_motion_event_t *>(event));
+            break;
         }
         break;
     }
     }
 }
 
+void Display::handleBarrierHit(const xcb_input_barrier_hit_event_t *ev) {
+    // 一次持续的撞击会不断产生 eventid 相同的事件，只处理第一个
+    if (ev->eventid == m_barrierEventId) {
+        return;
+    }
+    m_barrierEventId = ev->eventid;
+
+    auto iter = m_barriers.find(ev->barrier);
+    if (iter == m_barriers.end()) {
+        return;
+    }
+
+    // root_x/root_y 为 16.16 定点数
+    handleEdgeHit(iter->second, ev->root_x >> 16, ev->root_y >> 16, isPeerDevice(ev->sourceid));
+}
+
+void Display::handleRawMotion(const xcb_input_raw_motion_event_t *ev) {
+    bool fromPeer = isPeerDevice(ev->deviceid);
+    asyncReply<xcb_query_pointer_reply_t>(xcb_query_pointer(m_conn, m_screen->root),
+                                          [this, fromPeer](auto reply) {
+                                              if (!reply) {
+                                                  qWarning("failed to query pointer");
+                                                  return;
+                                              }
+
+                                              // 有屏障时流出由 BarrierHit 触发，这里只做预测
+                                              if (m_barrierSupported) {
+                                                  predictFlow(reply->root_x, reply->root_y, fromPeer);
+                                              } else {
+                                                  handleMotion(reply->root_x, reply->root_y, fromPeer);
+                                              }
+                                          });
+}
+
+void Display::refreshDevices() {
+    asyncReply<xcb_input_xi_query_device_reply_t>(
+        xcb_input_xi_query_device(m_conn, XCB_INPUT_DEVICE_ALL),
+        [this](auto reply) {
+            if (!reply) {
+                qWarning("failed to query input devices");
+                return;
+            }
+
+            updatePeerDevices(reply.get());
+        });
+}
+
+void Display::updatePeerDevices(xcb_input_xi_query_device_reply_t *reply) {
+    m_peerDevices.clear();
+
+    // 对端的输入通过名称以 DDE 开头的虚拟设备注入
+    auto it = xcb_input_xi_query_device_infos_iterator(reply);
+    for (; it.rem; xcb_input_xi_device_info_next(&it)) {
+        xcb_input_xi_device_info_t *deviceInfo = it.data;
+        if (deviceInfo->type != XCB_INPUT_DEVICE_TYPE_SLAVE_POINTER &&
+            deviceInfo->type != XCB_INPUT_DEVICE_TYPE_MASTER_POINTER) {
+            continue;
+        }
+
+        std::string deviceName(xcb_input_xi_device_info_name(deviceInfo), deviceInfo->name_len);
+        if (deviceName.rfind("DDE", 0) == 0) {
+            m_peerDevices.insert(deviceInfo->deviceid);
+        }
+    }
+}
+
+bool Display::isPeerDevice(xcb_input_device_id_t deviceid) const {
+    return m_peerDevices.count(deviceid) != 0;
+}
+
 void Display::hideMouse(bool hide) {
 #if 0 // TODO this operation does not work on some pc machines
     if (hide) {
@@ -177,10 +399,7 @@ void Display::hideMouse(bool hide) {
 }
 
 void Display::moveMouse(uint16_t x, uint16_t y) {
-    xcb_void_cookie_t
-        cookie = xcb_warp_pointer_checked(m_conn, XCB_NONE, m_screen->root, 0, 0, 0, 0, x, y);
-    xcb_generic_error_t *err = xcb_request_check(m_conn, cookie);
-    if (err != nullptr) {
-        qWarning() << fmt::format("failed to move cursor: {}", err->error_code).data();
-    }
+    // 出错时错误在事件循环中打印，不等待服务器处理完
+    xcb_warp_pointer(m_conn, XCB_NONE, m_screen->root, 0, 0, 0, 0, x, y);
+    xcb_flush(m_conn);
 }
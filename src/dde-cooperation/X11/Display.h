@@ -6,11 +6,15 @@
 #define X11_DISPLAY_H
 
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "../DisplayBase.h"
 #include "X11.h"
 
 #include <xcb/xcb.h>
+#include <xcb/xfixes.h>
+#include <xcb/xinput.h>
 
 namespace X11 {
 
@@ -19,7 +23,8 @@ public:
     explicit Display(Manager *manager, QObject *parent = nullptr);
     virtual ~Display();
 
-    virtual void handleEvent(std::shared_ptr<xcb_generic_event_t> event) override;
+    virtual void handleEvent(xcb_generic_event_t *event) override;
+    virtual void updateEdges() override;
 
 protected:
     virtual void hideMouse(bool hide) override;
@@ -28,10 +33,30 @@ protected:
 private:
     uint8_t m_xinput2OPCode;
     const struct xcb_query_extension_reply_t *m_xfixes;
+    const struct xcb_query_extension_reply_t *m_randr;
+
+    // XFixes 5 和 XInput 2.3 可用时在有对端的屏幕边缘放置指针屏障，
+    // 否则退回到处理每个 RawMotion 事件
+    bool m_barrierSupported;
+    std::unordered_map<xcb_xfixes_barrier_t, uint16_t> m_barriers; // 屏障 -> 方向
+    uint32_t m_barrierEventId; // 已经处理过的一次连续撞击
+
+    // 对端输入注入用的虚拟指针设备，设备增删时刷新
+    std::unordered_set<xcb_input_device_id_t> m_peerDevices;
 
     void initRandrExtension();
     void initXinputExtension();
     void initXfixesExtension();
+
+    void updateMonitors();
+
+    void createBarrier(uint16_t direction, const EdgeSegment &segment);
+    void destroyBarriers();
+    void handleBarrierHit(const xcb_input_barrier_hit_event_t *ev);
+    void handleRawMotion(const xcb_input_raw_motion_event_t *ev);
+    void refreshDevices();
+    void updatePeerDevices(xcb_input_xi_query_device_reply_t *reply);
+    bool isPeerDevice(xcb_input_device_id_t deviceid) const;
 };
 
 } // namespace X11
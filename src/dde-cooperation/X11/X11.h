@@ -5,20 +5,20 @@
 #ifndef X11_X11_H
 #define X11_X11_H
 
+#include <functional>
 #include <memory>
 
 #include <xcb/xcb.h>
 
 #include <QObject>
-#include <QSocketNotifier>
+
+#include "Connection.h"
 
 #define XCB_REPLY_CONNECTION_ARG(connection, ...) connection
 #define XCB_REPLY(call, ...)                                                                       \
     std::unique_ptr<call##_reply_t>(                                                               \
         call##_reply(XCB_REPLY_CONNECTION_ARG(__VA_ARGS__), call(__VA_ARGS__), nullptr))
 
-class QSocketNotifier;
-
 namespace X11 {
 
 class X11 : public QObject {
@@ -28,17 +28,25 @@ public:
     explicit X11(QObject *parent = nullptr);
     virtual ~X11();
 
-    virtual void handleEvent(std::shared_ptr<xcb_generic_event_t> event) = 0;
+    // 事件在分发结束后释放，需要保留时自行复制
+    virtual void handleEvent(xcb_generic_event_t *event) = 0;
 
 protected:
-    QSocketNotifier *m_socketNotifier;
+    std::shared_ptr<Connection> m_connection;
     xcb_connection_t *m_conn;
-    int m_xcbFd;
     const xcb_setup_t *m_setup;
     xcb_screen_t *m_screen;
 
-    xcb_screen_t *screenOfDisplay(int screen);
-    void onEvent();
+    void subscribe(uint8_t responseType) { m_connection->subscribe(responseType, this); }
+    void subscribeGeneric(uint8_t extension) { m_connection->subscribeGeneric(extension, this); }
+
+    // 发出请求后不等待回复，回复到达后在事件循环中调用 handler，出错或连接断开时参数为空
+    template <typename Reply, typename Cookie>
+    void asyncReply(Cookie cookie, std::function<void(std::unique_ptr<Reply>)> handler) {
+        m_connection->addPendingReply(cookie.sequence, this, [handler](void *reply) {
+            handler(std::unique_ptr<Reply>(static_cast<Reply *>(reply)));
+        });
+    }
 };
 
 } // namespace X11
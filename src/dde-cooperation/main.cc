@@ -6,10 +6,21 @@
 
 #include <DApplication>
 
+#include <sys/resource.h>
+
 namespace fs = std::filesystem;
 
 DWIDGET_USE_NAMESPACE
 
+// FuseServer 为内核引用的每个节点持有一个描述符，默认的软限制 1024 很容易用完
+static void raiseFdLimit() {
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+        rlim.rlim_cur = rlim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+}
+
 int main(int argc, char *argv[]) {
     std::string runtimeDir = getenv("XDG_RUNTIME_DIR");
     if (runtimeDir.empty()) {
@@ -18,6 +29,8 @@ int main(int argc, char *argv[]) {
 
     fs::path dataDir = fs::path(runtimeDir) / "dde-cooperation";
 
+    raiseFdLimit();
+
     DApplication::setQuitOnLastWindowClosed(false);
     DApplication app(argc, argv);
     app.setOrganizationName("deepin");
@@ -0,0 +1,295 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "Benchmark.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <fmt/core.h>
+
+#include <QDebug>
+
+namespace fs = std::filesystem;
+
+static constexpr size_t ioSize = 4096;
+static constexpr size_t readdirRounds = 20;
+static const char *bigDirName = "bigdir";
+static const char *dataFileName = "data.bin";
+
+using Clock = std::chrono::steady_clock;
+
+static uint64_t elapsedNs(Clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+static double elapsedSeconds(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static std::string fileName(size_t i) {
+    return fmt::format("file-{:06}", i);
+}
+
+// 每项测试前丢弃页缓存，保证数据从远端读取
+static int openCold(const fs::path &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    return fd;
+}
+
+Benchmark::Benchmark(const Options &options)
+    : m_options(options) {
+}
+
+bool Benchmark::prepare(const fs::path &root) const {
+    std::error_code ec;
+    fs::create_directories(root / bigDirName, ec);
+    if (ec) {
+        qWarning() << fmt::format("failed to create {}: {}", root.string(), ec.message()).data();
+        return false;
+    }
+
+    for (size_t i = 0; i < m_options.files; i++) {
+        int fd = open((root / bigDirName / fileName(i)).c_str(),
+                      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+        if (fd == -1) {
+            qWarning() << fmt::format("failed to create file: {}", strerror(errno)).data();
+            return false;
+        }
+        close(fd);
+    }
+
+    int fd = open((root / dataFileName).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        qWarning() << fmt::format("failed to create data file: {}", strerror(errno)).data();
+        return false;
+    }
+
+    // 写入真实数据，避免稀疏文件让服务端的读取失真
+    std::vector<char> buff(1024 * 1024);
+    std::mt19937_64 rng(0);
+    for (auto &c : buff) {
+        c = static_cast<char>(rng());
+    }
+
+    bool ok = true;
+    for (uint64_t written = 0; ok && written < m_options.fileSize;) {
+        size_t size = std::min<uint64_t>(buff.size(), m_options.fileSize - written);
+        ok = write(fd, buff.data(), size) == static_cast<ssize_t>(size);
+        written += size;
+    }
+    close(fd);
+
+    return ok;
+}
+
+QJsonArray Benchmark::run(const fs::path &mountpoint) const {
+    QJsonArray results;
+
+    for (auto test : {&Benchmark::statStorm,
+                      &Benchmark::readdirHuge,
+                      &Benchmark::sequentialRead,
+                      &Benchmark::randomRead,
+                      &Benchmark::parallelRead}) {
+        Result result = (this->*test)(mountpoint);
+        qInfo() << fmt::format("{}: {} ops in {:.3f}s", result.name, result.latencies.size(), result.seconds)
+                       .data();
+        results.append(toJson(result));
+    }
+
+    return results;
+}
+
+Benchmark::Result Benchmark::statStorm(const fs::path &mountpoint) const {
+    Result result{"stat_storm", 0, {}};
+    result.latencies.reserve(m_options.ops);
+
+    // 按顺序轮流 stat 大目录中的文件，文件数多于属性缓存能覆盖的范围时基本都要走远端
+    fs::path dir = mountpoint / bigDirName;
+    auto start = Clock::now();
+    for (size_t i = 0; i < m_options.ops; i++) {
+        std::string path = (dir / fileName(i % m_options.files)).string();
+
+        struct stat st;
+        auto opStart = Clock::now();
+        if (stat(path.c_str(), &st) == -1) {
+            qWarning() << fmt::format("stat {} failed: {}", path, strerror(errno)).data();
+            break;
+        }
+        result.latencies.push_back(elapsedNs(opStart));
+    }
+    result.seconds = elapsedSeconds(start);
+
+    return result;
+}
+
+Benchmark::Result Benchmark::readdirHuge(const fs::path &mountpoint) const {
+    Result result{"readdir_huge", 0, {}};
+
+    // 一次操作为完整列出一遍目录
+    fs::path dir = mountpoint / bigDirName;
+    auto start = Clock::now();
+    for (size_t i = 0; i < readdirRounds; i++) {
+        auto opStart = Clock::now();
+        DIR *d = opendir(dir.c_str());
+        if (!d) {
+            qWarning() << fmt::format("opendir failed: {}", strerror(errno)).data();
+            break;
+        }
+
+        size_t count = 0;
+        while (readdir(d)) {
+            count++;
+        }
+        closedir(d);
+        result.latencies.push_back(elapsedNs(opStart));
+
+        if (count < m_options.files) {
+            qWarning() << fmt::format("readdir returned {} entries, expected {}", count, m_options.files)
+                              .data();
+        }
+    }
+    result.seconds = elapsedSeconds(start);
+
+    return result;
+}
+
+Benchmark::Result Benchmark::sequentialRead(const fs::path &mountpoint) const {
+    Result result{"sequential_read_4k", 0, {}};
+    result.latencies.reserve(m_options.fileSize / ioSize);
+
+    int fd = openCold(mountpoint / dataFileName);
+    if (fd == -1) {
+        qWarning() << fmt::format("open failed: {}", strerror(errno)).data();
+        return result;
+    }
+
+    char buff[ioSize];
+    auto start = Clock::now();
+    while (true) {
+        auto opStart = Clock::now();
+        ssize_t n = read(fd, buff, sizeof(buff));
+        if (n <= 0) {
+            break;
+        }
+        result.latencies.push_back(elapsedNs(opStart));
+    }
+    result.seconds = elapsedSeconds(start);
+    close(fd);
+
+    return result;
+}
+
+Benchmark::Result Benchmark::randomRead(const fs::path &mountpoint) const {
+    Result result{"random_read_4k", 0, {}};
+    result.latencies.reserve(m_options.ops);
+
+    int fd = openCold(mountpoint / dataFileName);
+    if (fd == -1) {
+        qWarning() << fmt::format("open failed: {}", strerror(errno)).data();
+        return result;
+    }
+
+    std::mt19937_64 rng(1);
+    std::uniform_int_distribution<uint64_t> block(0, m_options.fileSize / ioSize - 1);
+
+    char buff[ioSize];
+    auto start = Clock::now();
+    for (size_t i = 0; i < m_options.ops; i++) {
+        auto opStart = Clock::now();
+        if (pread(fd, buff, sizeof(buff), block(rng) * ioSize) <= 0) {
+            qWarning() << fmt::format("pread failed: {}", strerror(errno)).data();
+            break;
+        }
+        result.latencies.push_back(elapsedNs(opStart));
+    }
+    result.seconds = elapsedSeconds(start);
+    close(fd);
+
+    return result;
+}
+
+Benchmark::Result Benchmark::parallelRead(const fs::path &mountpoint) const {
+    Result result{fmt::format("parallel_read_4k_x{}", m_options.threads), 0, {}};
+
+    std::vector<std::vector<uint64_t>> latencies(m_options.threads);
+    std::vector<std::thread> threads;
+
+    // 每个线程各自打开文件，模拟多个进程同时读取
+    size_t opsPerThread = m_options.ops / m_options.threads;
+    auto start = Clock::now();
+    for (unsigned int t = 0; t < m_options.threads; t++) {
+        threads.emplace_back([this, &mountpoint, &latencies, opsPerThread, t] {
+            int fd = openCold(mountpoint / dataFileName);
+            if (fd == -1) {
+                return;
+            }
+
+            std::mt19937_64 rng(t + 2);
+            std::uniform_int_distribution<uint64_t> block(0, m_options.fileSize / ioSize - 1);
+
+            char buff[ioSize];
+            latencies[t].reserve(opsPerThread);
+            for (size_t i = 0; i < opsPerThread; i++) {
+                auto opStart = Clock::now();
+                if (pread(fd, buff, sizeof(buff), block(rng) * ioSize) <= 0) {
+                    break;
+                }
+                latencies[t].push_back(elapsedNs(opStart));
+            }
+            close(fd);
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    result.seconds = elapsedSeconds(start);
+
+    for (auto &l : latencies) {
+        result.latencies.insert(result.latencies.end(), l.begin(), l.end());
+    }
+
+    return result;
+}
+
+QJsonObject Benchmark::toJson(Result &result) {
+    auto &l = result.latencies;
+    std::sort(l.begin(), l.end());
+
+    auto percentile = [&l](double q) -> double {
+        if (l.empty()) {
+            return 0;
+        }
+        size_t i = std::min(l.size() - 1, static_cast<size_t>(q * l.size()));
+        return l[i] / 1000.0;
+    };
+
+    QJsonObject latency;
+    latency["p50"] = percentile(0.50);
+    latency["p90"] = percentile(0.90);
+    latency["p99"] = percentile(0.99);
+    latency["max"] = l.empty() ? 0 : l.back() / 1000.0;
+
+    QJsonObject obj;
+    obj["name"] = QString::fromStdString(result.name);
+    obj["ops"] = static_cast<qint64>(l.size());
+    obj["seconds"] = result.seconds;
+    obj["ops_per_sec"] = result.seconds > 0 ? l.size() / result.seconds : 0;
+    obj["latency_us"] = latency;
+
+    return obj;
+}
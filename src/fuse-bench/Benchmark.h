@@ -0,0 +1,50 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef FUSE_BENCH_BENCHMARK_H
+#define FUSE_BENCH_BENCHMARK_H
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <QJsonArray>
+#include <QJsonObject>
+
+// 固定的测试集，在挂载点上运行，结果为每项的 ops/s 和延迟分位数
+class Benchmark {
+public:
+    struct Options {
+        size_t files = 10000;                // 大目录中的文件数
+        uint64_t fileSize = 64 * 1024 * 1024; // 读取测试使用的文件大小
+        size_t ops = 20000;                  // stat 与随机读的操作数
+        unsigned int threads = 4;            // 并发读的线程数
+    };
+
+    explicit Benchmark(const Options &options);
+
+    // 在服务端目录下生成测试用的文件树
+    bool prepare(const std::filesystem::path &root) const;
+    QJsonArray run(const std::filesystem::path &mountpoint) const;
+
+private:
+    struct Result {
+        std::string name;
+        double seconds;
+        // 每次操作的耗时，单位 ns
+        std::vector<uint64_t> latencies;
+    };
+
+    const Options m_options;
+
+    Result statStorm(const std::filesystem::path &mountpoint) const;
+    Result readdirHuge(const std::filesystem::path &mountpoint) const;
+    Result sequentialRead(const std::filesystem::path &mountpoint) const;
+    Result randomRead(const std::filesystem::path &mountpoint) const;
+    Result parallelRead(const std::filesystem::path &mountpoint) const;
+
+    static QJsonObject toJson(Result &result);
+};
+
+#endif // !FUSE_BENCH_BENCHMARK_H
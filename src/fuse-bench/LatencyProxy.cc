@@ -0,0 +1,168 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "LatencyProxy.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <fmt/core.h>
+
+#include "utils/net.h"
+
+static constexpr size_t chunkSize = 64 * 1024;
+
+LatencyProxy::Session::~Session() {
+    shutdown(client, SHUT_RDWR);
+    shutdown(server, SHUT_RDWR);
+
+    for (Pipe *pipe : {&up, &down}) {
+        if (pipe->reader.joinable()) {
+            pipe->reader.join();
+        }
+        if (pipe->writer.joinable()) {
+            pipe->writer.join();
+        }
+    }
+
+    close(client);
+    close(server);
+}
+
+LatencyProxy::LatencyProxy(uint16_t targetPort, std::chrono::microseconds rtt)
+    : m_targetPort(targetPort)
+    , m_delay(rtt / 2)
+    , m_listenFd(-1)
+    , m_port(0) {
+    m_listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (m_listenFd == -1 || bind(m_listenFd, reinterpret_cast<sockaddr *>(&addr), len) == -1
+        || listen(m_listenFd, 16) == -1
+        || getsockname(m_listenFd, reinterpret_cast<sockaddr *>(&addr), &len) == -1) {
+        qWarning() << fmt::format("failed to start latency proxy: {}", strerror(errno)).data();
+        return;
+    }
+
+    m_port = ntohs(addr.sin_port);
+    m_acceptThread = std::thread(&LatencyProxy::acceptLoop, this);
+}
+
+LatencyProxy::~LatencyProxy() {
+    if (m_listenFd != -1) {
+        shutdown(m_listenFd, SHUT_RDWR);
+    }
+    if (m_acceptThread.joinable()) {
+        m_acceptThread.join();
+    }
+    if (m_listenFd != -1) {
+        close(m_listenFd);
+    }
+
+    std::lock_guard lk(m_sessionsMut);
+    m_sessions.clear();
+}
+
+void LatencyProxy::acceptLoop() {
+    while (true) {
+        int client = accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        int server = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(m_targetPort);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (server == -1 || connect(server, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1) {
+            qWarning() << fmt::format("latency proxy failed to connect: {}", strerror(errno)).data();
+            if (server != -1) {
+                close(server);
+            }
+            close(client);
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        auto session = std::make_unique<Session>();
+        session->client = client;
+        session->server = server;
+        startPipe(session->up, client, server);
+        startPipe(session->down, server, client);
+
+        std::lock_guard lk(m_sessionsMut);
+        m_sessions.emplace_back(std::move(session));
+    }
+}
+
+void LatencyProxy::startPipe(Pipe &pipe, int from, int to) {
+    pipe.from = from;
+    pipe.to = to;
+    pipe.reader = std::thread(&LatencyProxy::readLoop, this, std::ref(pipe));
+    pipe.writer = std::thread(&LatencyProxy::writeLoop, this, std::ref(pipe));
+}
+
+void LatencyProxy::readLoop(Pipe &pipe) {
+    std::string buff(chunkSize, '\0');
+    while (true) {
+        ssize_t n = recv(pipe.from, buff.data(), buff.size(), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        std::lock_guard lk(pipe.mut);
+        if (n <= 0) {
+            pipe.eof = true;
+            pipe.cv.notify_one();
+            return;
+        }
+
+        pipe.chunks.push_back(Chunk{std::chrono::steady_clock::now() + m_delay, buff.substr(0, n)});
+        pipe.cv.notify_one();
+    }
+}
+
+void LatencyProxy::writeLoop(Pipe &pipe) {
+    std::unique_lock lk(pipe.mut);
+    while (true) {
+        pipe.cv.wait(lk, [&pipe] { return pipe.eof || !pipe.chunks.empty(); });
+        if (pipe.chunks.empty()) {
+            shutdown(pipe.to, SHUT_WR);
+            return;
+        }
+
+        auto due = pipe.chunks.front().due;
+        if (std::chrono::steady_clock::now() < due) {
+            pipe.cv.wait_until(lk, due);
+            continue;
+        }
+
+        Chunk chunk = std::move(pipe.chunks.front());
+        pipe.chunks.pop_front();
+
+        lk.unlock();
+        bool ok = Net::sendAll(pipe.to, chunk.data.data(), chunk.data.size());
+        lk.lock();
+
+        if (!ok) {
+            shutdown(pipe.from, SHUT_RD);
+            return;
+        }
+    }
+}
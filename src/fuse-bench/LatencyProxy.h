@@ -0,0 +1,67 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef FUSE_BENCH_LATENCYPROXY_H
+#define FUSE_BENCH_LATENCYPROXY_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// 本机 TCP 转发，每个方向的数据延迟 rtt / 2 后再发出，用来模拟无线网络下的往返时延
+class LatencyProxy {
+public:
+    LatencyProxy(uint16_t targetPort, std::chrono::microseconds rtt);
+    ~LatencyProxy();
+
+    uint16_t port() const { return m_port; }
+
+private:
+    struct Chunk {
+        std::chrono::steady_clock::time_point due;
+        std::string data;
+    };
+
+    // 单个方向的转发，读线程收到数据后打上到期时间入队，写线程到期后发出
+    struct Pipe {
+        int from;
+        int to;
+        std::mutex mut;
+        std::condition_variable cv;
+        std::deque<Chunk> chunks;
+        bool eof = false;
+        std::thread reader;
+        std::thread writer;
+    };
+
+    struct Session {
+        int client;
+        int server;
+        Pipe up;
+        Pipe down;
+        ~Session();
+    };
+
+    const uint16_t m_targetPort;
+    const std::chrono::microseconds m_delay;
+
+    int m_listenFd;
+    uint16_t m_port;
+    std::thread m_acceptThread;
+
+    std::mutex m_sessionsMut;
+    std::list<std::unique_ptr<Session>> m_sessions;
+
+    void acceptLoop();
+    void startPipe(Pipe &pipe, int from, int to);
+    void readLoop(Pipe &pipe);
+    void writeLoop(Pipe &pipe);
+};
+
+#endif // !FUSE_BENCH_LATENCYPROXY_H
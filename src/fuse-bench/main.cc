@@ -0,0 +1,174 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <thread>
+
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <fmt/core.h>
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QJsonDocument>
+#include <QLoggingCategory>
+
+#include "Benchmark.h"
+#include "LatencyProxy.h"
+
+#include "Fuse/FuseServer.h"
+#include "Fuse/FuseClient.h"
+
+namespace fs = std::filesystem;
+
+// FuseClient 挂载在后台线程完成，通过挂载点所在设备的变化判断是否已挂载
+static bool waitForMount(const fs::path &mountpoint, std::chrono::seconds timeout) {
+    struct stat parent;
+    if (stat(mountpoint.parent_path().c_str(), &parent) == -1) {
+        return false;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (std::chrono::steady_clock::now() < deadline) {
+        struct stat st;
+        if (stat(mountpoint.c_str(), &st) == 0 && st.st_dev != parent.st_dev) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    return false;
+}
+
+// 和 daemon 一样提高描述符限制，否则大目录的 stat 测试会很快用完 FuseServer 的节点额度
+static void raiseFdLimit() {
+    struct rlimit rlim;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+        rlim.rlim_cur = rlim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    raiseFdLimit();
+
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Loopback benchmark for the remote filesystem");
+    parser.addHelpOption();
+    QCommandLineOption filesOpt("files", "Number of files in the big directory.", "n", "10000");
+    QCommandLineOption sizeOpt("file-size", "Size of the read test file in MiB.", "mib", "64");
+    QCommandLineOption opsOpt("ops", "Operations for stat and random read tests.", "n", "20000");
+    QCommandLineOption threadsOpt("threads", "Readers in the parallel read test.", "n", "4");
+    QCommandLineOption rttOpt("rtt", "Inject this round trip time in milliseconds.", "ms", "0");
+    QCommandLineOption cacheOpt("cache-size", "Enable the block cache with this size in MiB.", "mib", "0");
+    QCommandLineOption outputOpt("output", "Write the JSON report to this file.", "path");
+    QCommandLineOption verboseOpt("verbose", "Keep debug logs of the server and client.");
+    parser.addOptions({filesOpt, sizeOpt, opsOpt, threadsOpt, rttOpt, cacheOpt, outputOpt, verboseOpt});
+    parser.process(app);
+
+    // 服务端和客户端每个请求都会打日志，测试时关掉以免影响结果
+    if (!parser.isSet(verboseOpt)) {
+        QLoggingCategory::setFilterRules("*.debug=false\n*.info=false");
+    }
+
+    Benchmark::Options options;
+    options.files = std::max(1u, parser.value(filesOpt).toUInt());
+    options.fileSize = std::max(1ull, parser.value(sizeOpt).toULongLong()) * 1024 * 1024;
+    options.ops = std::max(1u, parser.value(opsOpt).toUInt());
+    options.threads = std::max(1u, parser.value(threadsOpt).toUInt());
+    unsigned int rtt = parser.value(rttOpt).toUInt();
+    uint64_t cacheSize = parser.value(cacheOpt).toULongLong() * 1024 * 1024;
+
+    std::string tmpl = (fs::temp_directory_path() / "dde-cooperation-fuse-bench.XXXXXX").string();
+    if (!mkdtemp(tmpl.data())) {
+        qWarning("failed to create temp dir");
+        return 1;
+    }
+    const fs::path workDir = tmpl;
+    const fs::path treeDir = workDir / "tree";
+    const fs::path mountDir = workDir / "mnt";
+    fs::create_directories(mountDir);
+
+    Benchmark bench(options);
+    if (!bench.prepare(treeDir)) {
+        fs::remove_all(workDir);
+        return 1;
+    }
+
+    // 客户端和延迟代理都从本机连接
+    auto server = std::make_unique<FuseServer>(std::weak_ptr<Machine>(), "127.0.0.1", treeDir);
+    uint16_t port = server->port();
+
+    std::unique_ptr<LatencyProxy> proxy;
+    if (rtt > 0) {
+        proxy = std::make_unique<LatencyProxy>(port, std::chrono::milliseconds(rtt));
+        port = proxy->port();
+    }
+
+    std::unique_ptr<BlockCache> cache;
+    if (cacheSize > 0) {
+        cache = std::make_unique<BlockCache>(workDir / "cache", cacheSize);
+    }
+    auto client = std::make_unique<FuseClient>("127.0.0.1", mountDir, std::move(cache));
+    client->setRemote(port, server->token());
+
+    // 测试在单独的线程中进行，主线程运行事件循环，服务端依赖它接收连接
+    QJsonArray results;
+    bool mounted = false;
+    std::thread runner([&] {
+        mounted = waitForMount(mountDir, std::chrono::seconds(10));
+        if (mounted) {
+            results = bench.run(mountDir);
+        } else {
+            qWarning("mount timed out");
+        }
+        QMetaObject::invokeMethod(&app, &QCoreApplication::quit, Qt::QueuedConnection);
+    });
+
+    app.exec();
+    runner.join();
+
+    client.reset();
+    proxy.reset();
+    server.reset();
+    fs::remove_all(workDir);
+
+    if (!mounted) {
+        return 1;
+    }
+
+    QJsonObject config;
+    config["files"] = static_cast<qint64>(options.files);
+    config["file_size"] = static_cast<qint64>(options.fileSize);
+    config["ops"] = static_cast<qint64>(options.ops);
+    config["threads"] = static_cast<int>(options.threads);
+    config["rtt_ms"] = static_cast<int>(rtt);
+    config["cache_size"] = static_cast<qint64>(cacheSize);
+
+    QJsonObject report;
+    report["config"] = config;
+    report["results"] = results;
+    QByteArray json = QJsonDocument(report).toJson();
+
+    if (parser.isSet(outputOpt)) {
+        QFile file(parser.value(outputOpt));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            qWarning() << "failed to write" << file.fileName();
+            return 1;
+        }
+        file.write(json);
+    } else {
+        fmt::print("{}", json.toStdString());
+    }
+
+    return 0;
+}
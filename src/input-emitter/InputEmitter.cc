@@ -4,12 +4,16 @@
 
 #include "InputEmitter.h"
 
+#include <unistd.h>
+#include <string.h>
+
 #include <fmt/core.h>
 
 #include <libevdev/libevdev.h>
 #include <libevdev/libevdev-uinput.h>
 
 #include <QDebug>
+#include <QTimer>
 
 #include "utils/ptr.h"
 
@@ -23,7 +27,10 @@
 
 InputEmitter::InputEmitter(InputDeviceType type)
     : m_dev(make_handle(libevdev_new(), &libevdev_free))
-    , m_uidev(nullptr, &libevdev_uinput_destroy) {
+    , m_uidev(nullptr, &libevdev_uinput_destroy)
+    , m_repeatDelay(0)
+    , m_repeatInterval(0)
+    , m_repeatKey(0) {
     std::string name = std::string("DDE Cooperation ");
 
     enableEventType(EV_SYN);
@@ -43,6 +50,11 @@ InputEmitter::InputEmitter(InputDeviceType type)
         for (unsigned int code = 0; code < REP_MAX; code++) {
             enableEventCode(EV_REP, code);
         }
+
+        m_repeatTimer = std::make_unique<QTimer>();
+        m_repeatTimer->setSingleShot(true);
+        m_repeatTimer->setTimerType(Qt::PreciseTimer);
+        QObject::connect(m_repeatTimer.get(), &QTimer::timeout, [this]() { repeat(); });
     } break;
     case InputDeviceType::MOUSE: {
         name += "Mouse";
@@ -152,3 +164,101 @@ bool InputEmitter::emitEvent(unsigned int type, unsigned int code, int value) {
 
     return true;
 }
+
+bool InputEmitter::emitFrame(const std::vector<input_event> &frame) {
+    if (!m_uidev) {
+        return false;
+    }
+
+    if (!m_repeatTimer || m_repeatDelay == 0) {
+        return write(frame);
+    }
+
+    // 本端生成按键重复时丢弃对端发来的重复事件
+    m_filtered.clear();
+    for (const auto &ev : frame) {
+        if (ev.type != EV_KEY || ev.value != 2) {
+            m_filtered.push_back(ev);
+        }
+    }
+    if (m_filtered.size() == 1) {
+        return true;
+    }
+
+    if (!write(m_filtered)) {
+        return false;
+    }
+
+    trackRepeat(m_filtered);
+    return true;
+}
+
+void InputEmitter::setKeyRepeat(uint32_t delay, uint32_t interval) {
+    if (!m_repeatTimer) {
+        return;
+    }
+
+    qInfo() << fmt::format("key repeat: delay {}ms, interval {}ms", delay, interval).data();
+    m_repeatDelay = interval == 0 ? 0 : delay;
+    m_repeatInterval = interval;
+
+    if (m_repeatDelay == 0) {
+        m_repeatTimer->stop();
+    } else if (m_repeatKey != 0 && !m_repeatTimer->isActive()) {
+        m_repeatTimer->start(m_repeatDelay);
+    }
+}
+
+void InputEmitter::reset() {
+    m_repeatKey = 0;
+    if (m_repeatTimer) {
+        m_repeatTimer->stop();
+    }
+}
+
+void InputEmitter::trackRepeat(const std::vector<input_event> &frame) {
+    for (const auto &ev : frame) {
+        if (ev.type != EV_KEY) {
+            continue;
+        }
+
+        // 和内核一样只重复最后按下的键
+        if (ev.value == 1) {
+            m_repeatKey = ev.code;
+            m_repeatTimer->start(m_repeatDelay);
+        } else if (ev.value == 0 && ev.code == m_repeatKey) {
+            m_repeatKey = 0;
+            m_repeatTimer->stop();
+        }
+    }
+}
+
+void InputEmitter::repeat() {
+    if (m_repeatKey == 0 || m_repeatDelay == 0) {
+        return;
+    }
+
+    std::vector<input_event> frame(2);
+    frame[0].type = EV_KEY;
+    frame[0].code = m_repeatKey;
+    frame[0].value = 2;
+    frame[1].type = EV_SYN;
+    frame[1].code = SYN_REPORT;
+    frame[1].value = 0;
+    write(frame);
+
+    m_repeatTimer->start(m_repeatInterval);
+}
+
+bool InputEmitter::write(const std::vector<input_event> &frame) {
+    // uinput 会为每个事件重新打时间戳，这里不需要填写
+    size_t size = frame.size() * sizeof(input_event);
+    ssize_t n = ::write(libevdev_uinput_get_fd(m_uidev.get()), frame.data(), size);
+    if (n != static_cast<ssize_t>(size)) {
+        qWarning() << fmt::format("failed to write frame: {}", n == -1 ? strerror(errno) : "short write")
+                          .data();
+        return false;
+    }
+
+    return true;
+}
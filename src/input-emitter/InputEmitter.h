@@ -7,24 +7,45 @@
 
 #include <string>
 #include <memory>
+#include <vector>
 
 #include <libevdev/libevdev-uinput.h>
 
 #include "common.h"
 
+class QTimer;
+
 class InputEmitter {
 public:
     explicit InputEmitter(InputDeviceType type);
     ~InputEmitter();
 
     bool emitEvent(unsigned int type, unsigned int code, int value);
+    // 一次 write() 写入整帧事件
+    bool emitFrame(const std::vector<input_event> &frame);
+
+    // 按对端的设置生成按键重复，delay 为 0 时关闭，仅键盘有效
+    void setKeyRepeat(uint32_t delay, uint32_t interval);
+    // 停止正在进行的按键重复
+    void reset();
 
 private:
     std::unique_ptr<libevdev, decltype(&libevdev_free)> m_dev;
     std::unique_ptr<libevdev_uinput, decltype(&libevdev_uinput_destroy)> m_uidev;
 
+    // 按键重复
+    std::unique_ptr<QTimer> m_repeatTimer;
+    uint32_t m_repeatDelay;
+    uint32_t m_repeatInterval;
+    // 最后按下且尚未松开的键，0 表示没有
+    unsigned int m_repeatKey;
+    std::vector<input_event> m_filtered;
+
     void enableEventType(unsigned int type);
     void enableEventCode(unsigned int type, unsigned int code, const void *data = nullptr);
+    bool write(const std::vector<input_event> &frame);
+    void trackRepeat(const std::vector<input_event> &frame);
+    void repeat();
 };
 
 #endif // !INPUTEMITOR_H
@@ -5,12 +5,20 @@
 #include <QCoreApplication>
 
 #include <QLocalSocket>
+#include <QSocketNotifier>
+#include <QTimer>
 
 #include "InputEmitter.h"
 
+#include "utils/latency.h"
 #include "utils/message_helper.h"
+#include "utils/shm_ring.h"
 #include "protocol/ipc_message.pb.h"
 
+// 延迟样本攒够一秒再报给 daemon，样本过多时丢弃后来的
+static constexpr int latencyReportInterval = 1000;
+static constexpr int maxLatencySamples = 4096;
+
 int main(int argc, char *argv[]) {
     QCoreApplication::setSetuidAllowed(true);
     QCoreApplication app(argc, argv);
@@ -27,8 +35,61 @@ int main(int argc, char *argv[]) {
     InputDeviceType type = static_cast<InputDeviceType>(args[2].toUInt());
     InputEmitter emitter(type);
 
+    // 复用同一块缓冲区，避免每帧分配
+    std::vector<input_event> frame;
+
     QLocalSocket socket;
-    QObject::connect(&socket, &QLocalSocket::readyRead, [&emitter, &socket]() {
+
+    // 事件按 SYN_REPORT 分帧写入
+    std::unique_ptr<ShmRing<InputRingEvent>> ring;
+    std::vector<input_event> ringFrame;
+
+    InputEmitterChild latencyMsg;
+    auto *latency = latencyMsg.mutable_latency();
+    auto recordLatency = [latency](int64_t timestamp, int64_t sendTime) {
+        if (latency->emitlatency_size() >= maxLatencySamples) {
+            return;
+        }
+
+        int64_t now = Latency::now();
+        latency->add_emitlatency(Latency::toUs(now - sendTime));
+        if (timestamp != 0) {
+            latency->add_totallatency(Latency::toUs(now - timestamp));
+        }
+    };
+
+    QTimer latencyTimer;
+    QObject::connect(&latencyTimer, &QTimer::timeout, [&socket, &latencyMsg, latency]() {
+        if (latency->emitlatency_size() == 0) {
+            return;
+        }
+        socket.write(MessageHelper::genMessage(latencyMsg));
+        latency->Clear();
+    });
+    latencyTimer.start(latencyReportInterval);
+
+    auto drainRing = [&emitter, &ring, &ringFrame, &recordLatency]() {
+        if (!ring) {
+            return;
+        }
+
+        ring->drain([&emitter, &ringFrame, &recordLatency](const InputRingEvent &ringEvent) {
+            input_event ev{};
+            ev.type = ringEvent.type;
+            ev.code = ringEvent.code;
+            ev.value = ringEvent.value;
+            ringFrame.push_back(ev);
+
+            if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+                if (emitter.emitFrame(ringFrame)) {
+                    recordLatency(ringEvent.timestamp, ringEvent.sendTime);
+                }
+                ringFrame.clear();
+            }
+        });
+    };
+
+    QObject::connect(&socket, &QLocalSocket::readyRead, [&emitter, &socket, &frame, &recordLatency, &drainRing]() {
         while (socket.size() >= header_size) {
             QByteArray buffer = socket.peek(header_size);
             auto header = MessageHelper::parseMessageHeader(buffer);
@@ -50,9 +111,35 @@ int main(int argc, char *argv[]) {
                                                                             buffer.size());
 
             switch (base.payload_case()) {
-            case InputEmitterParent::PayloadCase::kInputEvent: {
-                auto &inputEvent = base.inputevent();
-                emitter.emitEvent(inputEvent.type(), inputEvent.code(), inputEvent.value());
+            case InputEmitterParent::PayloadCase::kFrame: {
+                // 队列满时 daemon 改走 socket，队列中的帧更早，需要先处理
+                drainRing();
+
+                frame.clear();
+                for (const auto &inputEvent : base.frame().events()) {
+                    input_event ev{};
+                    ev.type = inputEvent.type();
+                    ev.code = inputEvent.code();
+                    ev.value = inputEvent.value();
+                    frame.push_back(ev);
+                }
+                if (emitter.emitFrame(frame)) {
+                    recordLatency(base.frame().timestamp(), base.frame().sendtime());
+                }
+
+                if (base.frame().serial() != 0) {
+                    InputEmitterChild ack;
+                    ack.mutable_frameack()->set_serial(base.frame().serial());
+                    socket.write(MessageHelper::genMessage(ack));
+                }
+            } break;
+            case InputEmitterParent::PayloadCase::kKeyRepeat: {
+                emitter.setKeyRepeat(base.keyrepeat().delay(), base.keyrepeat().interval());
+            } break;
+            case InputEmitterParent::PayloadCase::kReset: {
+                // 先处理队列中松开按键的帧
+                drainRing();
+                emitter.reset();
             } break;
             case InputEmitterParent::PayloadCase::PAYLOAD_NOT_SET: {
             } break;
@@ -61,6 +148,24 @@ int main(int argc, char *argv[]) {
     });
     QObject::connect(&socket, &QLocalSocket::disconnected, [&app]() { app.quit(); });
     socket.connectToServer(addr);
+    if (!socket.waitForConnected(1000)) {
+        qWarning() << "failed to connect to daemon:" << socket.errorString();
+        return 1;
+    }
+
+    // daemon 在连接建立后首先发来共享内存队列，必须在 QLocalSocket 读取数据之前取出
+    auto fds = ShmRingHelper::recvFds(socket.socketDescriptor(), 2, 1000);
+    if (fds.size() == 2) {
+        ring = ShmRing<InputRingEvent>::attach(fds[0], fds[1]);
+    }
+
+    std::unique_ptr<QSocketNotifier> notifier;
+    if (ring) {
+        notifier = std::make_unique<QSocketNotifier>(ring->eventfd(), QSocketNotifier::Read);
+        QObject::connect(notifier.get(), &QSocketNotifier::activated, drainRing);
+    } else {
+        qWarning("shared memory ring unavailable, fall back to socket");
+    }
 
     return app.exec();
 }
@@ -6,33 +6,51 @@
 
 #include <filesystem>
 
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+
+#include <linux/input.h>
 
 #include <fmt/core.h>
 
 #include <libevdev/libevdev.h>
 
 #include <QDebug>
-#include <QCoreApplication>
 
 namespace fs = std::filesystem;
 
+// 只有这些类型的事件会被转发给对端
+static constexpr unsigned int forwardedTypes[] = {EV_SYN, EV_KEY, EV_REL, EV_ABS};
+
 InputGrabber::InputGrabber(const fs::path &path)
     : m_path(path)
-    , m_fd(open(m_path.c_str(), O_RDONLY | O_NONBLOCK))
-    , m_notifier(new QSocketNotifier(m_fd, QSocketNotifier::Type::Read, this)) {
+    , m_fd(open(m_path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC))
+    , m_dev(nullptr)
+    , m_type(static_cast<InputDeviceType>(0)) {
+    if (m_fd == -1) {
+        qWarning() << fmt::format("failed to open {}: {}", m_path.string(), strerror(errno)).data();
+        return;
+    }
 
     int rc = libevdev_new_from_fd(m_fd, &m_dev);
     if (rc < 0) {
         qCritical() << fmt::format("failed to init libevdev {}", strerror(-rc)).data();
-        qApp->quit();
+        m_dev = nullptr;
+        return;
     }
 
     m_name = libevdev_get_name(m_dev);
 
+    // 内核时间戳默认是 CLOCK_REALTIME，换成单调时钟才能和各环节的时刻相减
+    rc = libevdev_set_clock_id(m_dev, CLOCK_MONOTONIC);
+    if (rc < 0) {
+        qWarning() << fmt::format("failed to set clock id: {}", strerror(-rc)).data();
+    }
+
     if (libevdev_has_event_type(m_dev, EV_KEY) && libevdev_has_event_type(m_dev, EV_REP)) {
         m_type = InputDeviceType::KEYBOARD;
     } else if (libevdev_has_event_type(m_dev, EV_REL) &&
@@ -43,18 +61,21 @@ InputGrabber::InputGrabber(const fs::path &path)
         m_type = InputDeviceType::TOUCHPAD;
     }
 
-    m_notifier->setEnabled(false);
-    connect(m_notifier, &QSocketNotifier::activated, this, &InputGrabber::handlePollEvent);
+    setEventMask();
 }
 
 InputGrabber::~InputGrabber() {
-    qDebug() << "InputDevice::~InputDevice()" << m_name;
-    libevdev_free(m_dev);
-    close(m_fd);
+    qDebug() << "InputDevice::~InputDevice()" << m_name.c_str();
+    if (m_dev) {
+        libevdev_free(m_dev);
+    }
+    if (m_fd != -1) {
+        close(m_fd);
+    }
 }
 
-bool InputGrabber::shouldIgnore() {
-    if (m_name.startsWith("DDE Cooperation")) {
+bool InputGrabber::shouldIgnore() const {
+    if (!m_dev || m_name.rfind("DDE Cooperation", 0) == 0) {
         return true;
     }
 
@@ -67,41 +88,64 @@ bool InputGrabber::shouldIgnore() {
     return true;
 }
 
-void InputGrabber::start() {
+void InputGrabber::setEventMask() {
+    // type 为 EV_SYN 时掩码按事件类型设置，在内核中丢弃 EV_MSC、EV_LED 等用不到的事件
+    uint8_t types[EV_CNT / 8 + 1] = {};
+    for (unsigned int type : forwardedTypes) {
+        types[type / 8] |= 1 << (type % 8);
+    }
+
+    input_mask mask{};
+    mask.type = EV_SYN;
+    mask.codes_size = sizeof(types);
+    mask.codes_ptr = reinterpret_cast<uintptr_t>(types);
+    if (ioctl(m_fd, EVIOCSMASK, &mask) == -1) {
+        qDebug() << fmt::format("EVIOCSMASK unsupported: {}", strerror(errno)).data();
+    }
+}
+
+void InputGrabber::grab() {
     // clear already existed events
     input_event ev;
     while (-EAGAIN != libevdev_next_event(m_dev, LIBEVDEV_READ_FLAG_NORMAL, &ev))
         ;
-
-    m_notifier->setEnabled(true);
+    m_frame.clear();
 
     int rc = libevdev_grab(m_dev, LIBEVDEV_GRAB);
     if (rc != 0) {
         qWarning() << fmt::format("failed to grab device {}", strerror(-rc)).data();
-        return;
     }
 }
 
-void InputGrabber::stop() {
-    qDebug() << "stopping input device:" << m_name;
-    m_notifier->setEnabled(false);
+void InputGrabber::ungrab() {
+    qDebug() << "stopping input device:" << m_name.c_str();
     libevdev_grab(m_dev, LIBEVDEV_UNGRAB);
-    qDebug("stopped");
 }
 
-void InputGrabber::handlePollEvent() {
+bool InputGrabber::readFrames(
+    const std::function<void(const std::vector<input_event> &frame)> &cb) {
     input_event ev;
     int rc;
     do {
         rc = libevdev_next_event(m_dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
         if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-            qDebug() << fmt::format("event: {}, {}, {}",
-                                    libevdev_event_type_get_name(ev.type),
-                                    libevdev_event_code_get_name(ev.type, ev.code),
-                                    ev.value)
-                            .data();
-
-            m_onEvent(ev.type, ev.code, ev.value);
+            // 按键重复由接收端生成
+            if (ev.type == EV_KEY && ev.value == 2) {
+                continue;
+            }
+
+            // 只剩下 SYN_REPORT 的帧不需要转发
+            if (ev.type == EV_SYN && ev.code == SYN_REPORT && m_frame.empty()) {
+                continue;
+            }
+
+            m_frame.push_back(ev);
+            if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+                cb(m_frame);
+                m_frame.clear();
+            }
         }
-    } while (rc != -EAGAIN);
+    } while (rc == LIBEVDEV_READ_STATUS_SUCCESS || rc == LIBEVDEV_READ_STATUS_SYNC);
+
+    return rc == -EAGAIN;
 }
@@ -6,52 +6,47 @@
 #define INPUTEGRABBER_H
 
 #include <filesystem>
-#include <thread>
 #include <functional>
+#include <string>
+#include <vector>
 
 #include <libevdev/libevdev.h>
 
-#include <QObject>
-#include <QSocketNotifier>
-
 #include "common.h"
 
-class QSocketNotifier;
-
-class Machine;
-
-class InputGrabber : public QObject {
-    Q_OBJECT
-
+// 单个 /dev/input/event* 设备，由 InputGrabbers 统一用 epoll 监听
+class InputGrabber {
 public:
     explicit InputGrabber(const std::filesystem::path &path);
     ~InputGrabber();
 
-    bool shouldIgnore();
+    bool valid() const { return m_dev != nullptr; }
+    bool shouldIgnore() const;
 
-    void onEvent(const std::function<void(unsigned int type, unsigned int code, int value)> &cb) {
-        m_onEvent = cb;
-    }
+    int fd() const { return m_fd; }
+    const std::filesystem::path &path() const { return m_path; }
+    const std::string &name() const { return m_name; }
+    InputDeviceType type() const { return m_type; };
 
-    void start();
-    void stop();
+    void grab();
+    void ungrab();
 
-    InputDeviceType type() { return m_type; };
+    // 读出所有就绪的事件，每遇到 SYN_REPORT 回调一次整帧，设备已被移除时返回 false
+    bool readFrames(const std::function<void(const std::vector<input_event> &frame)> &cb);
 
 private:
-    const std::filesystem::path &m_path;
+    const std::filesystem::path m_path;
     int m_fd;
 
-    QSocketNotifier *m_notifier;
-
     libevdev *m_dev;
 
-    QString m_name;
+    std::string m_name;
     InputDeviceType m_type;
 
-    std::function<void(unsigned int type, unsigned int code, int value)> m_onEvent;
+    // 尚未收到 SYN_REPORT 的事件
+    std::vector<input_event> m_frame;
 
-    void handlePollEvent();
+    void setEventMask();
 };
 
 #endif // !INPUTEGRABBER_H
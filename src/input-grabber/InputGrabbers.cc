@@ -0,0 +1,262 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "InputGrabbers.h"
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <fmt/core.h>
+
+#include <libudev.h>
+
+#include <QDebug>
+#include <QSocketNotifier>
+
+// epoll 事件中的 data.u64 为设备序号，0 保留给 udev monitor
+static constexpr uint32_t udevId = 0;
+static constexpr int maxEpollEvents = 16;
+
+static bool isEventNode(const char *devnode) {
+    return devnode && strncmp(devnode, "/dev/input/event", strlen("/dev/input/event")) == 0;
+}
+
+static bool hasProperty(udev_device *dev, const char *key) {
+    const char *value = udev_device_get_property_value(dev, key);
+    return value && strcmp(value, "1") == 0;
+}
+
+// 按 udev input_id 的分类结果过滤，不需要逐个打开设备探测
+static bool shouldGrab(udev_device *dev) {
+    if (!hasProperty(dev, "ID_INPUT_KEYBOARD") && !hasProperty(dev, "ID_INPUT_MOUSE") &&
+        !hasProperty(dev, "ID_INPUT_TOUCHPAD")) {
+        return false;
+    }
+
+    // 跳过 input-emitter 创建的虚拟设备
+    udev_device *parent = udev_device_get_parent(dev);
+    const char *name = parent ? udev_device_get_sysattr_value(parent, "name") : nullptr;
+    return !name || strncmp(name, "DDE Cooperation", strlen("DDE Cooperation")) != 0;
+}
+
+InputGrabbers::InputGrabbers(QObject *parent)
+    : QObject(parent)
+    , m_epfd(epoll_create1(EPOLL_CLOEXEC))
+    , m_udev(udev_new())
+    , m_monitor(nullptr)
+    , m_notifier(nullptr)
+    , m_grabbing(false)
+    , m_nextId(udevId + 1) {
+    if (m_epfd == -1) {
+        qCritical() << fmt::format("epoll_create1 failed: {}", strerror(errno)).data();
+        return;
+    }
+
+    if (!m_udev) {
+        qCritical("udev_new failed");
+        return;
+    }
+
+    // 只接收 udev 处理完规则之后的消息，此时设备节点的权限已经设置好
+    m_monitor = udev_monitor_new_from_netlink(m_udev, "udev");
+    if (m_monitor && udev_monitor_filter_add_match_subsystem_devtype(m_monitor, "input", nullptr) >= 0 &&
+        udev_monitor_enable_receiving(m_monitor) >= 0) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = udevId;
+        epoll_ctl(m_epfd, EPOLL_CTL_ADD, udev_monitor_get_fd(m_monitor), &ev);
+    } else {
+        qWarning("failed to monitor udev input devices, hotplug disabled");
+    }
+
+    m_notifier = new QSocketNotifier(m_epfd, QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &InputGrabbers::handleEpoll);
+}
+
+InputGrabbers::~InputGrabbers() {
+    m_devices.clear();
+
+    if (m_monitor) {
+        udev_monitor_unref(m_monitor);
+    }
+    if (m_udev) {
+        udev_unref(m_udev);
+    }
+    if (m_epfd != -1) {
+        close(m_epfd);
+    }
+}
+
+void InputGrabbers::scan() {
+    if (!m_udev) {
+        return;
+    }
+
+    udev_enumerate *enumerate = udev_enumerate_new(m_udev);
+    udev_enumerate_add_match_subsystem(enumerate, "input");
+    udev_enumerate_add_match_sysname(enumerate, "event*");
+    udev_enumerate_scan_devices(enumerate);
+
+    udev_list_entry *entry;
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+        udev_device *dev = udev_device_new_from_syspath(m_udev, udev_list_entry_get_name(entry));
+        if (dev) {
+            addDevice(dev);
+            udev_device_unref(dev);
+        }
+    }
+
+    udev_enumerate_unref(enumerate);
+}
+
+void InputGrabbers::start() {
+    m_grabbing = true;
+    for (auto &[id, device] : m_devices) {
+        device->grab();
+        watchDevice(id, *device);
+    }
+}
+
+void InputGrabbers::stop() {
+    m_grabbing = false;
+    for (auto &[id, device] : m_devices) {
+        device->ungrab();
+        watchDevice(id, *device);
+    }
+}
+
+void InputGrabbers::watchDevice(uint32_t id, const InputGrabber &device) {
+    // 未抓取时不读取事件，本机的输入不会发给 daemon，EPOLLHUP 和 EPOLLERR 仍会上报
+    epoll_event ev{};
+    ev.events = m_grabbing ? EPOLLIN : 0;
+    ev.data.u64 = id;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_MOD, device.fd(), &ev) == -1) {
+        qWarning() << fmt::format("failed to update watch of {}: {}",
+                                  device.path().string(),
+                                  strerror(errno))
+                          .data();
+    }
+}
+
+void InputGrabbers::handleEpoll() {
+    epoll_event events[maxEpollEvents];
+    int n = epoll_wait(m_epfd, events, maxEpollEvents, 0);
+    for (int i = 0; i < n; i++) {
+        uint32_t id = static_cast<uint32_t>(events[i].data.u64);
+        if (id == udevId) {
+            handleUdev();
+            continue;
+        }
+
+        // 同一批中前面的 udev 消息可能已经移除了该设备
+        auto it = m_devices.find(id);
+        if (it == m_devices.end()) {
+            continue;
+        }
+
+        // 停止抓取前已经就绪的事件直接丢弃，grab() 时会清空
+        if (!m_grabbing) {
+            if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                removeDevice(id);
+            }
+            continue;
+        }
+
+        auto type = it->second->type();
+        bool alive = it->second->readFrames([this, id, type](const std::vector<input_event> &frame) {
+            if (m_frameCb) {
+                m_frameCb(id, type, frame);
+            }
+        });
+        if (!alive || (events[i].events & (EPOLLHUP | EPOLLERR))) {
+            removeDevice(id);
+        }
+    }
+}
+
+void InputGrabbers::handleUdev() {
+    udev_device *dev;
+    while ((dev = udev_monitor_receive_device(m_monitor)) != nullptr) {
+        const char *action = udev_device_get_action(dev);
+        const char *devnode = udev_device_get_devnode(dev);
+
+        if (action && isEventNode(devnode)) {
+            if (strcmp(action, "add") == 0) {
+                addDevice(dev);
+            } else if (strcmp(action, "remove") == 0) {
+                removeDevice(devnode);
+            }
+        }
+
+        udev_device_unref(dev);
+    }
+}
+
+void InputGrabbers::addDevice(udev_device *dev) {
+    const char *devnode = udev_device_get_devnode(dev);
+    if (!isEventNode(devnode) || !shouldGrab(dev)) {
+        return;
+    }
+
+    std::string path = devnode;
+    for (auto &[id, device] : m_devices) {
+        if (device->path() == path) {
+            return;
+        }
+    }
+
+    auto device = std::make_unique<InputGrabber>(path);
+    if (device->shouldIgnore()) {
+        return;
+    }
+
+    uint32_t id = m_nextId++;
+    epoll_event ev{};
+    ev.events = m_grabbing ? EPOLLIN : 0;
+    ev.data.u64 = id;
+    if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, device->fd(), &ev) == -1) {
+        qWarning() << fmt::format("failed to watch {}: {}", path, strerror(errno)).data();
+        return;
+    }
+
+    qInfo() << fmt::format("input device added: {} {} ({})", id, device->name(), path).data();
+
+    if (m_grabbing) {
+        device->grab();
+    }
+
+    auto type = device->type();
+    auto name = device->name();
+    m_devices.emplace(id, std::move(device));
+
+    if (m_deviceAddedCb) {
+        m_deviceAddedCb(id, type, name);
+    }
+}
+
+void InputGrabbers::removeDevice(uint32_t id) {
+    auto it = m_devices.find(id);
+    if (it == m_devices.end()) {
+        return;
+    }
+
+    qInfo() << fmt::format("input device removed: {} {}", id, it->second->name()).data();
+
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, it->second->fd(), nullptr);
+    m_devices.erase(it);
+
+    if (m_deviceRemovedCb) {
+        m_deviceRemovedCb(id);
+    }
+}
+
+void InputGrabbers::removeDevice(const std::string &path) {
+    for (auto &[id, device] : m_devices) {
+        if (device->path() == path) {
+            removeDevice(id);
+            return;
+        }
+    }
+}
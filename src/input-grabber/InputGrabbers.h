@@ -0,0 +1,72 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef INPUT_GRABBER_INPUTGRABBERS_H
+#define INPUT_GRABBER_INPUTGRABBERS_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <QObject>
+
+#include "InputGrabber.h"
+
+class QSocketNotifier;
+struct udev;
+struct udev_device;
+struct udev_monitor;
+
+// 在一个进程中打开所有输入设备，用 epoll 统一监听。
+// 热插拔通过 udev 的 netlink 消息逐个处理，设备类型直接取 udev 数据库中已分类好的属性，
+// 与共享无关的设备不会被打开
+class InputGrabbers : public QObject {
+    Q_OBJECT
+
+public:
+    explicit InputGrabbers(QObject *parent = nullptr);
+    ~InputGrabbers();
+
+    void onDeviceAdded(
+        const std::function<void(uint32_t id, InputDeviceType type, const std::string &name)> &cb) {
+        m_deviceAddedCb = cb;
+    }
+    void onDeviceRemoved(const std::function<void(uint32_t id)> &cb) { m_deviceRemovedCb = cb; }
+    void onFrame(const std::function<
+                 void(uint32_t id, InputDeviceType type, const std::vector<input_event> &frame)> &cb) {
+        m_frameCb = cb;
+    }
+
+    // 打开已有的键盘、鼠标和触控板
+    void scan();
+    void start();
+    void stop();
+
+private slots:
+    void handleEpoll();
+
+private:
+    int m_epfd;
+    udev *m_udev;
+    udev_monitor *m_monitor;
+    QSocketNotifier *m_notifier;
+
+    bool m_grabbing;
+    uint32_t m_nextId;
+    std::map<uint32_t, std::unique_ptr<InputGrabber>> m_devices;
+
+    std::function<void(uint32_t id, InputDeviceType type, const std::string &name)> m_deviceAddedCb;
+    std::function<void(uint32_t id)> m_deviceRemovedCb;
+    std::function<void(uint32_t id, InputDeviceType type, const std::vector<input_event> &frame)>
+        m_frameCb;
+
+    void handleUdev();
+    void watchDevice(uint32_t id, const InputGrabber &device);
+    void addDevice(udev_device *dev);
+    void removeDevice(uint32_t id);
+    void removeDevice(const std::string &path);
+};
+
+#endif // !INPUT_GRABBER_INPUTGRABBERS_H
@@ -5,9 +5,11 @@
 #include <QCoreApplication>
 #include <QLocalSocket>
 
-#include "InputGrabber.h"
+#include "InputGrabbers.h"
 
+#include "utils/latency.h"
 #include "utils/message_helper.h"
+#include "utils/shm_ring.h"
 #include "protocol/ipc_message.pb.h"
 
 int main(int argc, char *argv[]) {
@@ -15,22 +17,24 @@ int main(int argc, char *argv[]) {
     QCoreApplication app(argc, argv);
 
     auto args = app.arguments();
-    if (args.size() < 3) {
-        qWarning("3 args");
+    if (args.size() < 2) {
+        qWarning("2 args");
         return 1;
     }
 
     auto addr = args[1];
     qDebug() << "input-grabber LocalServer addr:" << addr;
-    auto path = args[2];
 
-    InputGrabber grabber(path.toStdString());
-    if (grabber.shouldIgnore()) {
-        return 2;
-    }
+    InputGrabbers grabbers;
+
+    // 队列满后改走 socket，直到 daemon 确认处理完最后一个经 socket 发出的帧，
+    // 期间的帧都走 socket，保证先后顺序
+    uint64_t fallbackSerial = 0;
+    uint64_t ackedSerial = 0;
+    uint64_t ringOverflows = 0;
 
     QLocalSocket socket;
-    QObject::connect(&socket, &QLocalSocket::readyRead, [&grabber, &socket]() {
+    QObject::connect(&socket, &QLocalSocket::readyRead, [&grabbers, &socket, &ackedSerial]() {
         while (socket.size() >= header_size) {
             QByteArray buffer = socket.peek(header_size);
             auto header = MessageHelper::parseMessageHeader(buffer);
@@ -53,32 +57,99 @@ int main(int argc, char *argv[]) {
 
             switch (base.payload_case()) {
             case InputGrabberParent::PayloadCase::kStart: {
-                grabber.start();
+                grabbers.start();
             } break;
             case InputGrabberParent::PayloadCase::kStop: {
-                grabber.stop();
+                grabbers.stop();
+            } break;
+            case InputGrabberParent::PayloadCase::kFrameAck: {
+                ackedSerial = base.frameack().serial();
             } break;
             case InputGrabberParent::PayloadCase::PAYLOAD_NOT_SET: {
             } break;
             }
         }
     });
-    QObject::connect(&socket, &QLocalSocket::connected, [&grabber, &socket]() {
+    QObject::connect(&socket, &QLocalSocket::disconnected, [&app]() { app.quit(); });
+    socket.connectToServer(addr);
+    if (!socket.waitForConnected(1000)) {
+        qWarning() << "failed to connect to daemon:" << socket.errorString();
+        return 1;
+    }
+
+    // daemon 在连接建立后首先发来共享内存队列，必须在 QLocalSocket 读取数据之前取出
+    std::unique_ptr<ShmRing<InputRingEvent>> ring;
+    auto fds = ShmRingHelper::recvFds(socket.socketDescriptor(), 2, 1000);
+    if (fds.size() == 2) {
+        ring = ShmRing<InputRingEvent>::attach(fds[0], fds[1]);
+    }
+    if (!ring) {
+        qWarning("shared memory ring unavailable, fall back to socket");
+    }
+
+    grabbers.onDeviceAdded([&socket](uint32_t id, InputDeviceType type, const std::string &name) {
         InputGrabberChild msg;
-        msg.set_devicetype(static_cast<uint8_t>(grabber.type()));
+        auto *deviceAdded = msg.mutable_deviceadded();
+        deviceAdded->set_device(id);
+        deviceAdded->set_type(static_cast<uint8_t>(type));
+        deviceAdded->set_name(name);
         socket.write(MessageHelper::genMessage(msg));
     });
-    QObject::connect(&socket, &QLocalSocket::disconnected, [&app]() { app.quit(); });
-    socket.connectToServer(addr);
+    grabbers.onDeviceRemoved([&socket](uint32_t id) {
+        InputGrabberChild msg;
+        msg.mutable_deviceremoved()->set_device(id);
+        socket.write(MessageHelper::genMessage(msg));
+    });
+    std::vector<InputRingEvent> ringFrame;
+    grabbers.onFrame([&socket, &ring, &ringFrame, &fallbackSerial, &ackedSerial, &ringOverflows](
+                         uint32_t id,
+                         InputDeviceType type,
+                         const std::vector<input_event> &frame) {
+        // SYN_REPORT 的时间戳即整帧的时间戳
+        const auto &syn = frame.back();
+        int64_t timestamp = static_cast<int64_t>(syn.input_event_sec) * 1000000000 +
+                            static_cast<int64_t>(syn.input_event_usec) * 1000;
+        int64_t sendTime = Latency::now();
+
+        if (ring && fallbackSerial == ackedSerial) {
+            ringFrame.clear();
+            for (const auto &ev : frame) {
+                ringFrame.push_back({id,
+                                     static_cast<uint8_t>(type),
+                                     ev.type,
+                                     ev.code,
+                                     ev.value,
+                                     timestamp,
+                                     sendTime});
+            }
+            if (ring->push(ringFrame.data(), ringFrame.size())) {
+                return;
+            }
+
+            // daemon 处理不过来，丢帧可能丢掉松开按键的事件，改走 socket
+            qWarning() << "shared memory ring full, fall back to socket, overflows:"
+                       << ++ringOverflows;
+        }
 
-    grabber.onEvent([&socket](unsigned int type, unsigned int code, int value) {
         InputGrabberChild msg;
-        auto *inputEvent = msg.mutable_inputevent();
-        inputEvent->set_type(type);
-        inputEvent->set_code(code);
-        inputEvent->set_value(value);
+        auto *inputFrame = msg.mutable_frame();
+        inputFrame->set_device(id);
+        inputFrame->set_timestamp(timestamp);
+        inputFrame->set_sendtime(sendTime);
+        if (ring) {
+            inputFrame->set_serial(++fallbackSerial);
+        }
+        for (const auto &ev : frame) {
+            auto *inputEvent = inputFrame->add_events();
+            inputEvent->set_type(ev.type);
+            inputEvent->set_code(ev.code);
+            inputEvent->set_value(ev.value);
+        }
         socket.write(MessageHelper::genMessage(msg));
     });
 
+    // 回调都设置好后再打开设备，保证已有设备都能通知到 daemon
+    grabbers.scan();
+
     return app.exec();
 }
@@ -0,0 +1,107 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef UTILS_LATENCY_H
+#define UTILS_LATENCY_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include <stdint.h>
+#include <time.h>
+
+namespace Latency {
+
+// 输入事件的时间戳统一使用 CLOCK_MONOTONIC，和 evdev 设置的内核时钟一致
+inline int64_t now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// 纳秒差值转换为微秒，时钟偏差估计不准导致为负时记为 0
+inline uint32_t toUs(int64_t ns) {
+    if (ns <= 0) {
+        return 0;
+    }
+    return static_cast<uint32_t>(std::min<int64_t>(ns / 1000, UINT32_MAX));
+}
+
+} // namespace Latency
+
+// 对数分桶的延迟直方图，单位微秒。
+// 16us 以下每 1us 一个桶，之后每个 2 的幂区间分为 8 个桶，相对误差不超过 12.5%
+class LatencyHistogram {
+public:
+    void record(uint32_t us) {
+        m_buckets[bucket(us)]++;
+        m_count++;
+        m_max = std::max(m_max, us);
+    }
+
+    void reset() {
+        m_buckets.fill(0);
+        m_count = 0;
+        m_max = 0;
+    }
+
+    uint64_t count() const { return m_count; }
+    uint32_t max() const { return m_max; }
+
+    // 返回所在桶的上界，不超过最大值
+    uint32_t percentile(double p) const {
+        if (m_count == 0) {
+            return 0;
+        }
+
+        auto target = static_cast<uint64_t>(std::ceil(p * m_count));
+        target = std::clamp<uint64_t>(target, 1, m_count);
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < m_buckets.size(); i++) {
+            seen += m_buckets[i];
+            if (seen >= target) {
+                return std::min(upperBound(i), m_max);
+            }
+        }
+        return m_max;
+    }
+
+private:
+    static constexpr int linearBuckets = 16;
+    static constexpr int subBucketBits = 3;
+    static constexpr int subBuckets = 1 << subBucketBits;
+    // 最高位从 4 到 31
+    static constexpr size_t bucketCount = linearBuckets + (32 - 4) * subBuckets;
+
+    std::array<uint64_t, bucketCount> m_buckets{};
+    uint64_t m_count = 0;
+    uint32_t m_max = 0;
+
+    static size_t bucket(uint32_t us) {
+        if (us < linearBuckets) {
+            return us;
+        }
+
+        int msb = 31 - __builtin_clz(us);
+        int shift = msb - subBucketBits;
+        size_t sub = (us >> shift) & (subBuckets - 1);
+        return linearBuckets + (msb - 4) * subBuckets + sub;
+    }
+
+    static uint32_t upperBound(size_t index) {
+        if (index < linearBuckets) {
+            return index;
+        }
+
+        int msb = (index - linearBuckets) / subBuckets + 4;
+        int shift = msb - subBucketBits;
+        uint64_t sub = (index - linearBuckets) % subBuckets;
+        uint64_t upper = ((subBuckets + sub + 1) << shift) - 1;
+        return static_cast<uint32_t>(std::min<uint64_t>(upper, UINT32_MAX));
+    }
+};
+
+#endif // !UTILS_LATENCY_H
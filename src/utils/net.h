@@ -6,10 +6,14 @@
 #define UTILS_NET_H
 
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
+#include <linux/sockios.h>
 
 #include <string>
 #include <QDebug>
@@ -58,6 +62,54 @@ inline void tcpSocketSetKeepAliveOption(int fd) {
     }
 }
 
+// 阻塞读取 size 字节，连接关闭、超时或出错时返回 false
+inline bool recvAll(int fd, void *buf, size_t size) {
+    char *p = static_cast<char *>(buf);
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// 阻塞发送 size 字节，不产生 SIGPIPE
+inline bool sendAll(int fd, const void *buf, size_t size, int flags = 0) {
+    const char *p = static_cast<const char *>(buf);
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, flags | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// 内核发送队列中尚未被对端确认的字节数
+inline int pendingSendBytes(int fd) {
+    int bytes = 0;
+    if (ioctl(fd, SIOCOUTQ, &bytes) != 0) {
+        return 0;
+    }
+
+    return bytes;
+}
+
 } // namespace Net
 
 #endif // !UTILS_NET_H
@@ -0,0 +1,320 @@
+// SPDX-FileCopyrightText: 2015 - 2023 UnionTech Software Technology Co., Ltd.
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef UTILS_SHM_RING_H
+#define UTILS_SHM_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+// 单生产者单消费者的无锁环形队列，数据放在 memfd 中由两个进程共享。
+// 生产者写入后只在消费者已进入睡眠时才敲 eventfd 门铃，
+// 消费者读空后先自旋一小段时间，自旋时长根据是否等到数据自适应调整。
+template <typename T>
+class ShmRing {
+    static_assert(std::is_trivially_copyable_v<T>);
+    static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+public:
+    // capacity 需为 2 的幂
+    static std::unique_ptr<ShmRing> create(uint32_t capacity) {
+        if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+            return nullptr;
+        }
+
+        int memfd = memfd_create("dde-cooperation-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (memfd == -1) {
+            return nullptr;
+        }
+
+        size_t size = mapSize(capacity);
+        // 封住大小，避免对端缩小文件导致本进程访问时 SIGBUS
+        if (ftruncate(memfd, size) == -1 ||
+            fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+            close(memfd);
+            return nullptr;
+        }
+
+        int efd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (efd == -1) {
+            close(memfd);
+            return nullptr;
+        }
+
+        auto ring = std::unique_ptr<ShmRing>(new ShmRing(memfd, efd));
+        if (!ring->map(size)) {
+            return nullptr;
+        }
+
+        auto *header = new (ring->m_header) Header;
+        header->capacity = capacity;
+        header->head.store(0);
+        header->tail.store(0);
+        header->sleeping.store(1);
+        ring->m_capacity = capacity;
+
+        return ring;
+    }
+
+    // 接管对端传来的 fd
+    static std::unique_ptr<ShmRing> attach(int memfd, int efd) {
+        auto ring = std::unique_ptr<ShmRing>(new ShmRing(memfd, efd));
+
+        struct stat st;
+        int seals = fcntl(memfd, F_GET_SEALS);
+        if (fstat(memfd, &st) == -1 || seals == -1 || !(seals & F_SEAL_SHRINK) ||
+            static_cast<size_t>(st.st_size) < sizeof(Header)) {
+            return nullptr;
+        }
+
+        if (!ring->map(st.st_size)) {
+            return nullptr;
+        }
+
+        uint32_t capacity = ring->m_header->capacity;
+        if (capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+            mapSize(capacity) != static_cast<size_t>(st.st_size)) {
+            return nullptr;
+        }
+        ring->m_capacity = capacity;
+
+        return ring;
+    }
+
+    ~ShmRing() {
+        if (m_header) {
+            munmap(m_header, m_mapSize);
+        }
+        if (m_memfd != -1) {
+            close(m_memfd);
+        }
+        if (m_eventfd != -1) {
+            close(m_eventfd);
+        }
+    }
+
+    int memfd() const { return m_memfd; }
+    int eventfd() const { return m_eventfd; }
+
+    // 生产者：一次写入一批数据，空间不足时全部丢弃并返回 false
+    bool push(const T *items, size_t n) {
+        uint32_t head = m_header->head.load(std::memory_order_relaxed);
+        uint32_t tail = m_header->tail.load(std::memory_order_acquire);
+        uint32_t used = head - tail;
+        if (used > m_capacity || m_capacity - used < n) {
+            return false;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            m_slots[(head + i) & (m_capacity - 1)] = items[i];
+        }
+
+        // 与消费者设置 sleeping 后检查 head 配对，二者至少有一方能看到对方的写入
+        m_header->head.store(head + n, std::memory_order_seq_cst);
+        if (m_header->sleeping.exchange(0, std::memory_order_seq_cst)) {
+            uint64_t one = 1;
+            [[maybe_unused]] ssize_t rc = write(m_eventfd, &one, sizeof(one));
+        }
+
+        return true;
+    }
+
+    // 消费者：在 eventfd 可读时调用，读出所有数据后返回
+    template <typename F>
+    void drain(F &&cb) {
+        uint64_t count;
+        [[maybe_unused]] ssize_t rc = read(m_eventfd, &count, sizeof(count));
+
+        m_header->sleeping.store(0, std::memory_order_relaxed);
+        while (true) {
+            if (popAll(cb)) {
+                continue;
+            }
+
+            if (spin()) {
+                m_spin = std::min(m_spin * 2 + std::chrono::microseconds(1), maxSpin);
+                continue;
+            }
+            m_spin /= 2;
+
+            m_header->sleeping.store(1, std::memory_order_seq_cst);
+            if (m_header->head.load(std::memory_order_seq_cst) ==
+                m_header->tail.load(std::memory_order_relaxed)) {
+                break;
+            }
+            m_header->sleeping.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct Header {
+        uint32_t capacity;
+        alignas(64) std::atomic<uint32_t> head;     // 只由生产者写
+        alignas(64) std::atomic<uint32_t> tail;     // 只由消费者写
+        alignas(64) std::atomic<uint32_t> sleeping; // 消费者等待门铃
+    };
+
+    static constexpr std::chrono::nanoseconds maxSpin = std::chrono::microseconds(50);
+
+    int m_memfd;
+    int m_eventfd;
+    Header *m_header;
+    T *m_slots;
+    size_t m_mapSize;
+    uint32_t m_capacity;
+    std::chrono::nanoseconds m_spin;
+
+    ShmRing(int memfd, int efd)
+        : m_memfd(memfd)
+        , m_eventfd(efd)
+        , m_header(nullptr)
+        , m_slots(nullptr)
+        , m_mapSize(0)
+        , m_capacity(0)
+        , m_spin(0) {}
+
+    static size_t mapSize(uint32_t capacity) {
+        return sizeof(Header) + static_cast<size_t>(capacity) * sizeof(T);
+    }
+
+    bool map(size_t size) {
+        void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_memfd, 0);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+
+        m_header = static_cast<Header *>(addr);
+        m_slots = reinterpret_cast<T *>(static_cast<char *>(addr) + sizeof(Header));
+        m_mapSize = size;
+        return true;
+    }
+
+    template <typename F>
+    bool popAll(F &cb) {
+        uint32_t tail = m_header->tail.load(std::memory_order_relaxed);
+        uint32_t head = m_header->head.load(std::memory_order_acquire);
+        // 对端不可信，序号异常时丢弃所有数据
+        uint32_t n = head - tail;
+        if (n > m_capacity) {
+            m_header->tail.store(head, std::memory_order_release);
+            return false;
+        }
+        if (n == 0) {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < n; i++) {
+            T item = m_slots[(tail + i) & (m_capacity - 1)];
+            cb(item);
+        }
+        m_header->tail.store(head, std::memory_order_release);
+
+        return true;
+    }
+
+    bool spin() const {
+        auto deadline = std::chrono::steady_clock::now() + m_spin;
+        while (std::chrono::steady_clock::now() < deadline) {
+            if (m_header->head.load(std::memory_order_acquire) !=
+                m_header->tail.load(std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+namespace ShmRingHelper {
+
+// 通过 unix socket 传递 fd，携带 1 字节数据
+inline bool sendFds(int sock, const std::vector<int> &fds) {
+    char byte = 0;
+    iovec iov{&byte, sizeof(byte)};
+
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+    ssize_t rc;
+    do {
+        rc = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (rc == -1 && errno == EINTR);
+
+    return rc == 1;
+}
+
+// 阻塞等待对端用 sendFds 发来的 fd，数量不符时全部关闭
+inline std::vector<int> recvFds(int sock, size_t n, int timeoutMs) {
+    pollfd pfd{sock, POLLIN, 0};
+    if (poll(&pfd, 1, timeoutMs) != 1) {
+        return {};
+    }
+
+    char byte;
+    iovec iov{&byte, sizeof(byte)};
+
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * n));
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    ssize_t rc;
+    do {
+        rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (rc == -1 && errno == EINTR);
+    if (rc != 1) {
+        return {};
+    }
+
+    std::vector<int> fds;
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        size_t offset = fds.size();
+        fds.resize(offset + count);
+        memcpy(fds.data() + offset, CMSG_DATA(cmsg), sizeof(int) * count);
+    }
+
+    if (fds.size() != n || (msg.msg_flags & MSG_CTRUNC)) {
+        for (int fd : fds) {
+            close(fd);
+        }
+        return {};
+    }
+
+    return fds;
+}
+
+} // namespace ShmRingHelper
+
+#endif // !UTILS_SHM_RING_H